@@ -0,0 +1,237 @@
+/*
+ * @file capstat.c
+ *
+ * Copyright 2017 zhujiongfu.
+ *
+ * Live view of the hot path histograms of streams captured with --stats:
+ * per stage rate and latency percentiles over the last interval, the
+ * frames skipped for want of a reader, and the readers of the stream
+ * with their drops and lag.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include "capture_stats.h"
+
+#define CAPSTAT_MAX_STREAMS	8
+
+static const char * const stage_names[STAT_NR_STAGES] = {
+	[STAT_DQBUF]	= "dqbuf",
+	[STAT_WAIT]	= "wait",
+	[STAT_COPY]	= "copy",
+	[STAT_PUBLISH]	= "publish",
+	[STAT_REQUEUE]	= "requeue",
+	[STAT_ACQUIRE]	= "acquire",
+	[STAT_HOLD]	= "hold",
+};
+
+struct capstat_stream {
+	const char		*name;
+	struct capture_pool	stats_pool;
+	struct capture_stats	*stats;
+	/* the stream itself, for the readers; optional */
+	struct capture_pool	pool;
+	struct capture_data	*shm;
+	struct capture_hist	last[STAT_NR_STAGES];
+	unsigned int		last_torn;
+	unsigned int		last_skipped;
+};
+
+static volatile sig_atomic_t quit;
+
+static void on_quit(int sig)
+{
+	quit = 1;
+}
+
+/* upper bound of the bucket holding the q-th of count samples */
+static uint64_t hist_quantile(const unsigned int *delta, unsigned int count,
+				double q)
+{
+	unsigned int b, seen = 0, want = count * q;
+
+	for (b = 0; b < STAT_BUCKETS; b++) {
+		seen += delta[b];
+		if (seen > want)
+			return stat_bucket_ns(b + 1);
+	}
+
+	return stat_bucket_ns(STAT_BUCKETS);
+}
+
+static void print_ns(uint64_t ns)
+{
+	if (ns < 10000)
+		printf(" %7lluns", (unsigned long long)ns);
+	else if (ns < 10000000)
+		printf(" %7lluus", (unsigned long long)(ns / 1000));
+	else
+		printf(" %7llums", (unsigned long long)(ns / 1000000));
+}
+
+static void print_stage(struct capstat_stream *s, int stage,
+				unsigned int interval_ms)
+{
+	struct capture_hist *h = &s->stats->hist[stage];
+	struct capture_hist *last = &s->last[stage];
+	unsigned int delta[STAT_BUCKETS];
+	unsigned int count = 0, b, max = 0;
+	unsigned int v;
+
+	for (b = 0; b < STAT_BUCKETS; b++) {
+		v = READ_ONCE(h->buckets[b]);
+		delta[b] = v - last->buckets[b];
+		last->buckets[b] = v;
+		count += delta[b];
+		if (delta[b])
+			max = b;
+	}
+	last->count = READ_ONCE(h->count);
+
+	printf("  %-8s %8.1f/s", stage_names[stage],
+			count * 1000.0 / interval_ms);
+	if (!count) {
+		printf("\n");
+		return;
+	}
+	print_ns(hist_quantile(delta, count, 0.5));
+	print_ns(hist_quantile(delta, count, 0.99));
+	print_ns(hist_quantile(delta, count, 0.999));
+	print_ns(stat_bucket_ns(max + 1));
+	printf("\n");
+}
+
+static void print_readers(struct capture_data *shm)
+{
+	struct capture_reader *r;
+	int i;
+
+	for (i = 0; i < CAPTURE_MAX_READERS; i++) {
+		r = &shm->readers[i];
+		if (READ_ONCE(r->state) != READER_ACTIVE)
+			continue;
+		printf("  reader %d pid %d: frames %u drops %u lost %u lag %u "
+			"latency %uus max %uus%s\n", i, READ_ONCE(r->pid),
+			READ_ONCE(r->frames), READ_ONCE(r->drops),
+			READ_ONCE(r->lost), READ_ONCE(r->lag),
+			READ_ONCE(r->latency_us),
+			READ_ONCE(r->max_latency_us),
+			READ_ONCE(r->lapped) ? " lapped" : "");
+	}
+}
+
+static void print_stream(struct capstat_stream *s, unsigned int interval_ms)
+{
+	unsigned int torn = READ_ONCE(s->stats->torn);
+	unsigned int skipped;
+	int i;
+
+	printf("%s: torn %u", s->name, torn - s->last_torn);
+	s->last_torn = torn;
+	if (s->shm) {
+		skipped = READ_ONCE(s->shm->skipped);
+		printf(" skipped %u", skipped - s->last_skipped);
+		s->last_skipped = skipped;
+	}
+	printf("\n");
+	printf("  %-8s %10s %9s %9s %9s %9s\n", "stage", "rate", "p50",
+			"p99", "p99.9", "max");
+	for (i = 0; i < STAT_NR_STAGES; i++)
+		print_stage(s, i, interval_ms);
+	if (s->shm)
+		print_readers(s->shm);
+}
+
+static int stream_attach(struct capstat_stream *s, const char *name)
+{
+	int i;
+
+	s->name = name;
+	s->stats = capture_stats_attach(&s->stats_pool, name);
+	if (!s->stats) {
+		printf("%s: no stats, is it captured with --stats?\n", name);
+		return -1;
+	}
+	s->shm = capture_pool_attach(&s->pool, name);
+
+	/* only report what happens from now on */
+	for (i = 0; i < STAT_NR_STAGES; i++)
+		memcpy(&s->last[i], &s->stats->hist[i], sizeof(s->last[i]));
+	s->last_torn = READ_ONCE(s->stats->torn);
+	if (s->shm)
+		s->last_skipped = READ_ONCE(s->shm->skipped);
+
+	return 0;
+}
+
+static void stream_detach(struct capstat_stream *s)
+{
+	if (s->shm)
+		capture_pool_detach(&s->pool);
+	capture_pool_detach(&s->stats_pool);
+}
+
+int main(int argc, char **argv)
+{
+	struct capstat_stream streams[CAPSTAT_MAX_STREAMS];
+	unsigned int interval_ms = 1000;
+	struct sigaction sa;
+	int i, n = 0, opt;
+
+	while ((opt = getopt(argc, argv, "i:")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval_ms = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			printf("usage: %s [-i interval ms] [stream...]\n",
+						argv[0]);
+			return -1;
+		}
+	}
+	if (!interval_ms || argc - optind > CAPSTAT_MAX_STREAMS) {
+		printf("bad interval or more than %d streams.\n",
+					CAPSTAT_MAX_STREAMS);
+		return -1;
+	}
+
+	memset(streams, 0, sizeof(streams));
+	if (optind == argc) {
+		if (stream_attach(&streams[n], CAPTURE_DEFAULT_STREAM) == 0)
+			n++;
+	}
+	for (i = optind; i < argc; i++) {
+		if (stream_attach(&streams[n], argv[i]) == 0)
+			n++;
+	}
+	if (!n)
+		return -1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_quit;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	while (!quit) {
+		usleep(interval_ms * 1000);
+		if (quit)
+			break;
+		for (i = 0; i < n; i++)
+			print_stream(&streams[i], interval_ms);
+		printf("\n");
+	}
+
+	for (i = 0; i < n; i++)
+		stream_detach(&streams[i]);
+
+	return 0;
+}
@@ -0,0 +1,1900 @@
+/*
+ * @file capture_bench.c
+ *
+ * Copyright 2017 zhujiongfu.
+ *
+ * Micro benchmarks for the capture -> shm publish path.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include <unistd.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/sem.h>
+#include <sys/wait.h>
+#include "v4l2_capture.h"
+#include <sys/shm.h>
+#include "capture_export.h"
+#include "capture_loop.h"
+#include "capture_pool.h"
+#include "capture_publish.h"
+#include "copy_kernel.h"
+#include "copy_pool.h"
+#include "libcapture.h"
+#include "capture_record.h"
+#include "capture_stats.h"
+#include "pixconv.h"
+#include "scaler.h"
+
+#define BENCH_FRAMES	2000
+#define BENCH_WIDTH	640
+#define BENCH_HEIGHT	480
+/* NV12 */
+#define BENCH_SIZEIMAGE	(BENCH_WIDTH * BENCH_HEIGHT * 3 / 2)
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static struct capture_data *bench_alloc_ring(unsigned int cnt,
+				unsigned int sizeimage)
+{
+	struct capture_data *shm;
+	size_t size;
+
+	size = capture_data_size(cnt) + capture_slot_size(sizeimage) * cnt;
+	shm = aligned_alloc(4096, ALIGN(size, 4096));
+	if (!shm)
+		return NULL;
+	memset(shm, 0, size);
+	ring_init(shm, cnt, sizeimage);
+
+	return shm;
+}
+
+/*
+ * The old two slot handoff: buf_flag guarded by a SysV semaphore,
+ * four semop() per frame.
+ */
+struct legacy_shm {
+	unsigned int		buf_flag;
+	unsigned int		last_in;
+	int			sem_id;
+};
+
+static void legacy_sem_op(int sem_id, int op)
+{
+	struct sembuf sb;
+
+	sb.sem_num = 0;
+	sb.sem_op = op;
+	sb.sem_flg = SEM_UNDO;
+	while (semop(sem_id, &sb, 1) < 0)
+		perror("semop");
+}
+
+static void legacy_put(struct legacy_shm *shm, char *shb,
+				const char *src, unsigned int size)
+{
+	unsigned int in;
+
+	legacy_sem_op(shm->sem_id, -1);
+	switch (shm->buf_flag) {
+	case 0x0:
+	case 0x2:
+		in = BIT(0);
+		break;
+	case 0x1:
+		in = BIT(1);
+		break;
+	default:
+		in = shm->last_in;
+		shm->buf_flag &= ~(shm->last_in);
+	}
+	legacy_sem_op(shm->sem_id, 1);
+	memcpy(shb + size * (in - 1), src, size);
+
+	legacy_sem_op(shm->sem_id, -1);
+	shm->buf_flag |= in;
+	shm->last_in = in;
+	legacy_sem_op(shm->sem_id, 1);
+}
+
+static double bench_legacy(const char *src, unsigned int size)
+{
+	struct legacy_shm shm;
+	char *shb;
+	uint64_t t;
+	int i;
+
+	shb = malloc((size_t)size * 2);
+	if (!shb)
+		return -1;
+	memset(&shm, 0, sizeof(shm));
+	shm.sem_id = semget(IPC_PRIVATE, 1, 0600 | IPC_CREAT);
+	if (shm.sem_id < 0) {
+		perror("semget");
+		free(shb);
+		return -1;
+	}
+	semctl(shm.sem_id, 0, SETVAL, 1);
+
+	t = now_ns();
+	for (i = 0; i < BENCH_FRAMES; i++)
+		legacy_put(&shm, shb, src, size);
+	t = now_ns() - t;
+
+	semctl(shm.sem_id, 0, IPC_RMID);
+	free(shb);
+
+	return (double)t / BENCH_FRAMES;
+}
+
+static double bench_ring(const char *src, unsigned int size,
+				unsigned int cnt)
+{
+	struct capture_data *shm;
+	uint64_t t;
+	int i;
+
+	shm = bench_alloc_ring(cnt, size);
+	if (!shm)
+		return -1;
+
+	t = now_ns();
+	for (i = 0; i < BENCH_FRAMES; i++) {
+		memcpy(ring_write_begin(shm), src, size);
+		ring_write_end(shm, NULL);
+	}
+	t = now_ns() - t;
+
+	free(shm);
+
+	return (double)t / BENCH_FRAMES;
+}
+
+static int cmd_ring(int argc, char **argv)
+{
+	unsigned int sizes[] = { 0, BENCH_SIZEIMAGE };
+	char *src;
+	unsigned int i;
+
+	src = malloc(BENCH_SIZEIMAGE);
+	if (!src)
+		return -1;
+	memset(src, 0x5a, BENCH_SIZEIMAGE);
+
+	printf("%-10s %10s %14s\n", "path", "bytes", "ns/frame");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		printf("%-10s %10u %14.1f\n", "semaphore", sizes[i],
+					bench_legacy(src, sizes[i]));
+		printf("%-10s %10u %14.1f\n", "ring/2", sizes[i],
+					bench_ring(src, sizes[i], 2));
+		printf("%-10s %10u %14.1f\n", "ring/8", sizes[i],
+					bench_ring(src, sizes[i], 8));
+	}
+
+	free(src);
+	return 0;
+}
+
+struct bench_reader {
+	pthread_t		tid;
+	struct capture_data	*shm;
+	struct capture_reader	*r;
+	volatile int		*stop;
+	char			*buf;
+};
+
+static void *bench_reader_fn(void *arg)
+{
+	struct bench_reader *br = arg;
+	unsigned int frame;
+
+	while (!*br->stop) {
+		if (ring_read_begin(br->shm, br->r, &frame) < 0) {
+			usleep(1000);
+			continue;
+		}
+		memcpy(br->buf, capture_slot_buf(br->shm, frame),
+					br->shm->sizeimage);
+		ring_read_end(br->shm, br->r, frame);
+	}
+
+	return NULL;
+}
+
+static uint64_t thread_cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Producer CPU and wall time per frame with n synthetic readers attached,
+ * and with stuck, one more block-producer reader that never reads: it
+ * may hold the producer back once, for CAPTURE_BLOCK_US, not every frame.
+ */
+static int bench_readers(unsigned int n, bool stuck, const char *src,
+				unsigned int size)
+{
+	struct capture_reader *sr = NULL;
+	struct bench_reader *br;
+	struct capture_data *shm;
+	volatile int stop = 0;
+	unsigned int frames = 0, drops = 0, lag = 0;
+	uint64_t t, wall, w, max_wait = 0;
+	unsigned int i;
+	char name[16];
+
+	shm = bench_alloc_ring(8, size);
+	br = calloc(n, sizeof(*br));
+	if (!shm || !br)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		br[i].shm = shm;
+		br[i].stop = &stop;
+		br[i].buf = malloc(size);
+		br[i].r = reader_attach(shm, i & 1 ? READER_LATEST_ONLY :
+					READER_DROP_OLDEST);
+		if (!br[i].r || !br[i].buf)
+			return -1;
+		pthread_create(&br[i].tid, NULL, bench_reader_fn, &br[i]);
+	}
+	if (stuck) {
+		sr = reader_attach(shm, READER_BLOCK_PRODUCER);
+		if (!sr)
+			return -1;
+	}
+
+	t = thread_cpu_ns();
+	wall = now_ns();
+	for (i = 0; i < BENCH_FRAMES; i++) {
+		w = now_ns();
+		memcpy(ring_write_begin(shm), src, size);
+		w = now_ns() - w;
+		if (w > max_wait)
+			max_wait = w;
+		ring_write_end(shm, NULL);
+		if ((i & 15) == 0)
+			sched_yield();
+	}
+	wall = now_ns() - wall;
+	t = thread_cpu_ns() - t;
+
+	stop = 1;
+	for (i = 0; i < n; i++) {
+		pthread_join(br[i].tid, NULL);
+		frames += br[i].r->frames;
+		drops += br[i].r->drops;
+		if (br[i].r->lag > lag)
+			lag = br[i].r->lag;
+		reader_detach(shm, br[i].r);
+		free(br[i].buf);
+	}
+	if (sr)
+		reader_detach(shm, sr);
+
+	snprintf(name, sizeof(name), "%u%s", n, stuck ? "+stuck" : "");
+	printf("%8s %14.1f %12.1f %12.1f %12u %12u %8u %7u\n", name,
+			(double)t / BENCH_FRAMES, (double)wall / BENCH_FRAMES,
+			max_wait / 1000.0, frames, drops, lag, shm->stalls);
+
+	free(br);
+	free(shm);
+	return 0;
+}
+
+static int cmd_readers(int argc, char **argv)
+{
+	unsigned int counts[] = { 1, 4, 16 };
+	unsigned int size = 64 * 1024;
+	char *src;
+	unsigned int i;
+
+	src = malloc(size);
+	if (!src)
+		return -1;
+	memset(src, 0x5a, size);
+
+	printf("%8s %14s %12s %12s %12s %12s %8s %7s\n", "readers",
+			"producer ns", "wall ns", "max wait us", "frames read",
+			"drops", "max lag", "stalls");
+	for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+		bench_readers(counts[i], false, src, size);
+	bench_readers(4, true, src, size);
+
+	free(src);
+	return 0;
+}
+
+#define WAKE_FRAMES	200
+#define WAKE_PERIOD_US	5000
+
+enum { WAKE_POLL, WAKE_FUTEX, WAKE_EVENTFD };
+
+struct wake_bench {
+	struct capture_data	*shm;
+	uint64_t		pub_ns[WAKE_FRAMES];
+};
+
+static void *wake_producer_fn(void *arg)
+{
+	struct wake_bench *wb = arg;
+	unsigned int i;
+
+	for (i = 0; i < WAKE_FRAMES; i++) {
+		usleep(WAKE_PERIOD_US);
+		ring_write_begin(wb->shm);
+		wb->pub_ns[i] = now_ns();
+		ring_write_end(wb->shm, NULL);
+	}
+
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void bench_wakeup(const char *name, int mode)
+{
+	struct capture_notifier notifier;
+	struct capture_reader *r;
+	struct wake_bench wb;
+	struct pollfd pfd;
+	uint64_t lat[WAKE_FRAMES];
+	uint64_t cnt;
+	unsigned int frame, n = 0;
+	pthread_t tid;
+
+	wb.shm = bench_alloc_ring(4, 4096);
+	if (!wb.shm)
+		return;
+	r = reader_attach(wb.shm, READER_DROP_OLDEST);
+	if (mode == WAKE_EVENTFD) {
+		pfd.fd = capture_notifier_start(&notifier, wb.shm);
+		pfd.events = POLLIN;
+	}
+
+	pthread_create(&tid, NULL, wake_producer_fn, &wb);
+	while (n < WAKE_FRAMES) {
+		if (ring_read_begin(wb.shm, r, &frame) < 0) {
+			if (mode == WAKE_POLL)
+				usleep(10000);
+			else if (mode == WAKE_FUTEX)
+				ring_wait(wb.shm, r, 1000);
+			else if (poll(&pfd, 1, 1000) > 0)
+				read(pfd.fd, &cnt, sizeof(cnt));
+			continue;
+		}
+		lat[n++] = now_ns() - wb.pub_ns[frame];
+		ring_read_end(wb.shm, r, frame);
+		if (frame == WAKE_FRAMES - 1)
+			break;
+	}
+	pthread_join(tid, NULL);
+	if (mode == WAKE_EVENTFD)
+		capture_notifier_stop(&notifier);
+
+	qsort(lat, n, sizeof(lat[0]), cmp_u64);
+	printf("%-8s %8u %10.1f %10.1f %10.1f\n", name, n,
+			lat[n / 2] / 1000.0, lat[n * 99 / 100] / 1000.0,
+			lat[n - 1] / 1000.0);
+
+	reader_detach(wb.shm, r);
+	free(wb.shm);
+}
+
+static int cmd_wakeup(int argc, char **argv)
+{
+	printf("%-8s %8s %10s %10s %10s\n", "wakeup", "frames",
+				"p50 us", "p99 us", "max us");
+	bench_wakeup("poll", WAKE_POLL);
+	bench_wakeup("futex", WAKE_FUTEX);
+	bench_wakeup("eventfd", WAKE_EVENTFD);
+
+	return 0;
+}
+
+#define EXPORT_BUFS	4
+#define EXPORT_FRAMES	500
+#define EXPORT_SOCK	"/tmp/capture-bench-export.sock"
+
+/* consumer process: lease every frame it can get and check its contents */
+static void export_consumer(struct capture_data *shm, int result_fd)
+{
+	struct capture_reader *r;
+	unsigned int res[3] = { 0, 0, 0 };
+	unsigned int cnt, length;
+	unsigned int frame;
+	int fds[CAPTURE_MAX_BUFS];
+	unsigned int *maps[CAPTURE_MAX_BUFS];
+	unsigned int i;
+	int buf;
+
+	if (export_connect(EXPORT_SOCK, fds, &cnt, &length) < 0)
+		_exit(1);
+	for (i = 0; i < cnt; i++)
+		maps[i] = mmap(NULL, length, PROT_READ, MAP_SHARED, fds[i], 0);
+	r = reader_attach(shm, READER_DROP_OLDEST);
+	write(result_fd, res, sizeof(res));
+
+	for (;;) {
+		buf = export_acquire(shm, r, &frame, NULL);
+		if (buf < 0) {
+			if (ring_wait(shm, r, 200) == -ETIMEDOUT)
+				break;
+			continue;
+		}
+		if (maps[buf][0] == frame)
+			res[0]++;
+		else
+			res[1]++;
+		export_release(shm, r, buf);
+		if (frame == EXPORT_FRAMES - 1)
+			break;
+	}
+	res[2] = r->drops;
+	reader_detach(shm, r);
+	write(result_fd, res, sizeof(res));
+	_exit(0);
+}
+
+/*
+ * Publish from a memfd stand-in source the way export mode does it,
+ * with a second process leasing the buffers through the fds it got over
+ * the socket.
+ */
+static int cmd_export(int argc, char **argv)
+{
+	struct capture_data *shm;
+	unsigned int size = BENCH_SIZEIMAGE;
+	unsigned int res[3];
+	unsigned int free_mask = 0;
+	unsigned int *bufs[EXPORT_BUFS];
+	int fds[EXPORT_BUFS];
+	int pipefd[2];
+	int latest = -1;
+	int listen_fd;
+	uint64_t t = 0, t0;
+	unsigned int i, b;
+	pid_t pid;
+
+	shm = mmap(NULL, capture_data_size(4), PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shm == MAP_FAILED)
+		return -1;
+	ring_init(shm, 4, size);
+	shm->flags |= CAPTURE_F_EXPORT;
+	shm->export_cnt = EXPORT_BUFS;
+	for (i = 0; i < EXPORT_BUFS; i++) {
+		fds[i] = memfd_alloc(size, (void **)&bufs[i]);
+		if (fds[i] < 0)
+			return -1;
+	}
+	free_mask = BIT(EXPORT_BUFS) - 1;
+
+	listen_fd = export_listen(EXPORT_SOCK);
+	if (listen_fd < 0 || pipe(pipefd) < 0)
+		return -1;
+	pid = fork();
+	if (pid == 0)
+		export_consumer(shm, pipefd[1]);
+
+	while (export_serve(listen_fd, fds, EXPORT_BUFS, size) == 0)
+		usleep(1000);
+	read(pipefd[0], res, sizeof(res));
+
+	for (i = 0; i < EXPORT_BUFS; i++)
+		memset(bufs[i], 0, size);
+
+	for (i = 0; i < EXPORT_FRAMES; i++) {
+		free_mask |= export_reclaim(shm);
+		if (!free_mask) {
+			usleep(100);
+			i--;
+			continue;
+		}
+		b = __builtin_ctz(free_mask);
+		free_mask &= ~BIT(b);
+		/* the "DMA" of the stand-in source */
+		bufs[b][0] = shm->in;
+
+		t0 = now_ns();
+		export_buf_done(shm, b);
+		export_publish(shm, b, NULL, &latest);
+		t += now_ns() - t0;
+		usleep(500);
+	}
+
+	read(pipefd[0], res, sizeof(res));
+	waitpid(pid, NULL, 0);
+	close(listen_fd);
+	unlink(EXPORT_SOCK);
+
+	printf("%-10s %10s %14s %8s %8s %8s\n", "path", "bytes", "ns/frame",
+				"ok", "bad", "drops");
+	printf("%-10s %10u %14.1f %8u %8u %8u\n", "export", size,
+				(double)t / EXPORT_FRAMES, res[0], res[1], res[2]);
+	printf("%-10s %10u %14.1f\n", "copy", size, bench_ring((char *)bufs[0],
+				size, 4));
+
+	return res[1] ? -1 : 0;
+}
+
+#define POOL_SLOTS	8
+#define POOL_PASSES	20
+/* 1080p NV12 */
+#define POOL_SIZEIMAGE	(1920 * 1080 * 3 / 2)
+
+static void bench_pool_copy(const char *name, char *base, uint64_t create_ns,
+				const char *src)
+{
+	uint64_t cold, steady;
+	unsigned int i, j;
+	size_t slot = capture_slot_size(POOL_SIZEIMAGE);
+	double bytes = (double)POOL_SLOTS * POOL_SIZEIMAGE;
+
+	cold = now_ns();
+	for (i = 0; i < POOL_SLOTS; i++)
+		memcpy(base + slot * i, src, POOL_SIZEIMAGE);
+	cold = now_ns() - cold;
+
+	steady = now_ns();
+	for (j = 0; j < POOL_PASSES; j++)
+		for (i = 0; i < POOL_SLOTS; i++)
+			memcpy(base + slot * i, src, POOL_SIZEIMAGE);
+	steady = (now_ns() - steady) / POOL_PASSES;
+
+	printf("%-14s %12.2f %12.2f %12.2f\n", name, create_ns / 1e6,
+			bytes / cold, bytes / steady);
+}
+
+static void bench_pool(const char *name, unsigned int flags, const char *src)
+{
+	struct capture_pool pool;
+	size_t size = capture_slot_size(POOL_SIZEIMAGE) * POOL_SLOTS;
+	uint64_t t;
+	char *base;
+
+	t = now_ns();
+	base = capture_pool_create(&pool, "bench", size, flags);
+	t = now_ns() - t;
+	if (!base)
+		return;
+	bench_pool_copy(name, base, t, src);
+	capture_pool_destroy(&pool);
+}
+
+/* Cold start and steady copy bandwidth: shmget vs the frame pool. */
+static int cmd_pool(int argc, char **argv)
+{
+	size_t size = capture_slot_size(POOL_SIZEIMAGE) * POOL_SLOTS;
+	uint64_t t;
+	char *src;
+	char *base;
+	int id;
+
+	src = malloc(POOL_SIZEIMAGE);
+	if (!src)
+		return -1;
+	memset(src, 0x5a, POOL_SIZEIMAGE);
+
+	printf("%-14s %12s %12s %12s\n", "pool", "create ms",
+				"cold GB/s", "steady GB/s");
+
+	t = now_ns();
+	id = shmget(IPC_PRIVATE, size, 0600 | IPC_CREAT);
+	base = id < 0 ? (void *)-1 : shmat(id, NULL, 0);
+	t = now_ns() - t;
+	if (base != (void *)-1) {
+		bench_pool_copy("shmget", base, t, src);
+		shmdt(base);
+	}
+	if (id >= 0)
+		shmctl(id, IPC_RMID, NULL);
+
+	bench_pool("shm", 0, src);
+	bench_pool("shm+populate", POOL_F_POPULATE, src);
+	bench_pool("huge+populate", POOL_F_HUGETLB | POOL_F_POPULATE, src);
+
+	free(src);
+	return 0;
+}
+
+#define COPY_RING	8
+
+/*
+ * Bandwidth of every copy kernel this CPU supports, VGA to 1080p. Source
+ * and destination rotate through COPY_RING frames each so that, like a
+ * freshly DMA'd V4L2 buffer, the source is not already in the cache.
+ */
+static int cmd_copy(int argc, char **argv)
+{
+	static const struct {
+		const char	*name;
+		unsigned int	size;
+	} frames[] = {
+		{ "vga-nv12", 640 * 480 * 3 / 2 },
+		{ "vga-yuyv", 640 * 480 * 2 },
+		{ "720p-nv12", 1280 * 720 * 3 / 2 },
+		{ "uxga-nv12", 1600 * 1200 * 3 / 2 },
+		{ "1080p-nv12", 1920 * 1080 * 3 / 2 },
+		{ "1080p-yuyv", 1920 * 1080 * 2 },
+	};
+	size_t max = capture_slot_size(1920 * 1080 * 2);
+	unsigned int i, k, j, passes;
+	char *src, *dst;
+	size_t slot;
+	uint64_t t;
+
+	src = aligned_alloc(CAPTURE_PAGE_SIZE, max * COPY_RING);
+	dst = aligned_alloc(CAPTURE_PAGE_SIZE, max * COPY_RING);
+	if (!src || !dst)
+		return -1;
+	memset(src, 0x5a, max * COPY_RING);
+	memset(dst, 0, max * COPY_RING);
+
+	printf("%-12s", "frame");
+	for (k = 0; k < NR_COPY_KERNELS; k++)
+		if (copy_kernels[k].supported())
+			printf(" %10s", copy_kernels[k].name);
+	printf("   (GB/s)\n");
+
+	for (i = 0; i < sizeof(frames) / sizeof(frames[0]); i++) {
+		slot = capture_slot_size(frames[i].size);
+		passes = 512 * 1024 * 1024 / frames[i].size;
+		printf("%-12s", frames[i].name);
+		for (k = 0; k < NR_COPY_KERNELS; k++) {
+			if (!copy_kernels[k].supported())
+				continue;
+			t = now_ns();
+			for (j = 0; j < passes; j++)
+				copy_kernels[k].fn(dst + slot * (j % COPY_RING),
+					src + slot * ((j * 3) % COPY_RING),
+					frames[i].size);
+			t = now_ns() - t;
+			printf(" %10.2f", (double)frames[i].size * passes / t);
+		}
+		printf("\n");
+	}
+
+	free(src);
+	free(dst);
+	return 0;
+}
+
+/* Striped copy throughput with 1 to 4 threads. */
+static int cmd_stripe(int argc, char **argv)
+{
+	static const struct {
+		const char	*name;
+		unsigned int	width;
+		unsigned int	height;
+	} frames[] = {
+		{ "vga-nv12", 640, 480 },
+		{ "720p-nv12", 1280, 720 },
+		{ "uxga-nv12", 1600, 1200 },
+		{ "1080p-nv12", 1920, 1080 },
+	};
+	const struct copy_kernel *k = copy_kernel_select(NULL);
+	size_t max = capture_slot_size(1920 * 1080 * 3 / 2);
+	struct copy_pool pool;
+	unsigned int i, n, j, passes, size;
+	char *src, *dst;
+	uint64_t t;
+
+	src = aligned_alloc(CAPTURE_PAGE_SIZE, max * COPY_RING);
+	dst = aligned_alloc(CAPTURE_PAGE_SIZE, max * COPY_RING);
+	if (!src || !dst)
+		return -1;
+	memset(src, 0x5a, max * COPY_RING);
+	memset(dst, 0, max * COPY_RING);
+
+	printf("kernel %s, %ld cpus\n", k->name, sysconf(_SC_NPROCESSORS_ONLN));
+	printf("%-12s %10s %10s %10s %10s   (GB/s)\n", "frame", "1 thread",
+				"2 threads", "3 threads", "4 threads");
+	for (i = 0; i < sizeof(frames) / sizeof(frames[0]); i++) {
+		size = frames[i].width * frames[i].height * 3 / 2;
+		passes = 256 * 1024 * 1024 / size;
+		printf("%-12s", frames[i].name);
+		for (n = 1; n <= COPY_POOL_MAX; n++) {
+			copy_pool_init(&pool, n, k->fn, sched_getcpu());
+			/* measure the split itself, even for small frames */
+			pool.min_split = 0;
+			t = now_ns();
+			for (j = 0; j < passes; j++)
+				copy_pool_run(&pool,
+					dst + max * (j % COPY_RING),
+					src + max * ((j * 3) % COPY_RING),
+					size, frames[i].width);
+			t = now_ns() - t;
+			copy_pool_exit(&pool);
+			printf(" %10.2f", (double)size * passes / t);
+		}
+		printf("\n");
+	}
+
+	free(src);
+	free(dst);
+	return 0;
+}
+
+#define MULTI_MAX	4
+#define MULTI_FRAMES	100
+#define MULTI_PERIOD_US	10000
+#define MULTI_SIZEIMAGE	(1280 * 720 * 3 / 2)
+
+/* a synthetic camera: a timerfd stands in for the V4L2 fd */
+struct bench_cam {
+	pthread_t		tid;
+	unsigned int		id;
+	struct capture_pool	pool;
+	struct capture_data	*shm;
+	const struct copy_kernel *copy;
+	char			*src;
+	unsigned int		frames;
+	uint64_t		start_ns;
+	uint64_t		cpu_ns;
+	uint64_t		jitter_ns[MULTI_FRAMES];
+	struct capture_loop	loop;
+	struct loop_source	timer;
+};
+
+static void bench_cam_frame(struct loop_source *src, uint32_t events)
+{
+	struct bench_cam *cam = src->data;
+	uint64_t due, t;
+
+	loop_timer_ack(src);
+	t = now_ns();
+	due = cam->start_ns + (uint64_t)(cam->frames + 1) *
+					MULTI_PERIOD_US * 1000;
+	cam->copy->fn(ring_write_begin(cam->shm), cam->src +
+			capture_slot_size(MULTI_SIZEIMAGE) *
+			(cam->frames % COPY_RING), MULTI_SIZEIMAGE);
+	ring_write_end(cam->shm, NULL);
+	cam->jitter_ns[cam->frames] = t > due ? t - due : due - t;
+	if (++cam->frames == MULTI_FRAMES)
+		cam->loop.stop = 1;
+}
+
+static void *bench_cam_fn(void *arg)
+{
+	struct bench_cam *cam = arg;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t set;
+	uint64_t t;
+
+	CPU_ZERO(&set);
+	CPU_SET(cam->id % ncpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+	capture_loop_init(&cam->loop);
+	cam->start_ns = now_ns();
+	loop_add_timer(&cam->loop, &cam->timer, MULTI_PERIOD_US,
+				bench_cam_frame, cam);
+	cam->timer.urgent = true;
+	t = thread_cpu_ns();
+	capture_loop_run(&cam->loop);
+	cam->cpu_ns = thread_cpu_ns() - t;
+	loop_close(&cam->loop, &cam->timer);
+	capture_loop_exit(&cam->loop);
+
+	return NULL;
+}
+
+static int bench_multi(unsigned int n, const struct copy_kernel *k)
+{
+	struct bench_cam *cams;
+	uint64_t *jitter;
+	uint64_t cpu = 0;
+	char name[16];
+	size_t size, slot = capture_slot_size(MULTI_SIZEIMAGE);
+	unsigned int i, cnt = 0;
+	int ret = -1;
+
+	cams = calloc(n, sizeof(*cams));
+	jitter = malloc(n * MULTI_FRAMES * sizeof(*jitter));
+	if (!cams || !jitter)
+		goto out;
+
+	size = capture_data_size(4) + slot * 4;
+	for (i = 0; i < n; i++) {
+		cams[i].id = i;
+		cams[i].copy = k;
+		snprintf(name, sizeof(name), "bench-multi%u", i);
+		cams[i].shm = capture_pool_create(&cams[i].pool, name, size,
+					POOL_F_POPULATE);
+		cams[i].src = aligned_alloc(CAPTURE_PAGE_SIZE,
+					slot * COPY_RING);
+		if (!cams[i].shm || !cams[i].src)
+			goto out;
+		ring_init(cams[i].shm, 4, MULTI_SIZEIMAGE);
+		memset(cams[i].src, 0x5a + i, slot * COPY_RING);
+	}
+
+	for (i = 0; i < n; i++)
+		pthread_create(&cams[i].tid, NULL, bench_cam_fn, &cams[i]);
+	for (i = 0; i < n; i++) {
+		pthread_join(cams[i].tid, NULL);
+		cpu += cams[i].cpu_ns;
+		memcpy(jitter + cnt, cams[i].jitter_ns,
+				cams[i].frames * sizeof(*jitter));
+		cnt += cams[i].frames;
+	}
+
+	qsort(jitter, cnt, sizeof(*jitter), cmp_u64);
+	printf("%8u %14.1f %14.1f %12.1f %12.1f\n", n,
+			(double)cpu / cnt / 1000,
+			(double)cpu / (MULTI_FRAMES * MULTI_PERIOD_US) / 10,
+			jitter[cnt / 2] / 1000.0, jitter[cnt * 99 / 100] / 1000.0);
+	ret = 0;
+out:
+	for (i = 0; cams && i < n; i++) {
+		free(cams[i].src);
+		if (cams[i].shm)
+			capture_pool_destroy(&cams[i].pool);
+	}
+	free(jitter);
+	free(cams);
+	return ret;
+}
+
+/*
+ * 1 to 4 synthetic 720p cameras at 100 fps, each on its own pinned
+ * thread and loop the way the daemon runs them. Per frame CPU should
+ * stay flat and total CPU grow linearly, with no jitter from the others.
+ */
+static int cmd_multi(int argc, char **argv)
+{
+	const struct copy_kernel *k = copy_kernel_select(NULL);
+	unsigned int n;
+
+	printf("kernel %s, %ld cpus\n", k->name, sysconf(_SC_NPROCESSORS_ONLN));
+	printf("%8s %14s %14s %12s %12s\n", "cameras", "us/frame",
+				"cpu %", "jitter p50", "jitter p99");
+	for (n = 1; n <= MULTI_MAX; n++)
+		if (bench_multi(n, k) < 0)
+			return -1;
+
+	return 0;
+}
+
+#define PIXCONV_PASSES	50
+
+static const struct {
+	const char	*name;
+	uint32_t	fourcc;
+} pixconv_ins[] = {
+	{ "yuyv", V4L2_PIX_FMT_YUYV },
+	{ "nv12", V4L2_PIX_FMT_NV12 },
+	{ "nv21", V4L2_PIX_FMT_NV21 },
+	{ "i420", V4L2_PIX_FMT_YUV420 },
+};
+
+static const char *pixconv_outs[] = { "rgb32", "bgr24", "rgb565" };
+
+/* planes of a packed w x h frame at base, like capture_fill_planes() */
+static void pixconv_planes(uint32_t fourcc, uint8_t *base, unsigned int w,
+				unsigned int h, const uint8_t *plane[3],
+				unsigned int stride[3])
+{
+	plane[0] = base;
+	stride[0] = fourcc == V4L2_PIX_FMT_YUYV ? w * 2 : w;
+	plane[1] = base + w * h;
+	stride[1] = fourcc == V4L2_PIX_FMT_YUV420 ? w / 2 : w;
+	plane[2] = plane[1] + (w / 2) * ((h + 1) / 2);
+	stride[2] = w / 2;
+}
+
+/*
+ * Every kernel against the C reference for every format, matrix and
+ * range, on a 720p frame and on an odd sized one that exercises the
+ * tails. Returns the number of mismatching combinations.
+ */
+static int pixconv_check(const struct pixconv_kernel *k, uint8_t *src,
+				uint8_t *ref, uint8_t *out)
+{
+	static const unsigned int sizes[][2] = { { 1280, 720 }, { 646, 363 } };
+	struct pixconv pc, pr;
+	const uint8_t *plane[3];
+	unsigned int stride[3];
+	unsigned int i, o, m, s, w, h;
+	int bad = 0;
+
+	for (i = 0; i < sizeof(pixconv_ins) / sizeof(pixconv_ins[0]); i++)
+	for (o = PIXCONV_RGB32; o <= PIXCONV_RGB565; o++)
+	for (m = 0; m < 4; m++)
+	for (s = 0; s < 2; s++) {
+		w = sizes[s][0];
+		h = sizes[s][1];
+		pixconv_planes(pixconv_ins[i].fourcc, src, w, h, plane, stride);
+		pixconv_init(&pr, pixconv_ins[i].fourcc, o, m >> 1, m & 1, "c");
+		pixconv_init(&pc, pixconv_ins[i].fourcc, o, m >> 1, m & 1,
+					k->name);
+		pixconv_frame(&pr, ref, w * pr.bpp, plane, stride, w, h);
+		pixconv_frame(&pc, out, w * pc.bpp, plane, stride, w, h);
+		if (memcmp(ref, out, (size_t)w * h * pc.bpp)) {
+			printf("%s: %s -> %s bt%s %s range %ux%u differs\n",
+				k->name, pixconv_ins[i].name, pixconv_outs[o],
+				m >> 1 ? "709" : "601", m & 1 ? "full" : "limited",
+				w, h);
+			bad++;
+		}
+	}
+
+	return bad;
+}
+
+/*
+ * ms per 720p frame for each kernel and format pair, after checking
+ * that each kernel is bit-exact against the C reference.
+ */
+static int cmd_pixconv(int argc, char **argv)
+{
+	size_t size = 1280 * 720 * 4;
+	struct pixconv pc;
+	const uint8_t *plane[3];
+	unsigned int stride[3];
+	unsigned int i, o, k, j;
+	uint8_t *src, *ref, *out;
+	uint64_t t;
+	int bad = 0;
+
+	src = malloc(size);
+	ref = malloc(size);
+	out = malloc(size);
+	if (!src || !ref || !out)
+		return -1;
+	srand(1);
+	for (j = 0; j < size; j++)
+		src[j] = rand();
+
+	for (k = 0; k < NR_PIXCONV_KERNELS; k++) {
+		if (!pixconv_kernels[k].supported())
+			continue;
+		bad += pixconv_check(&pixconv_kernels[k], src, ref, out);
+	}
+	printf("bit-exact: %s\n", bad ? "NO" : "yes");
+
+	printf("%-16s", "720p");
+	for (k = 0; k < NR_PIXCONV_KERNELS; k++)
+		if (pixconv_kernels[k].supported())
+			printf(" %8s", pixconv_kernels[k].name);
+	printf("   (ms/frame)\n");
+
+	for (i = 0; i < sizeof(pixconv_ins) / sizeof(pixconv_ins[0]); i++) {
+		for (o = PIXCONV_RGB32; o <= PIXCONV_RGB565; o++) {
+			printf("%5s -> %-7s", pixconv_ins[i].name,
+						pixconv_outs[o]);
+			for (k = 0; k < NR_PIXCONV_KERNELS; k++) {
+				if (!pixconv_kernels[k].supported())
+					continue;
+				pixconv_init(&pc, pixconv_ins[i].fourcc, o,
+					PIXCONV_BT601, false,
+					pixconv_kernels[k].name);
+				pixconv_planes(pc.fourcc, src, 1280, 720,
+					plane, stride);
+				t = now_ns();
+				for (j = 0; j < PIXCONV_PASSES; j++)
+					pixconv_frame(&pc, out, 1280 * pc.bpp,
+						plane, stride, 1280, 720);
+				t = now_ns() - t;
+				printf(" %8.3f", t / 1e6 / PIXCONV_PASSES);
+			}
+			printf("\n");
+		}
+	}
+
+	free(src);
+	free(ref);
+	free(out);
+	return bad ? -1 : 0;
+}
+
+#define SCALE_PASSES	20
+
+static const struct {
+	const char	*name;
+	uint32_t	fourcc;
+	unsigned int	src_w, src_h, dst_w, dst_h;
+} scale_cases[] = {
+	{ "rgb32 vga->800x480", V4L2_PIX_FMT_XBGR32, 640, 480, 800, 480 },
+	{ "rgb32 720p->800x480", V4L2_PIX_FMT_XBGR32, 1280, 720, 800, 480 },
+	{ "nv12 1080p->720p", V4L2_PIX_FMT_NV12, 1920, 1080, 1280, 720 },
+	{ "nv12 1080p->vga", V4L2_PIX_FMT_NV12, 1920, 1080, 640, 480 },
+	{ "nv12 vga->1080p", V4L2_PIX_FMT_NV12, 640, 480, 1920, 1080 },
+};
+
+/* a packed frame at base with all planes, returns its size */
+static size_t scale_planes(uint32_t fourcc, uint8_t *base, unsigned int w,
+				unsigned int h, uint8_t *plane[3],
+				unsigned int stride[3])
+{
+	unsigned int cpp = 1, n = 1;
+
+	scaler_layout(fourcc, &cpp, &n);
+	plane[0] = base;
+	stride[0] = w * cpp;
+	plane[1] = base + (size_t)w * h * cpp;
+	stride[1] = n == 2 ? w : w / 2;
+	plane[2] = plane[1] + (size_t)(w / 2) * (h / 2);
+	stride[2] = w / 2;
+
+	return n == 1 ? (size_t)w * h * cpp : (size_t)w * h * 3 / 2;
+}
+
+static double scale_run(struct scaler *sc, unsigned int i, uint8_t *src,
+				uint8_t *dst)
+{
+	uint8_t *sp[3], *dp[3];
+	unsigned int ss[3], ds[3];
+	unsigned int j;
+	uint64_t t;
+
+	scale_planes(scale_cases[i].fourcc, src, scale_cases[i].src_w,
+				scale_cases[i].src_h, sp, ss);
+	scale_planes(scale_cases[i].fourcc, dst, scale_cases[i].dst_w,
+				scale_cases[i].dst_h, dp, ds);
+	t = now_ns();
+	for (j = 0; j < SCALE_PASSES; j++)
+		scaler_run(sc, (const uint8_t *const *)sp, ss, dp, ds);
+	t = now_ns() - t;
+
+	/* output megapixels per second */
+	return (double)scale_cases[i].dst_w * scale_cases[i].dst_h *
+				SCALE_PASSES * 1000 / t;
+}
+
+/*
+ * Output MP/s of each filter and vertical kernel, on one thread and in
+ * COPY_POOL_MAX bands, after checking every kernel against C.
+ */
+static int cmd_scale(int argc, char **argv)
+{
+	static const char *filters[] = { "bilinear", "area" };
+	size_t max = 1920 * 1080 * 4;
+	struct copy_pool pool;
+	struct scaler sc;
+	uint8_t *src, *ref, *out;
+	uint8_t *dp[3];
+	unsigned int ds[3];
+	unsigned int i, f, k, j;
+	size_t size;
+	int bad = 0;
+
+	src = malloc(max);
+	ref = malloc(max);
+	out = malloc(max);
+	if (!src || !ref || !out)
+		return -1;
+	srand(1);
+	for (j = 0; j < max; j++)
+		src[j] = rand();
+	copy_pool_init(&pool, COPY_POOL_MAX, copy_kernel_select(NULL)->fn,
+				sched_getcpu());
+
+	for (i = 0; i < sizeof(scale_cases) / sizeof(scale_cases[0]); i++)
+	for (f = 0; f < 2; f++) {
+		size = scale_planes(scale_cases[i].fourcc, ref,
+				scale_cases[i].dst_w, scale_cases[i].dst_h,
+				dp, ds);
+		scaler_init(&sc, scale_cases[i].fourcc, scale_cases[i].src_w,
+				scale_cases[i].src_h, scale_cases[i].dst_w,
+				scale_cases[i].dst_h, f, "c", NULL);
+		scale_run(&sc, i, src, ref);
+		scaler_exit(&sc);
+		for (k = 0; k < NR_SCALER_KERNELS; k++) {
+			if (!scaler_kernels[k].supported())
+				continue;
+			scaler_init(&sc, scale_cases[i].fourcc,
+				scale_cases[i].src_w, scale_cases[i].src_h,
+				scale_cases[i].dst_w, scale_cases[i].dst_h,
+				f, scaler_kernels[k].name, &pool);
+			scale_run(&sc, i, src, out);
+			scaler_exit(&sc);
+			if (memcmp(ref, out, size)) {
+				printf("%s %s %s differs from c\n",
+					scale_cases[i].name, filters[f],
+					scaler_kernels[k].name);
+				bad++;
+			}
+		}
+	}
+	printf("bit-exact: %s, %ld cpus\n", bad ? "NO" : "yes",
+				sysconf(_SC_NPROCESSORS_ONLN));
+
+	printf("%-20s %-9s", "MP/s", "filter");
+	for (k = 0; k < NR_SCALER_KERNELS; k++)
+		if (scaler_kernels[k].supported())
+			printf(" %8s", scaler_kernels[k].name);
+	printf(" %8s\n", "bands");
+
+	for (i = 0; i < sizeof(scale_cases) / sizeof(scale_cases[0]); i++) {
+		for (f = 0; f < 2; f++) {
+			printf("%-20s %-9s", scale_cases[i].name, filters[f]);
+			for (k = 0; k < NR_SCALER_KERNELS; k++) {
+				if (!scaler_kernels[k].supported())
+					continue;
+				scaler_init(&sc, scale_cases[i].fourcc,
+					scale_cases[i].src_w,
+					scale_cases[i].src_h,
+					scale_cases[i].dst_w,
+					scale_cases[i].dst_h, f,
+					scaler_kernels[k].name, NULL);
+				printf(" %8.1f", scale_run(&sc, i, src, out));
+				scaler_exit(&sc);
+			}
+			scaler_init(&sc, scale_cases[i].fourcc,
+				scale_cases[i].src_w, scale_cases[i].src_h,
+				scale_cases[i].dst_w, scale_cases[i].dst_h,
+				f, NULL, &pool);
+			printf(" %8.1f\n", scale_run(&sc, i, src, out));
+			scaler_exit(&sc);
+		}
+	}
+
+	copy_pool_exit(&pool);
+	free(src);
+	free(ref);
+	free(out);
+	return bad ? -1 : 0;
+}
+
+#define ROI_WIDTH	1920
+#define ROI_HEIGHT	1080
+#define ROI_FRAMES	500
+
+/* the publish of v4l2_capture.c: the readers' ROIs only, or everything */
+static size_t roi_publish(struct capture_data *shm,
+				const struct capture_layout *l, copy_fn copy,
+				const unsigned char *src, size_t size)
+{
+	struct capture_meta meta;
+	struct capture_reader *r;
+	unsigned int i, n, p, off, len, rows;
+	size_t bytes = 0;
+	char *dst;
+
+	memset(&meta, 0, sizeof(meta));
+	meta.bytesused = size;
+	dst = ring_write_begin(shm);
+	if (!ring_roi_only(shm, &meta.roi_gen)) {
+		copy(dst, src, size);
+		ring_write_end(shm, &meta);
+		return size;
+	}
+
+	meta.flags = CAPTURE_META_PARTIAL;
+	for (i = 0; i < CAPTURE_MAX_READERS; i++) {
+		r = &shm->readers[i];
+		if (READ_ONCE(r->state) != READER_ACTIVE)
+			continue;
+		for (n = 0; n < r->nr_rois; n++)
+			for (p = 0; p < l->nplanes; p++) {
+				off = capture_roi_rect(l, p, &r->rois[n],
+							&len, &rows);
+				bytes += (size_t)len * rows;
+				while (rows--) {
+					memcpy(dst + off, src + off, len);
+					off += l->planes[p].stride;
+				}
+			}
+	}
+	ring_write_end(shm, &meta);
+
+	return bytes;
+}
+
+/*
+ * Producer and consumer cost of a 1080p NV12 stream read whole, through
+ * one quarter frame ROI and through two 1/16 frame ROIs: the publish
+ * copy and the compact copy of the consumer should follow the ROI area.
+ */
+static int cmd_roi(int argc, char **argv)
+{
+	static const struct {
+		const char	*name;
+		unsigned int	nr;
+		unsigned int	roi[2][4];
+	} cases[] = {
+		{ "full", 0, { { 0 } } },
+		{ "1/4", 1, { { 480, 270, 960, 540 } } },
+		{ "2x1/16", 2, { { 0, 0, 480, 270 },
+				{ 1440, 810, 480, 270 } } },
+	};
+	unsigned int size = ROI_WIDTH * ROI_HEIGHT * 3 / 2;
+	const struct copy_kernel *k = copy_kernel_select(NULL);
+	struct capture_client c;
+	struct capture_frame f;
+	struct capture_view v;
+	unsigned char *src, *dense;
+	uint64_t tp, tc;
+	size_t pub, used;
+	unsigned int i, j, n;
+	int ret = 0;
+
+	memset(&c, 0, sizeof(c));
+	c.shm = bench_alloc_ring(4, size);
+	src = aligned_alloc(CAPTURE_PAGE_SIZE, (size_t)size * COPY_RING);
+	dense = malloc(size);
+	if (!c.shm || !src || !dense)
+		return -1;
+	memset(src, 0x5a, (size_t)size * COPY_RING);
+	c.shm->width = ROI_WIDTH;
+	c.shm->height = ROI_HEIGHT;
+	c.shm->fmt = V4L2_PIX_FMT_NV12;
+	c.shm->bytesperline = ROI_WIDTH;
+	capture_layout(&c.layout, c.shm->fmt, ROI_WIDTH, ROI_HEIGHT,
+				ROI_WIDTH, size);
+
+	printf("copy kernel %s, %ux%u nv12\n", k->name, ROI_WIDTH, ROI_HEIGHT);
+	printf("%-8s %12s %14s %14s\n", "readers", "bytes/frame",
+				"publish us", "consumer us");
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		c.reader = reader_attach(c.shm, READER_LATEST_ONLY);
+		if (!c.reader) {
+			ret = -1;
+			break;
+		}
+		for (n = 0; n < cases[i].nr; n++)
+			capture_roi_add(&c, cases[i].name, cases[i].roi[n][0],
+					cases[i].roi[n][1], cases[i].roi[n][2],
+					cases[i].roi[n][3]);
+
+		pub = 0;
+		tp = tc = 0;
+		for (j = 0; j < ROI_FRAMES; j++) {
+			tp -= now_ns();
+			pub = roi_publish(c.shm, &c.layout, k->fn,
+					src + (size_t)size * (j % COPY_RING),
+					size);
+			tp += now_ns();
+
+			tc -= now_ns();
+			if (capture_acquire_frame(&c, &f, 0) < 0) {
+				ret = -1;
+				break;
+			}
+			if (!cases[i].nr)
+				memcpy(dense, f.data, f.meta.bytesused);
+			for (n = 0, used = 0; n < cases[i].nr; n++)
+				if (capture_frame_view(&c, &f, n, &v) == 0)
+					used += capture_view_compact(&v,
+								dense + used);
+			capture_release_frame(&c, &f);
+			tc += now_ns();
+		}
+		printf("%-8s %12zu %14.1f %14.1f\n", cases[i].name, pub,
+				tp / 1000.0 / ROI_FRAMES,
+				tc / 1000.0 / ROI_FRAMES);
+		reader_detach(c.shm, c.reader);
+	}
+
+	free(c.shm);
+	free(src);
+	free(dense);
+	return ret;
+}
+
+#define RECORD_FRAMES	240
+#define RECORD_FPS	60
+
+/*
+ * Consumer side cost of recording 1080p NV12 at RECORD_FPS: fwrite() as
+ * demo.c used to, and the async recorder with and without O_DIRECT.
+ * The recorder must keep the consumer path flat and drop nothing as
+ * long as the disk keeps up on average.
+ */
+static int cmd_record(int argc, char **argv)
+{
+	static const char *modes[] = { "fwrite", "async", "async-direct" };
+	const char *dir = argc > 1 ? argv[1] : "/tmp";
+	unsigned int size = 1920 * 1080 * 3 / 2;
+	struct capture_recorder rec;
+	uint64_t *lat, t, total;
+	struct timespec next;
+	unsigned char *src;
+	char path[256];
+	unsigned int m, i;
+	FILE *file = NULL;
+	int ret = 0;
+
+	src = malloc(size);
+	lat = malloc(RECORD_FRAMES * sizeof(*lat));
+	if (!src || !lat)
+		return -1;
+	memset(src, 0x5a, size);
+	snprintf(path, sizeof(path), "%s/capture_bench.rec", dir);
+
+	printf("%s, %u frames of %u bytes\n", path, RECORD_FRAMES, size);
+	printf("%-14s %10s %10s %10s %10s %8s\n", "mode", "p50 us",
+			"p99 us", "max us", "total ms", "drops");
+	for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+		if (m == 0)
+			file = fopen(path, "wb");
+		else if (record_open(&rec, path, 0,
+					m == 2 ? RECORD_F_DIRECT : 0) < 0)
+			file = NULL;
+		else
+			file = stdout;
+		if (!file) {
+			ret = -1;
+			break;
+		}
+
+		total = now_ns();
+		clock_gettime(CLOCK_MONOTONIC, &next);
+		for (i = 0; i < RECORD_FRAMES; i++) {
+			next.tv_nsec += 1000000000 / RECORD_FPS;
+			if (next.tv_nsec >= 1000000000) {
+				next.tv_nsec -= 1000000000;
+				next.tv_sec++;
+			}
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+						NULL);
+			t = now_ns();
+			if (m == 0) {
+				fwrite(src, size, 1, file);
+			} else if (record_frame(&rec, src, size) == 0) {
+				record_commit(&rec);
+			}
+			lat[i] = now_ns() - t;
+		}
+		if (m == 0) {
+			fflush(file);
+			fdatasync(fileno(file));
+			fclose(file);
+		} else {
+			record_print_stats(&rec);
+			record_close(&rec);
+		}
+		total = now_ns() - total;
+
+		qsort(lat, RECORD_FRAMES, sizeof(*lat), cmp_u64);
+		printf("%-14s %10.1f %10.1f %10.1f %10.1f %8llu\n", modes[m],
+			lat[RECORD_FRAMES / 2] / 1000.0,
+			lat[RECORD_FRAMES * 99 / 100] / 1000.0,
+			lat[RECORD_FRAMES - 1] / 1000.0, total / 1000000.0,
+			(unsigned long long)(m ? rec.drops : 0));
+	}
+
+	unlink(path);
+	free(src);
+	free(lat);
+	return ret;
+}
+
+#define E2E_SOURCES	4
+#define E2E_SAMPLES	65536
+#define E2E_MAX_READERS	4
+/* latency phase: at most this rate, and half of what the path sustains */
+#define E2E_MAX_FPS	4000
+/* enough for p999 to be more than the single worst sample */
+#define E2E_LAT_SAMPLES	10000
+#define E2E_LAT_MAX_US	(60 * 1000000ull)
+
+struct e2e_consumer {
+	pthread_t		tid;
+	unsigned int		*ready;
+	unsigned int		*stop;
+	unsigned int		*sample;
+	uint64_t		*lat;
+	unsigned int		nr_lat;
+	uint64_t		frames;
+	uint64_t		torn;
+};
+
+/* a plain libcapture consumer, timing publish to acquire */
+static void *e2e_consumer_fn(void *arg)
+{
+	struct e2e_consumer *ec = arg;
+	struct capture_client c;
+	struct capture_frame f;
+	uint64_t now;
+
+	if (capture_attach(&c, "bench-e2e", READER_DROP_OLDEST) < 0) {
+		__atomic_add_fetch(ec->ready, 1, __ATOMIC_RELEASE);
+		return NULL;
+	}
+	__atomic_add_fetch(ec->ready, 1, __ATOMIC_RELEASE);
+
+	while (!READ_ONCE(*ec->stop)) {
+		if (capture_acquire_frame(&c, &f, 50) < 0)
+			continue;
+		now = capture_now_us();
+		if (READ_ONCE(*ec->sample) && ec->nr_lat < E2E_SAMPLES)
+			ec->lat[ec->nr_lat++] = now - f.meta.publish_us;
+		if (capture_release_frame(&c, &f) < 0)
+			ec->torn++;
+		ec->frames++;
+	}
+
+	capture_detach(&c);
+	return NULL;
+}
+
+static uint64_t e2e_drops(struct capture_data *shm)
+{
+	uint64_t drops = 0;
+	unsigned int i;
+
+	for (i = 0; i < CAPTURE_MAX_READERS; i++)
+		if (READ_ONCE(shm->readers[i].state) == READER_ACTIVE)
+			drops += READ_ONCE(shm->readers[i].drops);
+
+	return drops;
+}
+
+static uint64_t process_cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * The daemon's publish, capture_publish_want() and capture_publish(),
+ * for duration_us or count frames; a non-zero period paces it.
+ */
+static uint64_t e2e_publish(struct capture_data *shm, struct copy_pool *pool,
+				const struct capture_layout *l,
+				struct capture_demand *d,
+				unsigned char *src, size_t size,
+				uint64_t duration_us, uint64_t count,
+				uint64_t period_ns, uint64_t *seq)
+{
+	struct capture_meta meta;
+	struct timespec next;
+	uint64_t end = capture_now_us() + duration_us;
+	uint64_t n;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (n = 0; n < count && capture_now_us() < end; n++) {
+		if (period_ns) {
+			next.tv_nsec += period_ns;
+			while (next.tv_nsec >= 1000000000) {
+				next.tv_nsec -= 1000000000;
+				next.tv_sec++;
+			}
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+						NULL);
+		}
+
+		memset(&meta, 0, sizeof(meta));
+		meta.sequence = (*seq)++;
+		meta.bytesused = size;
+		meta.timestamp_us = capture_now_us();
+		if (capture_publish_want(shm, d, &meta))
+			capture_publish(shm, NULL, pool, l,
+					src + (n % E2E_SOURCES) * size, &meta);
+	}
+
+	return n;
+}
+
+static int e2e_run(const char *res, unsigned int w, unsigned int h,
+			const char *fmt_name, unsigned int fmt,
+			unsigned int slots, unsigned int readers,
+			unsigned int ms, struct copy_pool *copy,
+			unsigned char *src)
+{
+	struct e2e_consumer ec[E2E_MAX_READERS];
+	struct capture_demand demand;
+	struct capture_layout l;
+	struct capture_pool pool;
+	struct capture_data *shm;
+	unsigned int ready = 0, stop = 0, sample = 0;
+	uint64_t *lat, t, cpu, frames, drops, seq = 0, nr = 0;
+	uint64_t period, total;
+	unsigned int i, j, size;
+	double fps;
+
+	capture_layout(&l, fmt, w, h, 0, 0);
+	size = l.planes[l.nplanes - 1].offset + l.planes[l.nplanes - 1].stride *
+					l.planes[l.nplanes - 1].height;
+	/* populated, so first touch page faults don't count as publish cost */
+	shm = capture_pool_create(&pool, "bench-e2e",
+				capture_data_size(slots) +
+				capture_slot_size(size) * slots,
+				POOL_F_POPULATE);
+	if (!shm)
+		return -1;
+	shm->width = w;
+	shm->height = h;
+	shm->fmt = fmt;
+	shm->bytesperline = l.planes[0].stride;
+	ring_init(shm, slots, size);
+	memset(&demand, 0, sizeof(demand));
+
+	lat = malloc(sizeof(*lat) * E2E_SAMPLES * readers);
+	for (i = 0; i < readers; i++) {
+		memset(&ec[i], 0, sizeof(ec[i]));
+		ec[i].ready = &ready;
+		ec[i].stop = &stop;
+		ec[i].sample = &sample;
+		ec[i].lat = lat + i * E2E_SAMPLES;
+		pthread_create(&ec[i].tid, NULL, e2e_consumer_fn, &ec[i]);
+	}
+	while (smp_load_acquire(&ready) != readers)
+		usleep(1000);
+
+	/* throughput: as fast as the ring and the readers allow */
+	t = now_ns();
+	cpu = process_cpu_ns();
+	drops = e2e_drops(shm);
+	frames = e2e_publish(shm, copy, &l, &demand, src, size, ms * 1000ull,
+					UINT64_MAX, 0, &seq);
+	t = now_ns() - t;
+	cpu = process_cpu_ns() - cpu;
+	drops = e2e_drops(shm) - drops;
+	fps = frames * 1e9 / t;
+
+	/*
+	 * latency: paced well below saturation, so no queueing, for
+	 * E2E_LAT_SAMPLES samples over all readers
+	 */
+	period = 1000000000ull / (fps / 2 < E2E_MAX_FPS ?
+				(uint64_t)(fps / 2) + 1 : E2E_MAX_FPS);
+	WRITE_ONCE(sample, 1);
+	e2e_publish(shm, copy, &l, &demand, src, size, E2E_LAT_MAX_US,
+			(E2E_LAT_SAMPLES + readers - 1) / readers, period, &seq);
+	usleep(10000);
+	WRITE_ONCE(stop, 1);
+
+	for (i = 0; i < readers; i++) {
+		pthread_join(ec[i].tid, NULL);
+		for (j = 0; j < ec[i].nr_lat; j++)
+			lat[nr++] = ec[i].lat[j];
+	}
+	qsort(lat, nr, sizeof(*lat), cmp_u64);
+
+	total = frames * readers;
+	printf("%s,%s,%u,%u,%u,%.1f,%.1f,%.3f,%llu,%llu,%llu,%llu,%llu\n",
+		res, fmt_name, size, slots, readers, fps,
+		cpu / 1000.0 / (frames ? frames : 1),
+		total ? drops * 100.0 / total : 0.0,
+		(unsigned long long)nr,
+		(unsigned long long)(nr ? lat[nr / 2] : 0),
+		(unsigned long long)(nr ? lat[nr * 99 / 100] : 0),
+		(unsigned long long)(nr ? lat[nr * 999 / 1000] : 0),
+		(unsigned long long)(nr ? lat[nr - 1] : 0));
+	fflush(stdout);
+
+	free(lat);
+	capture_pool_destroy(&pool);
+	return 0;
+}
+
+/*
+ * End to end, synthetic producer -> shm -> libcapture consumers, swept
+ * over resolution, format, slot count and consumer count. Each point
+ * runs [ms] (default 500) flat out for throughput, CPU per frame (all
+ * threads) and drop rate, then paced at half that rate until there are
+ * E2E_LAT_SAMPLES publish to acquire latencies for the percentiles.
+ * CSV on stdout.
+ */
+static int cmd_e2e(int argc, char **argv)
+{
+	static const struct {
+		const char	*name;
+		unsigned int	w, h;
+	} res[] = {
+		{ "vga", 640, 480 },
+		{ "720p", 1280, 720 },
+		{ "1080p", 1920, 1080 },
+		{ "4k", 3840, 2160 },
+	};
+	static const struct {
+		const char	*name;
+		unsigned int	fourcc;
+	} fmts[] = {
+		{ "nv12", V4L2_PIX_FMT_NV12 },
+		{ "yuyv", V4L2_PIX_FMT_YUYV },
+	};
+	static const unsigned int slots[] = { 2, 8 };
+	static const unsigned int readers[] = { 1, 4 };
+	unsigned int ms = argc > 1 ? strtoul(argv[1], NULL, 0) : 500;
+	size_t max = 3840 * 2160 * 2;
+	const struct copy_kernel *k = copy_kernel_select(NULL);
+	struct copy_pool copy;
+	unsigned int r, f, s, n;
+	unsigned char *src;
+	int ret = 0;
+
+	src = malloc(max * E2E_SOURCES);
+	if (!src || copy_pool_init(&copy, 0, k->fn, 0) < 0)
+		return -1;
+	memset(src, 0x5a, max * E2E_SOURCES);
+
+	printf("# copy kernel %s, %ums throughput, %u latency samples\n",
+			k->name, ms, E2E_LAT_SAMPLES);
+	printf("res,fmt,bytes,slots,readers,fps,cpu_us_per_frame,drop_pct,"
+		"samples,p50_us,p99_us,p999_us,max_us\n");
+	for (r = 0; r < sizeof(res) / sizeof(res[0]); r++)
+		for (f = 0; f < sizeof(fmts) / sizeof(fmts[0]); f++)
+			for (s = 0; s < sizeof(slots) / sizeof(slots[0]); s++)
+				for (n = 0; n < sizeof(readers) /
+						sizeof(readers[0]); n++)
+					ret |= e2e_run(res[r].name, res[r].w,
+						res[r].h, fmts[f].name,
+						fmts[f].fourcc, slots[s],
+						readers[n], ms, &copy, src);
+
+	copy_pool_exit(&copy);
+	free(src);
+	return ret;
+}
+
+#define STATS_REPS	9
+
+/* ns per frame published the way the daemon does, timed by st or not */
+static double stats_publish(struct capture_data *shm, const char *src,
+				unsigned int size, struct capture_stats *st)
+{
+	struct capture_meta meta;
+	uint64_t t, t0;
+	unsigned int i;
+	char *slot;
+
+	memset(&meta, 0, sizeof(meta));
+	meta.bytesused = size;
+	t0 = now_ns();
+	for (i = 0; i < BENCH_FRAMES; i++) {
+		t = stat_begin(st);
+		slot = ring_write_begin(shm);
+		t = stat_end(st, STAT_WAIT, t);
+		if (src)
+			memcpy(slot, src, size);
+		t = stat_end(st, STAT_COPY, t);
+		meta.sequence = i;
+		ring_write_end(shm, &meta);
+		stat_end(st, STAT_PUBLISH, t);
+	}
+
+	return (double)(now_ns() - t0) / BENCH_FRAMES;
+}
+
+/*
+ * Cost of --stats on the producer, VGA and 1080p NV12. The difference
+ * of two publish runs drowns in the noise of the copy, so the stats
+ * are timed on their own, around an empty publish, and set against the
+ * best plain publish.
+ */
+static int cmd_stats(int argc, char **argv)
+{
+	static const unsigned int sizes[] = {
+		BENCH_SIZEIMAGE, 1920 * 1080 * 3 / 2,
+	};
+	struct capture_stats *st;
+	struct capture_data *shm;
+	double frame, cost, d;
+	unsigned int i, rep;
+	char *src;
+
+	src = malloc(sizes[1]);
+	st = aligned_alloc(4096, ALIGN(sizeof(*st), 4096));
+	if (!src || !st)
+		return -1;
+	memset(src, 0x5a, sizes[1]);
+	memset(st, 0, sizeof(*st));
+
+	printf("%10s %14s %14s %10s\n", "bytes", "publish ns", "stats ns",
+			"overhead");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		shm = bench_alloc_ring(8, sizes[i]);
+		if (!shm)
+			return -1;
+		frame = cost = 1e12;
+		for (rep = 0; rep < STATS_REPS; rep++) {
+			d = stats_publish(shm, src, sizes[i], NULL);
+			frame = d < frame ? d : frame;
+			d = stats_publish(shm, NULL, sizes[i], st) -
+				stats_publish(shm, NULL, sizes[i], NULL);
+			cost = d < cost ? d : cost;
+		}
+		if (cost < 0)
+			cost = 0;
+		printf("%10u %14.1f %14.1f %9.2f%%\n", sizes[i], frame, cost,
+					cost * 100 / frame);
+		free(shm);
+	}
+
+	free(st);
+	free(src);
+	return 0;
+}
+
+#define LOST_FRAMES	3000
+#define LOST_SLOTS	8
+#define LOST_PERIOD_US	33333
+/* the driver drops a frame every LOST_DROP sequence numbers */
+#define LOST_DROP	97
+/* and every LOST_STALL frames the readers stall for 3 rings' worth */
+#define LOST_STALL	500
+
+struct lost_reader {
+	const char		*name;
+	unsigned int		max_fps;
+	unsigned int		every;
+	struct capture_client	c;
+	/* frames published for it, and how many of them it got */
+	unsigned int		sent;
+	unsigned int		got;
+};
+
+static void lost_drain(struct lost_reader *lr, unsigned int nr)
+{
+	struct capture_frame f;
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+		while (capture_acquire_frame(&lr[i].c, &f, 0) == 0)
+			if (capture_release_frame(&lr[i].c, &f) == 0)
+				lr[i].got++;
+}
+
+/*
+ * Loss accounting of subscribed readers: the driver drops frames and the
+ * readers stall long enough to be lapped, both of which must show up as
+ * lost, while the frames a subscription passes over must not.
+ */
+static int cmd_lost(int argc, char **argv)
+{
+	struct lost_reader lr[] = {
+		{ .name = "all" },
+		{ .name = "every 3", .every = 3 },
+		{ .name = "10 fps", .max_fps = 10 },
+		{ .name = "7 fps, every 2", .max_fps = 7, .every = 2 },
+	};
+	unsigned int nr = sizeof(lr) / sizeof(lr[0]);
+	struct capture_demand demand;
+	struct capture_meta meta;
+	struct capture_layout l;
+	struct copy_pool copy;
+	struct capture_data *shm;
+	unsigned int i, n, seq = 0, drops = 0, expect;
+	unsigned char *src;
+	int ret = 0;
+
+	shm = bench_alloc_ring(LOST_SLOTS, BENCH_SIZEIMAGE);
+	src = malloc(BENCH_SIZEIMAGE);
+	if (!shm || !src)
+		return -1;
+	memset(src, 0x5a, BENCH_SIZEIMAGE);
+	shm->width = BENCH_WIDTH;
+	shm->height = BENCH_HEIGHT;
+	shm->fmt = V4L2_PIX_FMT_NV12;
+	shm->bytesperline = BENCH_WIDTH;
+	capture_layout(&l, shm->fmt, BENCH_WIDTH, BENCH_HEIGHT, BENCH_WIDTH,
+				BENCH_SIZEIMAGE);
+	copy_pool_init(&copy, 0, copy_kernel_select(NULL)->fn, 0);
+	memset(&demand, 0, sizeof(demand));
+
+	for (i = 0; i < nr; i++) {
+		lr[i].c.shm = shm;
+		lr[i].c.layout = l;
+		lr[i].c.reader = reader_attach(shm, READER_DROP_OLDEST);
+		if (!lr[i].c.reader)
+			return -1;
+		capture_subscribe(&lr[i].c, lr[i].max_fps, lr[i].every);
+	}
+
+	for (n = 0; n < LOST_FRAMES; n++, seq++) {
+		if (seq && seq % LOST_DROP == 0) {
+			seq++;
+			drops++;
+		}
+
+		memset(&meta, 0, sizeof(meta));
+		meta.sequence = seq;
+		meta.bytesused = BENCH_SIZEIMAGE;
+		meta.timestamp_us = (uint64_t)(seq + 1) * LOST_PERIOD_US;
+		if (capture_publish_want(shm, &demand, &meta)) {
+			capture_publish(shm, NULL, &copy, &l, src, &meta);
+			for (i = 0; i < nr; i++)
+				if (meta.want & BIT(lr[i].c.reader -
+							shm->readers))
+					lr[i].sent++;
+		}
+
+		/* stalled, the ring goes round three times */
+		if (n % LOST_STALL >= LOST_STALL - 3 * LOST_SLOTS)
+			continue;
+		lost_drain(lr, nr);
+	}
+	lost_drain(lr, nr);
+
+	printf("%u frames, %u dropped by the driver, %u skipped\n",
+			LOST_FRAMES, drops, READ_ONCE(shm->skipped));
+	printf("%-16s %8s %8s %8s %8s\n", "reader", "sent", "got", "lost",
+			"expected");
+	for (i = 0; i < nr; i++) {
+		expect = drops + lr[i].sent - lr[i].got;
+		printf("%-16s %8u %8u %8u %8u%s\n", lr[i].name, lr[i].sent,
+				lr[i].got, lr[i].c.reader->lost, expect,
+				lr[i].c.reader->lost == expect ? "" : " wrong");
+		if (lr[i].c.reader->lost != expect)
+			ret = -1;
+		reader_detach(shm, lr[i].c.reader);
+	}
+
+	copy_pool_exit(&copy);
+	free(shm);
+	free(src);
+	return ret;
+}
+
+static const struct {
+	const char	*name;
+	int		(*fn)(int argc, char **argv);
+	const char	*help;
+} cmds[] = {
+	{ "ring", cmd_ring, "publish cost: SysV semaphore vs seqlock ring" },
+	{ "readers", cmd_readers, "producer cost with 1, 4, 16 and a stuck reader" },
+	{ "wakeup", cmd_wakeup, "publish to consumer wakeup latency" },
+	{ "export", cmd_export, "zero-copy export from a memfd source" },
+	{ "pool", cmd_pool, "frame pool copy bandwidth vs shmget" },
+	{ "copy", cmd_copy, "GB/s of each copy kernel, VGA to 1080p" },
+	{ "stripe", cmd_stripe, "striped copy scaling with 1-4 threads" },
+	{ "multi", cmd_multi, "1-4 synthetic cameras, one thread each" },
+	{ "pixconv", cmd_pixconv, "YUV to RGB kernels: exactness and ms/720p" },
+	{ "scale", cmd_scale, "bilinear and area scaler MP/s" },
+	{ "roi", cmd_roi, "publish and consumer cost of ROI views" },
+	{ "record", cmd_record, "fwrite vs async recorder, [dir]" },
+	{ "e2e", cmd_e2e, "producer to consumer sweep as CSV, [ms]" },
+	{ "stats", cmd_stats, "producer overhead of the --stats histograms" },
+	{ "lost", cmd_lost, "loss accounting of subscribed readers" },
+};
+
+static void usage(const char *prog)
+{
+	unsigned int i;
+
+	fprintf(stderr, "usage: %s <bench> [args]\n", prog);
+	for (i = 0; i < sizeof(cmds) / sizeof(cmds[0]); i++)
+		fprintf(stderr, "  %-10s %s\n", cmds[i].name, cmds[i].help);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int i;
+
+	if (argc < 2) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	for (i = 0; i < sizeof(cmds) / sizeof(cmds[0]); i++)
+		if (!strcmp(argv[1], cmds[i].name))
+			return cmds[i].fn(argc - 1, argv + 1);
+
+	usage(argv[0]);
+	return -1;
+}
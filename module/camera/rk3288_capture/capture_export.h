@@ -0,0 +1,176 @@
+/*
+ * Zero-copy frame export.
+ *
+ * Copyright (C) 2017 zhujiongfu
+ *
+ * The capture buffers are handed to consumers once, as dmabuf (or memfd)
+ * file descriptors over a unix socket. After that only buffer indices go
+ * through the shm ring and buffer lifetime is tracked by the leases in
+ * struct capture_data.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ */
+
+#ifndef __CAPTURE_EXPORT_H
+#define __CAPTURE_EXPORT_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "v4l2_capture.h"
+
+#define EXPORT_SOCK_FMT		KEY_PATH "/capture-%s.sock"
+
+struct export_hello {
+	unsigned int		cnt;
+	unsigned int		length;
+};
+
+static inline char *export_sock_path(char *path, size_t len,
+				const char *name)
+{
+	snprintf(path, len, EXPORT_SOCK_FMT, name);
+	return path;
+}
+
+static inline int memfd_alloc(size_t size, void **addr)
+{
+	int fd;
+
+	fd = memfd_create("capture-buf", MFD_CLOEXEC);
+	if (fd < 0) {
+		perror("memfd_create error");
+		return -1;
+	}
+	if (ftruncate(fd, size) < 0) {
+		perror("memfd ftruncate error");
+		close(fd);
+		return -1;
+	}
+	*addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (*addr == MAP_FAILED) {
+		perror("memfd mmap error");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static inline int export_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("export socket error");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+			listen(fd, 8) < 0) {
+		fprintf(stderr, "export bind %s error: %s\n", path,
+					strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Hand every buffer fd to one pending client, then hang up. */
+static inline int export_serve(int listen_fd, const int *fds,
+				unsigned int cnt, unsigned int length)
+{
+	char cbuf[CMSG_SPACE(sizeof(int) * CAPTURE_MAX_BUFS)];
+	struct export_hello hello = { cnt, length };
+	struct iovec iov = { &hello, sizeof(hello) };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int fd;
+	int ret;
+
+	fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0)
+		return errno == EAGAIN ? 0 : -1;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * cnt);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * cnt);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * cnt);
+
+	ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+	if (ret < 0)
+		perror("export sendmsg error");
+	close(fd);
+
+	return ret < 0 ? -1 : 1;
+}
+
+static inline int export_connect(const char *path, int *fds,
+				unsigned int *cnt, unsigned int *length)
+{
+	char cbuf[CMSG_SPACE(sizeof(int) * CAPTURE_MAX_BUFS)];
+	struct export_hello hello;
+	struct iovec iov = { &hello, sizeof(hello) };
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int fd;
+	int ret;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("export socket error");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "export connect %s error: %s\n", path,
+					strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	ret = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	close(fd);
+	if (ret != sizeof(hello) || hello.cnt > CAPTURE_MAX_BUFS) {
+		printf("bad export hello.\n");
+		return -1;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+			cmsg->cmsg_len != CMSG_LEN(sizeof(int) * hello.cnt)) {
+		printf("no buffer fds in export hello.\n");
+		return -1;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * hello.cnt);
+	*cnt = hello.cnt;
+	*length = hello.length;
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,456 @@
+/*
+ * Recording container.
+ *
+ * Copyright (C) 2017 zhujiongfu
+ *
+ * A recording is a capfile_header with the stream parameters followed
+ * by one record per frame: a capfile_frame header and the payload,
+ * padded to 8 bytes. Next to it, <file>.idx holds one fixed size entry
+ * per frame, sorted by timestamp, so that a reader can mmap it and find
+ * the frame at a given time with a binary search instead of walking a
+ * multi-GB file.
+ *
+ * The index is only written when the recording is closed. A recording
+ * that was not closed cleanly, or whose index doesn't match it any more,
+ * gets its index rebuilt from the frame records on open; everything up
+ * to the first torn record is recovered. Frames are kept even when their
+ * timestamps go backwards (a clock step, a driver restart); the index is
+ * sorted either way, so seeking still works.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ */
+
+#ifndef __CAPTURE_FILE_H
+#define __CAPTURE_FILE_H
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "v4l2_capture.h"
+#include "capture_record.h"
+
+#define CAPFILE_MAGIC		0x52504143	/* "CAPR" */
+#define CAPFILE_FRAME_MAGIC	0x454d5246	/* "FRME" */
+#define CAPFILE_INDEX_MAGIC	0x49504143	/* "CAPI" */
+#define CAPFILE_VERSION		1
+#define CAPFILE_ALIGN		8
+#define CAPFILE_PATH_MAX	256
+
+struct capfile_header {
+	uint32_t		magic;
+	uint32_t		version;
+	uint32_t		header_size;
+	uint32_t		width;
+	uint32_t		height;
+	uint32_t		fmt;
+	uint32_t		bytesperline;
+	uint32_t		sizeimage;
+	/* CLOCK_REALTIME at creation, to put frame timestamps on a date */
+	uint64_t		created_us;
+	uint32_t		reserved[6];
+};
+
+struct capfile_frame {
+	uint32_t		magic;
+	uint32_t		size;		/* payload, without the padding */
+	uint32_t		sequence;
+	uint32_t		flags;		/* capture_meta.flags */
+	uint64_t		timestamp_us;
+};
+
+struct capfile_index_header {
+	uint32_t		magic;
+	uint32_t		version;
+	uint64_t		count;
+	/* size of the recording the index was written for */
+	uint64_t		data_size;
+	uint64_t		reserved;
+};
+
+struct capfile_index_entry {
+	uint64_t		timestamp_us;
+	uint64_t		offset;		/* of the capfile_frame */
+	uint32_t		sequence;
+	uint32_t		size;
+};
+
+static inline void capfile_index_path(char *buf, size_t len, const char *path)
+{
+	snprintf(buf, len, "%s.idx", path);
+}
+
+static inline uint64_t capfile_record_size(uint32_t size)
+{
+	return sizeof(struct capfile_frame) + ALIGN((uint64_t)size,
+					CAPFILE_ALIGN);
+}
+
+/* by timestamp, frames with the same one in file order */
+static inline int capfile_entry_cmp(const void *a, const void *b)
+{
+	const struct capfile_index_entry *x = a, *y = b;
+
+	if (x->timestamp_us != y->timestamp_us)
+		return x->timestamp_us < y->timestamp_us ? -1 : 1;
+	return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/*
+ * Sort entries and write them out next to path, replacing the old index
+ * atomically.
+ */
+static inline int capfile_write_index(const char *path,
+				struct capfile_index_entry *entries,
+				uint64_t count, uint64_t data_size)
+{
+	struct capfile_index_header hdr;
+	char idx[PATH_MAX], tmp[PATH_MAX + 8];
+	FILE *file;
+
+	if (count)
+		qsort(entries, count, sizeof(*entries), capfile_entry_cmp);
+	capfile_index_path(idx, sizeof(idx), path);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", idx);
+	file = fopen(tmp, "wb");
+	if (!file) {
+		perror("create index");
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CAPFILE_INDEX_MAGIC;
+	hdr.version = CAPFILE_VERSION;
+	hdr.count = count;
+	hdr.data_size = data_size;
+	if (fwrite(&hdr, sizeof(hdr), 1, file) != 1 ||
+			(count && fwrite(entries, sizeof(*entries), count,
+						file) != count) ||
+			fflush(file) != 0 || fdatasync(fileno(file)) < 0) {
+		perror("write index");
+		fclose(file);
+		unlink(tmp);
+		return -1;
+	}
+	fclose(file);
+
+	if (rename(tmp, idx) < 0) {
+		perror("rename index");
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Writer side, on top of the async recorder: capfile_frame() copies a
+ * frame in, capfile_commit() or capfile_abort() decide whether it stays
+ * and capfile_finish() writes the index.
+ */
+struct capfile_writer {
+	struct capture_recorder	rec;
+	char			path[CAPFILE_PATH_MAX];
+	struct capfile_index_entry *index;
+	uint64_t		count;
+	uint64_t		alloc;
+	/* the frame between capfile_frame() and capfile_commit() */
+	struct capfile_index_entry pending;
+};
+
+static inline int capfile_create(struct capfile_writer *w, const char *path,
+				const struct capture_data *shm, unsigned int flags)
+{
+	struct capfile_header hdr;
+	char idx[PATH_MAX];
+	struct timespec ts;
+
+	memset(w, 0, sizeof(*w));
+	snprintf(w->path, sizeof(w->path), "%s", path);
+	if (record_open(&w->rec, path, 0, flags) < 0)
+		return -1;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CAPFILE_MAGIC;
+	hdr.version = CAPFILE_VERSION;
+	hdr.header_size = sizeof(hdr);
+	hdr.width = shm->width;
+	hdr.height = shm->height;
+	hdr.fmt = shm->fmt;
+	hdr.bytesperline = shm->bytesperline;
+	hdr.sizeimage = shm->sizeimage;
+	hdr.created_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	record_frame(&w->rec, &hdr, sizeof(hdr));
+	record_commit(&w->rec);
+	/* the header is not a frame */
+	w->rec.frames = 0;
+
+	/* a stale index would describe another recording */
+	capfile_index_path(idx, sizeof(idx), path);
+	unlink(idx);
+
+	return 0;
+}
+
+static inline int capfile_frame(struct capfile_writer *w,
+				const struct capture_meta *meta,
+				const void *data, uint32_t size)
+{
+	static const unsigned char pad[CAPFILE_ALIGN];
+	struct capfile_frame rec;
+
+	if (capfile_record_size(size) > record_room(&w->rec)) {
+		w->rec.drops++;
+		return -EAGAIN;
+	}
+
+	rec.magic = CAPFILE_FRAME_MAGIC;
+	rec.size = size;
+	rec.sequence = meta->sequence;
+	rec.flags = meta->flags;
+	rec.timestamp_us = meta->timestamp_us;
+
+	w->pending.timestamp_us = meta->timestamp_us;
+	w->pending.offset = w->rec.pos;
+	w->pending.sequence = meta->sequence;
+	w->pending.size = size;
+
+	record_frame(&w->rec, &rec, sizeof(rec));
+	record_frame(&w->rec, data, size);
+	record_frame(&w->rec, pad, ALIGN(size, CAPFILE_ALIGN) - size);
+
+	return 0;
+}
+
+static inline void capfile_commit(struct capfile_writer *w)
+{
+	struct capfile_index_entry *index;
+
+	record_commit(&w->rec);
+
+	/* without memory for the index it gets rebuilt on open */
+	if (w->count == w->alloc) {
+		index = realloc(w->index, (w->alloc ? w->alloc * 2 : 1024) *
+						sizeof(*index));
+		if (!index)
+			return;
+		w->index = index;
+		w->alloc = w->alloc ? w->alloc * 2 : 1024;
+	}
+	w->index[w->count++] = w->pending;
+}
+
+static inline void capfile_abort(struct capfile_writer *w)
+{
+	record_abort(&w->rec);
+}
+
+static inline int capfile_finish(struct capfile_writer *w)
+{
+	uint64_t size = w->rec.commit_pos;
+	int ret;
+
+	ret = record_close(&w->rec);
+	if (ret == 0 && w->count == w->rec.frames)
+		ret = capfile_write_index(w->path, w->index, w->count, size);
+	free(w->index);
+
+	return ret;
+}
+
+/* Reader side. */
+struct capfile {
+	int			fd;
+	uint64_t		size;
+	struct capfile_header	hdr;
+	/* mmap of the index file, entries follow the header */
+	void			*map;
+	size_t			map_len;
+	const struct capfile_index_entry *index;
+	uint64_t		count;
+};
+
+static inline int capfile_read_header(int fd, struct capfile_header *hdr)
+{
+	if (pread(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr) ||
+			hdr->magic != CAPFILE_MAGIC ||
+			hdr->version != CAPFILE_VERSION ||
+			hdr->header_size < sizeof(*hdr)) {
+		printf("not a capture recording.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Walk the frame records and write a fresh index. A record is judged by
+ * its header and size alone; the walk stops at the first one that is
+ * torn or doesn't look like one, which after a crash is where the
+ * recording really ends.
+ */
+static inline int capfile_rebuild_index(const char *path)
+{
+	struct capfile_index_entry *index = NULL, *tmp;
+	struct capfile_header hdr;
+	struct capfile_frame rec;
+	uint64_t count = 0, alloc = 0;
+	uint64_t off, size;
+	struct stat st;
+	int ret = -1;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror("open recording");
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || capfile_read_header(fd, &hdr) < 0)
+		goto out;
+
+	size = st.st_size;
+	off = hdr.header_size;
+	while (off + sizeof(rec) <= size) {
+		if (pread(fd, &rec, sizeof(rec), off) != sizeof(rec) ||
+				rec.magic != CAPFILE_FRAME_MAGIC ||
+				off + capfile_record_size(rec.size) > size)
+			break;
+
+		if (count == alloc) {
+			alloc = alloc ? alloc * 2 : 1024;
+			tmp = realloc(index, alloc * sizeof(*index));
+			if (!tmp)
+				goto out;
+			index = tmp;
+		}
+		index[count].timestamp_us = rec.timestamp_us;
+		index[count].offset = off;
+		index[count].sequence = rec.sequence;
+		index[count].size = rec.size;
+		count++;
+		off += capfile_record_size(rec.size);
+	}
+
+	if (off != size)
+		printf("%s: %llu bytes of torn data after frame %llu.\n", path,
+				(unsigned long long)(size - off),
+				(unsigned long long)count);
+	ret = capfile_write_index(path, index, count, size);
+out:
+	free(index);
+	close(fd);
+	return ret;
+}
+
+static inline int capfile_map_index(struct capfile *f, const char *path)
+{
+	const struct capfile_index_header *hdr;
+	char idx[PATH_MAX];
+	struct stat st;
+	int fd;
+
+	capfile_index_path(idx, sizeof(idx), path);
+	fd = open(idx, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		return -1;
+	}
+
+	f->map_len = st.st_size;
+	f->map = mmap(NULL, f->map_len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (f->map == MAP_FAILED)
+		return -1;
+
+	hdr = f->map;
+	if (hdr->magic != CAPFILE_INDEX_MAGIC ||
+			hdr->version != CAPFILE_VERSION ||
+			hdr->data_size != f->size ||
+			sizeof(*hdr) + hdr->count * sizeof(*f->index) !=
+						f->map_len) {
+		munmap(f->map, f->map_len);
+		return -1;
+	}
+	f->index = (const struct capfile_index_entry *)(hdr + 1);
+	f->count = hdr->count;
+
+	return 0;
+}
+
+static inline int capfile_open(struct capfile *f, const char *path)
+{
+	struct stat st;
+
+	memset(f, 0, sizeof(*f));
+	f->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (f->fd < 0) {
+		perror("open recording");
+		return -1;
+	}
+	if (fstat(f->fd, &st) < 0 || capfile_read_header(f->fd, &f->hdr) < 0)
+		goto err;
+	f->size = st.st_size;
+
+	if (capfile_map_index(f, path) == 0)
+		return 0;
+
+	printf("%s: index missing or stale, rebuilding.\n", path);
+	if (capfile_rebuild_index(path) < 0 || capfile_map_index(f, path) < 0)
+		goto err;
+
+	return 0;
+err:
+	close(f->fd);
+	return -1;
+}
+
+static inline void capfile_close(struct capfile *f)
+{
+	munmap(f->map, f->map_len);
+	close(f->fd);
+}
+
+/* first frame at or after timestamp_us, count if there is none */
+static inline uint64_t capfile_seek(const struct capfile *f,
+				uint64_t timestamp_us)
+{
+	uint64_t lo = 0, hi = f->count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (f->index[mid].timestamp_us < timestamp_us)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* payload of frame i into buf, at most len bytes; returns its size */
+static inline ssize_t capfile_read(const struct capfile *f, uint64_t i,
+				void *buf, size_t len)
+{
+	const struct capfile_index_entry *e;
+	ssize_t n;
+
+	if (i >= f->count)
+		return -1;
+
+	e = &f->index[i];
+	if (len > e->size)
+		len = e->size;
+	n = pread(f->fd, buf, len, e->offset + sizeof(struct capfile_frame));
+	if (n < 0)
+		perror("read frame");
+
+	return n;
+}
+
+#endif
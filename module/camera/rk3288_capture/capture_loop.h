@@ -0,0 +1,238 @@
+/*
+ * Event loop of the capture daemon.
+ *
+ * Copyright (C) 2017 zhujiongfu
+ *
+ * A thin epoll wrapper: every fd the daemon cares about (the V4L2 node,
+ * the export socket, housekeeping timers, signals) is a loop_source with
+ * its own handler. Urgent sources are dispatched before the others of
+ * the same wakeup, so timers and control requests never sit between a
+ * ready frame and its publish.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ */
+
+#ifndef __CAPTURE_LOOP_H
+#define __CAPTURE_LOOP_H
+
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include "v4l2_capture.h"
+
+#define LOOP_MAX_EVENTS		16
+
+struct loop_source;
+
+typedef void (*loop_fn)(struct loop_source *src, uint32_t events);
+
+struct loop_source {
+	int			fd;
+	uint32_t		events;
+	loop_fn			fn;
+	void			*data;
+	/* dispatched first, before the rest of the same batch */
+	bool			urgent;
+	bool			armed;
+};
+
+struct capture_loop {
+	int			epfd;
+	int			stop;
+};
+
+static inline int capture_loop_init(struct capture_loop *loop)
+{
+	loop->stop = 0;
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+
+	return 0;
+}
+
+static inline void capture_loop_exit(struct capture_loop *loop)
+{
+	close(loop->epfd);
+}
+
+static inline void loop_source_init(struct loop_source *src, int fd,
+				uint32_t events, loop_fn fn, void *data)
+{
+	src->fd = fd;
+	src->events = events;
+	src->fn = fn;
+	src->data = data;
+	src->urgent = false;
+	src->armed = false;
+}
+
+/*
+ * Add or remove src from the epoll set. Some fds can't just be masked:
+ * vb2 keeps reporting EPOLLERR while no buffer is queued, and epoll
+ * reports that whatever the event mask says.
+ */
+static inline int loop_arm(struct capture_loop *loop, struct loop_source *src,
+				bool on)
+{
+	struct epoll_event ev;
+
+	if (src->armed == on)
+		return 0;
+
+	ev.events = src->events;
+	ev.data.ptr = src;
+	if (epoll_ctl(loop->epfd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+					src->fd, &ev) < 0) {
+		perror("epoll_ctl");
+		return -1;
+	}
+	src->armed = on;
+
+	return 0;
+}
+
+static inline int loop_add(struct capture_loop *loop, struct loop_source *src)
+{
+	return loop_arm(loop, src, true);
+}
+
+static inline void loop_del(struct capture_loop *loop, struct loop_source *src)
+{
+	loop_arm(loop, src, false);
+}
+
+/* periodic timer, the handler must call loop_timer_ack() */
+static inline int loop_add_timer(struct capture_loop *loop,
+				struct loop_source *src, unsigned int period_us,
+				loop_fn fn, void *data)
+{
+	struct itimerspec its;
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		perror("timerfd_create");
+		return -1;
+	}
+
+	its.it_interval.tv_sec = period_us / 1000000;
+	its.it_interval.tv_nsec = (period_us % 1000000) * 1000;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(fd, 0, &its, NULL) < 0) {
+		perror("timerfd_settime");
+		goto err;
+	}
+
+	loop_source_init(src, fd, EPOLLIN, fn, data);
+	if (loop_add(loop, src) < 0)
+		goto err;
+
+	return 0;
+err:
+	close(fd);
+	return -1;
+}
+
+/* number of periods elapsed since the last ack */
+static inline uint64_t loop_timer_ack(struct loop_source *src)
+{
+	uint64_t ticks = 0;
+
+	if (read(src->fd, &ticks, sizeof(ticks)) != sizeof(ticks))
+		return 0;
+
+	return ticks;
+}
+
+/*
+ * Route the signals in mask to src instead of asynchronous handlers.
+ * They are blocked in the calling thread, so call this before starting
+ * any other thread that should inherit the mask.
+ */
+static inline int loop_add_signals(struct capture_loop *loop,
+				struct loop_source *src, const sigset_t *mask,
+				loop_fn fn, void *data)
+{
+	int fd;
+
+	if (pthread_sigmask(SIG_BLOCK, mask, NULL) != 0) {
+		perror("pthread_sigmask");
+		return -1;
+	}
+
+	fd = signalfd(-1, mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0) {
+		perror("signalfd");
+		return -1;
+	}
+
+	loop_source_init(src, fd, EPOLLIN, fn, data);
+	if (loop_add(loop, src) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* next pending signal, 0 when there is none */
+static inline int loop_signal_read(struct loop_source *src)
+{
+	struct signalfd_siginfo si;
+
+	if (read(src->fd, &si, sizeof(si)) != sizeof(si))
+		return 0;
+
+	return si.ssi_signo;
+}
+
+static inline void loop_close(struct capture_loop *loop,
+				struct loop_source *src)
+{
+	loop_del(loop, src);
+	close(src->fd);
+	src->fd = -1;
+}
+
+/* a source disarmed earlier in the same batch is skipped */
+static inline void loop_dispatch(struct epoll_event *evs, int n, bool urgent)
+{
+	struct loop_source *src;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		src = evs[i].data.ptr;
+		if (src->urgent == urgent && src->armed)
+			src->fn(src, evs[i].events);
+	}
+}
+
+/* run until a handler sets loop->stop, returns -1 on epoll failure */
+static inline int capture_loop_run(struct capture_loop *loop)
+{
+	struct epoll_event evs[LOOP_MAX_EVENTS];
+	int n;
+
+	while (!loop->stop) {
+		n = epoll_wait(loop->epfd, evs, LOOP_MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return -1;
+		}
+
+		loop_dispatch(evs, n, true);
+		loop_dispatch(evs, n, false);
+	}
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,219 @@
+/*
+ * Shared frame pool.
+ *
+ * Copyright (C) 2017 zhujiongfu
+ *
+ * Replaces the ftok()/shmget() segment with a named file on /dev/shm, or
+ * on hugetlbfs when huge pages are asked for, so that several streams
+ * can live side by side and the frame slots don't take a TLB miss and a
+ * page fault on every first touch.
+ *
+ * A restarted daemon builds its pool in a new file and renames it over
+ * the old one, so readers still attached to the previous run keep their
+ * mapping rather than seeing it truncated under them, and it removes the
+ * stream from the other backing so attach can't pick up a stale one.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ */
+
+#ifndef __CAPTURE_POOL_H
+#define __CAPTURE_POOL_H
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "v4l2_capture.h"
+
+#define CAPTURE_SHM_DIR		"/dev/shm"
+#define CAPTURE_HUGETLB_DIR	"/dev/hugepages"
+#define CAPTURE_HUGE_PAGE	(2 * 1024 * 1024)
+
+#define POOL_F_HUGETLB		BIT(0)	/* hugetlbfs, THP as fallback */
+#define POOL_F_POPULATE		BIT(1)	/* prefault everything at create */
+#define POOL_F_MLOCK		BIT(2)	/* and keep it resident */
+
+struct capture_pool {
+	void			*addr;
+	size_t			size;
+	int			fd;
+	bool			hugetlb;
+	char			path[PATH_MAX];
+};
+
+static inline int pool_map(struct capture_pool *pool, unsigned int flags)
+{
+	int mflags = MAP_SHARED;
+
+	if (flags & POOL_F_POPULATE)
+		mflags |= MAP_POPULATE;
+	pool->addr = mmap(NULL, pool->size, PROT_READ | PROT_WRITE, mflags,
+					pool->fd, 0);
+	if (pool->addr == MAP_FAILED) {
+		fprintf(stderr, "mmap %s error: %s\n", pool->path,
+					strerror(errno));
+		return -1;
+	}
+
+	if ((flags & POOL_F_HUGETLB) && !pool->hugetlb)
+		madvise(pool->addr, pool->size, MADV_HUGEPAGE);
+	if ((flags & POOL_F_MLOCK) && mlock(pool->addr, pool->size) < 0)
+		perror("mlock pool error");
+
+	return 0;
+}
+
+static inline int pool_path(char *path, size_t len, const char *name,
+				bool hugetlb)
+{
+	int n;
+
+	n = snprintf(path, len, "%s/capture-%s",
+			hugetlb ? CAPTURE_HUGETLB_DIR : CAPTURE_SHM_DIR, name);
+	if (n < 0 || (size_t)n >= len) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return 0;
+}
+
+static inline int pool_open(struct capture_pool *pool, const char *name,
+				bool hugetlb, int oflags)
+{
+	pool->fd = -1;
+	if (pool_path(pool->path, sizeof(pool->path), name, hugetlb) < 0)
+		return -1;
+	pool->fd = open(pool->path, oflags | O_CLOEXEC, 0666);
+	pool->hugetlb = hugetlb;
+
+	return pool->fd;
+}
+
+static inline void pool_unlink(const char *name, bool hugetlb)
+{
+	char path[PATH_MAX];
+
+	if (pool_path(path, sizeof(path), name, hugetlb) == 0)
+		unlink(path);
+}
+
+/* a new file of pool->size, mapped, then renamed to the stream's name */
+static inline int pool_create_file(struct capture_pool *pool,
+				const char *name, bool hugetlb,
+				unsigned int flags)
+{
+	char tmp[PATH_MAX];
+	int n;
+
+	n = pool_path(pool->path, sizeof(pool->path), name, hugetlb);
+	if (n == 0)
+		n = snprintf(tmp, sizeof(tmp), "%s.%d", pool->path, getpid());
+	if (n < 0 || (size_t)n >= sizeof(tmp)) {
+		fprintf(stderr, "capture stream name %s too long\n", name);
+		return -1;
+	}
+	pool->hugetlb = hugetlb;
+	unlink(tmp);
+	pool->fd = open(tmp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	if (pool->fd < 0) {
+		/* no hugetlbfs is not an error, the caller falls back */
+		if (!hugetlb)
+			fprintf(stderr, "open %s error: %s\n", tmp,
+						strerror(errno));
+		return -1;
+	}
+	if (ftruncate(pool->fd, pool->size) < 0) {
+		perror("pool ftruncate error");
+		goto err;
+	}
+	if (pool_map(pool, flags) < 0)
+		goto err;
+	if (rename(tmp, pool->path) < 0) {
+		fprintf(stderr, "rename %s error: %s\n", tmp, strerror(errno));
+		munmap(pool->addr, pool->size);
+		goto err;
+	}
+
+	return 0;
+
+err:
+	close(pool->fd);
+	unlink(tmp);
+	return -1;
+}
+
+/* Create (or recreate) the pool of the stream name. */
+static inline void *capture_pool_create(struct capture_pool *pool,
+				const char *name, size_t size,
+				unsigned int flags)
+{
+	pool->size = size;
+	if (flags & POOL_F_HUGETLB) {
+		pool->size = ALIGN(size, CAPTURE_HUGE_PAGE);
+		if (pool_create_file(pool, name, true, flags) == 0) {
+			pool_unlink(name, false);
+			return pool->addr;
+		}
+		printf("no hugetlbfs pages for %s, using THP.\n", name);
+	}
+
+	if (pool_create_file(pool, name, false, flags) < 0)
+		return NULL;
+	pool_unlink(name, true);
+
+	return pool->addr;
+}
+
+/* Attach to the pool of an existing stream. */
+static inline void *capture_pool_attach(struct capture_pool *pool,
+				const char *name)
+{
+	struct stat st;
+
+	if (pool_open(pool, name, true, O_RDWR) < 0 &&
+			pool_open(pool, name, false, O_RDWR) < 0) {
+		fprintf(stderr, "no capture stream %s: %s\n", name,
+					strerror(errno));
+		return NULL;
+	}
+	if (fstat(pool->fd, &st) < 0) {
+		perror("pool fstat error");
+		close(pool->fd);
+		return NULL;
+	}
+	pool->size = st.st_size;
+	if (pool_map(pool, 0) < 0) {
+		close(pool->fd);
+		return NULL;
+	}
+
+	return pool->addr;
+}
+
+static inline void capture_pool_detach(struct capture_pool *pool)
+{
+	munmap(pool->addr, pool->size);
+	close(pool->fd);
+}
+
+/*
+ * Remove the stream, unless a newer daemon has already renamed its own
+ * pool over the name: only unlink the path if it is still our file.
+ */
+static inline void capture_pool_destroy(struct capture_pool *pool)
+{
+	struct stat ours, st;
+	bool unlink_path;
+
+	unlink_path = fstat(pool->fd, &ours) == 0 &&
+			stat(pool->path, &st) == 0 &&
+			st.st_dev == ours.st_dev && st.st_ino == ours.st_ino;
+	capture_pool_detach(pool);
+	if (unlink_path)
+		unlink(pool->path);
+}
+
+#endif
@@ -0,0 +1,106 @@
+/*
+ * Producer side publish of one frame.
+ *
+ * Copyright (C) 2017 zhujiongfu
+ *
+ * What the daemon does with every frame it dequeues, kept in one place
+ * so that the benchmarks measure the real thing: ask the readers whether
+ * anybody takes the frame, wait for its slot, copy the whole frame or
+ * just the readers' ROIs into it and make it visible.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ */
+
+#ifndef __CAPTURE_PUBLISH_H
+#define __CAPTURE_PUBLISH_H
+
+#include "v4l2_capture.h"
+#include "capture_roi.h"
+#include "capture_stats.h"
+#include "copy_pool.h"
+
+/*
+ * Fill in meta->want. A frame no reader is going to take is counted as
+ * skipped and shouldn't be published at all.
+ */
+static inline unsigned int capture_publish_want(struct capture_data *shm,
+				struct capture_demand *d,
+				struct capture_meta *meta)
+{
+	meta->want = ring_demand(shm, d, meta);
+	if (!meta->want)
+		WRITE_ONCE(shm->skipped, shm->skipped + 1);
+
+	return meta->want;
+}
+
+/*
+ * Publish only the rectangles the readers registered. ROIs of different
+ * readers that overlap are copied twice, they are few and small next to
+ * a whole frame. Rows go through plain memcpy: the streaming kernels
+ * flush a partial line at both ends of every short row, and a ROI is
+ * read back soon enough that it may as well stay in the cache.
+ */
+static inline void capture_copy_rois(struct capture_data *shm,
+				const struct capture_layout *l, char *dst,
+				const unsigned char *src)
+{
+	struct capture_reader *r;
+	struct capture_roi roi;
+	unsigned int i, n, p, nr;
+	unsigned int off, len, rows;
+
+	for (i = 0; i < CAPTURE_MAX_READERS; i++) {
+		r = &shm->readers[i];
+		if (smp_load_acquire(&r->state) != READER_ACTIVE)
+			continue;
+		nr = smp_load_acquire(&r->nr_rois);
+		for (n = 0; n < nr && n < CAPTURE_MAX_ROIS; n++) {
+			roi = r->rois[n];
+			for (p = 0; p < l->nplanes; p++) {
+				off = capture_roi_rect(l, p, &roi, &len, &rows);
+				while (rows--) {
+					memcpy(dst + off, src + off, len);
+					off += l->planes[p].stride;
+				}
+			}
+		}
+	}
+}
+
+/*
+ * Copy the frame at src into the next slot and publish it with meta,
+ * timed into st if there is one. Returns true if only the ROIs went in.
+ */
+static inline bool capture_publish(struct capture_data *shm,
+				struct capture_stats *st,
+				struct copy_pool *copy,
+				const struct capture_layout *l,
+				const unsigned char *src,
+				struct capture_meta *meta)
+{
+	bool partial;
+	char *slot;
+	uint64_t t;
+
+	t = stat_begin(st);
+	slot = ring_write_begin(shm);
+	t = stat_end(st, STAT_WAIT, t);
+	partial = ring_roi_only(shm, &meta->roi_gen);
+	if (partial) {
+		meta->flags |= CAPTURE_META_PARTIAL;
+		capture_copy_rois(shm, l, slot, src);
+	} else {
+		copy_pool_run(copy, slot, src, meta->bytesused,
+					shm->bytesperline);
+	}
+	t = stat_end(st, STAT_COPY, t);
+	ring_write_end(shm, meta);
+	stat_end(st, STAT_PUBLISH, t);
+
+	return partial;
+}
+
+#endif
@@ -0,0 +1,122 @@
+/*
+ * @file capture_rec.c
+ *
+ * Copyright 2017 zhujiongfu.
+ *
+ * Inspect recordings made by demo: stream parameters and frame count,
+ * index rebuild, and extraction of the frame at a given time.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "capture_file.h"
+
+static void print_info(const struct capfile *f)
+{
+	const struct capfile_header *hdr = &f->hdr;
+	uint64_t span = 0;
+	char fourcc[5];
+
+	memcpy(fourcc, &hdr->fmt, 4);
+	fourcc[4] = '\0';
+	if (f->count > 1)
+		span = f->index[f->count - 1].timestamp_us -
+					f->index[0].timestamp_us;
+
+	printf("%ux%u %s bpl %u sizeimage %u\n", hdr->width, hdr->height,
+			fourcc, hdr->bytesperline, hdr->sizeimage);
+	printf("%llu frames, %llu.%03llus, %llu bytes\n",
+			(unsigned long long)f->count,
+			(unsigned long long)(span / 1000000),
+			(unsigned long long)(span / 1000 % 1000),
+			(unsigned long long)f->size);
+	if (f->count)
+		printf("sequence %u .. %u\n", f->index[0].sequence,
+				f->index[f->count - 1].sequence);
+}
+
+/* frame at ms after the first one, written to out if given */
+static int seek_frame(const struct capfile *f, const char *arg,
+				const char *out)
+{
+	const struct capfile_index_entry *e;
+	uint64_t i;
+	FILE *file;
+	char *buf;
+	ssize_t n;
+
+	if (!f->count) {
+		printf("empty recording.\n");
+		return -1;
+	}
+
+	i = capfile_seek(f, f->index[0].timestamp_us +
+				strtoull(arg, NULL, 0) * 1000);
+	if (i == f->count) {
+		printf("past the end.\n");
+		return -1;
+	}
+	e = &f->index[i];
+	printf("frame %llu: sequence %u at +%llums, %u bytes @%llu\n",
+			(unsigned long long)i, e->sequence,
+			(unsigned long long)((e->timestamp_us -
+					f->index[0].timestamp_us) / 1000),
+			e->size, (unsigned long long)e->offset);
+	if (!out)
+		return 0;
+
+	buf = malloc(e->size);
+	if (!buf)
+		return -1;
+	n = capfile_read(f, i, buf, e->size);
+	file = fopen(out, "wb");
+	if (n != e->size || !file || fwrite(buf, n, 1, file) != 1) {
+		printf("failed to extract frame to %s.\n", out);
+		if (file)
+			fclose(file);
+		free(buf);
+		return -1;
+	}
+	fclose(file);
+	free(buf);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct capfile f;
+	int ret = 0;
+
+	if (argc < 3) {
+		printf("usage: %s info|rebuild|seek <file> [ms [out]]\n",
+					argv[0]);
+		return -1;
+	}
+
+	if (!strcmp(argv[1], "rebuild"))
+		return capfile_rebuild_index(argv[2]);
+
+	if (capfile_open(&f, argv[2]) < 0)
+		return -1;
+
+	if (!strcmp(argv[1], "info")) {
+		print_info(&f);
+	} else if (!strcmp(argv[1], "seek") && argc > 3) {
+		ret = seek_frame(&f, argv[3], argc > 4 ? argv[4] : NULL);
+	} else {
+		printf("unknown command %s\n", argv[1]);
+		ret = -1;
+	}
+
+	capfile_close(&f);
+
+	return ret;
+}
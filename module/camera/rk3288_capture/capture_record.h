@@ -0,0 +1,335 @@
+/*
+ * Asynchronous frame recorder.
+ *
+ * Copyright (C) 2017 zhujiongfu
+ *
+ * Frames are copied into a write-behind ring of aligned chunks and a
+ * writer thread streams full chunks to disk, so a slow eMMC or SD card
+ * only ever stalls the writer. The consumer never blocks: when the ring
+ * is full the frame is dropped and counted. Optionally the file is
+ * opened O_DIRECT, it is preallocated in RECORD_PREALLOC steps, and
+ * fdatasync runs at most once per sync interval instead of per frame.
+ *
+ *	record_open(&rec, "/tmp/stream.out", 0, RECORD_F_DIRECT);
+ *	record_frame(&rec, data, len);
+ *	if (the source turned out to be overwritten)
+ *		record_abort(&rec);
+ *	else
+ *		record_commit(&rec);
+ *	record_close(&rec);
+ *
+ * A frame only reaches the writer once committed, so a frame that was
+ * overwritten while being copied in can still be taken back.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ */
+
+#ifndef __CAPTURE_RECORD_H
+#define __CAPTURE_RECORD_H
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "v4l2_capture.h"
+
+/* O_DIRECT buffer, offset and length alignment */
+#define RECORD_ALIGN		4096
+#define RECORD_CHUNK		(1024 * 1024)
+/* 32MB, a couple of seconds of 1080p NV12 at 30fps */
+#define RECORD_CHUNKS		32
+#define RECORD_PREALLOC		(64 * 1024 * 1024)
+#define RECORD_SYNC_MS		1000
+
+#define RECORD_F_DIRECT		BIT(0)
+
+struct capture_recorder {
+	int			fd;
+	unsigned int		flags;
+	unsigned int		nr_chunks;
+	unsigned char		*bufs;
+	pthread_t		tid;
+
+	/* producer: bytes copied in, and up to where they are committed */
+	uint64_t		pos;
+	uint64_t		commit_pos;
+	uint64_t		frames;
+	uint64_t		drops;
+	/* chunks handed to the writer, also its futex word */
+	unsigned int		head;
+	unsigned int		stop;
+	/* length of the last chunk, valid once stop is set */
+	unsigned int		final_len;
+
+	/* writer */
+	unsigned int		tail __cacheline_aligned;
+	uint64_t		offset;
+	uint64_t		allocated;
+	uint64_t		synced_us;
+	unsigned int		max_depth;
+	unsigned int		writes;
+	unsigned int		syncs;
+	uint64_t		write_us;
+	unsigned int		max_write_us;
+	unsigned int		max_sync_us;
+	int			err;
+};
+
+static inline unsigned char *record_chunk(struct capture_recorder *rec,
+				uint64_t pos)
+{
+	return rec->bufs + (pos / RECORD_CHUNK % rec->nr_chunks) *
+					RECORD_CHUNK;
+}
+
+static inline int record_pwrite(struct capture_recorder *rec,
+				const unsigned char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pwrite(rec->fd, buf, len, rec->offset);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		rec->offset += n;
+	}
+
+	return 0;
+}
+
+static inline void record_sync(struct capture_recorder *rec)
+{
+	uint64_t t = capture_now_us();
+
+	fdatasync(rec->fd);
+	rec->synced_us = capture_now_us();
+	rec->syncs++;
+	if (rec->synced_us - t > rec->max_sync_us)
+		rec->max_sync_us = rec->synced_us - t;
+}
+
+/* write one chunk, growing the preallocation ahead of it */
+static inline int record_write_chunk(struct capture_recorder *rec,
+				unsigned int tail, bool last)
+{
+	const unsigned char *buf;
+	unsigned int len = RECORD_CHUNK;
+	uint64_t t;
+
+	if (last) {
+		len = rec->final_len;
+		if (rec->flags & RECORD_F_DIRECT)
+			len = ALIGN(len, RECORD_ALIGN);
+	}
+
+	if (rec->offset + len > rec->allocated) {
+		if (fallocate(rec->fd, FALLOC_FL_KEEP_SIZE, rec->allocated,
+					RECORD_PREALLOC) == 0)
+			rec->allocated += RECORD_PREALLOC;
+		else
+			rec->allocated = UINT64_MAX;
+	}
+
+	buf = rec->bufs + (tail % rec->nr_chunks) * RECORD_CHUNK;
+	t = capture_now_us();
+	if (record_pwrite(rec, buf, len) < 0)
+		return -1;
+	t = capture_now_us() - t;
+
+	rec->writes++;
+	rec->write_us += t;
+	if (t > rec->max_write_us)
+		rec->max_write_us = t;
+
+	if (capture_now_us() - rec->synced_us >= RECORD_SYNC_MS * 1000)
+		record_sync(rec);
+
+	return 0;
+}
+
+static inline void *record_writer_fn(void *arg)
+{
+	struct capture_recorder *rec = arg;
+	unsigned int head, tail = 0;
+	bool stop;
+
+	for (;;) {
+		stop = smp_load_acquire(&rec->stop);
+		head = smp_load_acquire(&rec->head);
+		if (tail == head) {
+			if (stop)
+				break;
+			syscall(SYS_futex, &rec->head, FUTEX_WAIT_PRIVATE,
+						head, NULL, NULL, 0);
+			continue;
+		}
+
+		if (head - tail > rec->max_depth)
+			rec->max_depth = head - tail;
+		if (record_write_chunk(rec, tail,
+					stop && tail + 1 == head) < 0) {
+			rec->err = errno;
+			perror("record write");
+			/* keep draining so the producer never wedges */
+		}
+		smp_store_release(&rec->tail, ++tail);
+	}
+
+	return NULL;
+}
+
+static inline int record_open(struct capture_recorder *rec, const char *path,
+				unsigned int nr_chunks, unsigned int flags)
+{
+	int oflags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->nr_chunks = nr_chunks ? nr_chunks : RECORD_CHUNKS;
+	rec->flags = flags;
+
+	if (flags & RECORD_F_DIRECT) {
+		rec->fd = open(path, oflags | O_DIRECT, 0644);
+		if (rec->fd < 0 && errno == EINVAL) {
+			/* tmpfs and friends */
+			printf("%s: no O_DIRECT here, using the page cache.\n",
+						path);
+			rec->flags &= ~RECORD_F_DIRECT;
+		}
+	}
+	if (!(rec->flags & RECORD_F_DIRECT))
+		rec->fd = open(path, oflags, 0644);
+	if (rec->fd < 0) {
+		perror("open record file");
+		return -1;
+	}
+
+	rec->bufs = aligned_alloc(RECORD_ALIGN,
+				(size_t)rec->nr_chunks * RECORD_CHUNK);
+	if (!rec->bufs) {
+		printf("%s: failed to alloc record buffers.\n", path);
+		goto err;
+	}
+	/* fault the ring in now rather than on the consumer's time */
+	memset(rec->bufs, 0, (size_t)rec->nr_chunks * RECORD_CHUNK);
+
+	rec->synced_us = capture_now_us();
+	if (pthread_create(&rec->tid, NULL, record_writer_fn, rec) != 0) {
+		printf("%s: failed to start writer.\n", path);
+		free(rec->bufs);
+		goto err;
+	}
+
+	return 0;
+err:
+	close(rec->fd);
+	return -1;
+}
+
+/* bytes that can be copied in before the writer frees a chunk */
+static inline uint64_t record_room(struct capture_recorder *rec)
+{
+	uint64_t tail = smp_load_acquire(&rec->tail);
+
+	return (uint64_t)rec->nr_chunks * RECORD_CHUNK -
+				(rec->pos - tail * RECORD_CHUNK);
+}
+
+/*
+ * Copy a frame into the ring. Returns -EAGAIN, and counts a drop, if the
+ * writer is too far behind to take it; nothing waits on the disk here.
+ */
+static inline int record_frame(struct capture_recorder *rec,
+				const void *data, size_t len)
+{
+	const unsigned char *src = data;
+	size_t room, n;
+
+	if (len > record_room(rec)) {
+		rec->drops++;
+		return -EAGAIN;
+	}
+
+	while (len) {
+		room = RECORD_CHUNK - rec->pos % RECORD_CHUNK;
+		n = len < room ? len : room;
+		memcpy(record_chunk(rec, rec->pos) + rec->pos % RECORD_CHUNK,
+					src, n);
+		rec->pos += n;
+		src += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* hand the chunks filled up by committed frames to the writer */
+static inline void record_commit(struct capture_recorder *rec)
+{
+	unsigned int head = rec->commit_pos / RECORD_CHUNK;
+
+	rec->commit_pos = rec->pos;
+	rec->frames++;
+	if (rec->commit_pos / RECORD_CHUNK == head)
+		return;
+
+	smp_store_release(&rec->head, rec->commit_pos / RECORD_CHUNK);
+	syscall(SYS_futex, &rec->head, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* forget what was copied in since the last commit */
+static inline void record_abort(struct capture_recorder *rec)
+{
+	rec->pos = rec->commit_pos;
+	rec->drops++;
+}
+
+static inline void record_print_stats(struct capture_recorder *rec)
+{
+	unsigned int head = READ_ONCE(rec->head);
+	unsigned int tail = READ_ONCE(rec->tail);
+
+	printf("record: frames %llu drops %llu %lluMB, queue %u/%u max %u, "
+		"write avg %uus max %uus, %u syncs max %uus\n",
+		(unsigned long long)rec->frames,
+		(unsigned long long)rec->drops,
+		(unsigned long long)(rec->commit_pos >> 20), head - tail,
+		rec->nr_chunks, READ_ONCE(rec->max_depth),
+		rec->writes ? (unsigned int)(rec->write_us / rec->writes) : 0,
+		READ_ONCE(rec->max_write_us), READ_ONCE(rec->syncs),
+		READ_ONCE(rec->max_sync_us));
+}
+
+/* flush everything committed, trim the padding and preallocation */
+static inline int record_close(struct capture_recorder *rec)
+{
+	unsigned int head = rec->commit_pos / RECORD_CHUNK;
+
+	rec->pos = rec->commit_pos;
+	rec->final_len = rec->commit_pos % RECORD_CHUNK;
+	if (rec->final_len)
+		head++;
+	else
+		rec->final_len = RECORD_CHUNK;
+	smp_store_release(&rec->head, head);
+	smp_store_release(&rec->stop, 1);
+	syscall(SYS_futex, &rec->head, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	pthread_join(rec->tid, NULL);
+
+	if (ftruncate(rec->fd, rec->commit_pos) < 0)
+		perror("ftruncate record file");
+	fdatasync(rec->fd);
+	close(rec->fd);
+	free(rec->bufs);
+
+	return rec->err ? -1 : 0;
+}
+
+#endif
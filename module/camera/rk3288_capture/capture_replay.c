@@ -0,0 +1,408 @@
+/*
+ * @file capture_replay.c
+ *
+ * Copyright 2017 zhujiongfu.
+ *
+ * Replay producer: publishes a recording into a shared frame pool laid
+ * out exactly like the one v4l2_capture creates, so consumers can be
+ * load tested and field recordings reproduced without a camera. Frames
+ * are copied into the slots straight from an mmap of the file.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+#include "v4l2_capture.h"
+#include "capture_file.h"
+#include "capture_pool.h"
+#include "capture_publish.h"
+#include "capture_roi.h"
+#include "copy_kernel.h"
+
+#define REPLAY_SLOTS		8
+#define REPLAY_DEFAULT_FPS	30
+
+enum replay_pacing {
+	PACE_ORIGINAL,		/* the recorded timestamps */
+	PACE_FPS,		/* a fixed rate */
+	PACE_ASAP,		/* as fast as the ring takes them */
+};
+
+struct replay {
+	/* a capfile recording, or a headerless dump of raw frames */
+	struct capfile		file;
+	bool			raw;
+	unsigned int		width;
+	unsigned int		height;
+	unsigned int		fmt;
+	unsigned int		bytesperline;
+	unsigned int		sizeimage;
+	uint64_t		count;
+
+	int			fd;
+	uint64_t		size;
+	/* the whole file, or NULL and a window per frame */
+	const unsigned char	*map;
+	void			*win;
+	size_t			win_len;
+
+	enum replay_pacing	pacing;
+	unsigned int		fps;
+	bool			loop;
+
+	struct capture_pool	pool;
+	struct capture_data	*shm;
+	struct capture_demand	demand;
+	const struct copy_kernel *copy;
+
+	uint64_t		published;
+	uint64_t		late;
+};
+
+static volatile sig_atomic_t quit;
+
+static void on_quit(int sig)
+{
+	quit = 1;
+}
+
+static void replay_frame_info(struct replay *r, uint64_t i, uint64_t *off,
+				unsigned int *size, unsigned int *sequence,
+				uint64_t *timestamp_us)
+{
+	const struct capfile_index_entry *e;
+
+	if (r->raw) {
+		*off = i * r->sizeimage;
+		*size = r->sizeimage;
+		*sequence = i;
+		*timestamp_us = i * 1000000 / r->fps;
+		return;
+	}
+
+	e = &r->file.index[i];
+	*off = e->offset + sizeof(struct capfile_frame);
+	*size = e->size < r->sizeimage ? e->size : r->sizeimage;
+	*sequence = e->sequence;
+	*timestamp_us = e->timestamp_us;
+}
+
+/*
+ * Map the frame at off. 32-bit targets can't map a multi-GB recording
+ * in one go, then each frame gets its own window.
+ */
+static const unsigned char *replay_map(struct replay *r, uint64_t off,
+				unsigned int size)
+{
+	uint64_t start = off & ~(uint64_t)(CAPTURE_PAGE_SIZE - 1);
+
+	if (r->map)
+		return r->map + off;
+
+	if (r->win)
+		munmap(r->win, r->win_len);
+	r->win_len = off - start + size;
+	r->win = mmap(NULL, r->win_len, PROT_READ, MAP_SHARED, r->fd, start);
+	if (r->win == MAP_FAILED) {
+		perror("mmap frame");
+		r->win = NULL;
+		return NULL;
+	}
+
+	return (unsigned char *)r->win + (off - start);
+}
+
+static int replay_open(struct replay *r, const char *path)
+{
+	struct capture_layout l;
+	const struct capture_layout_plane *p;
+	struct stat st;
+	void *map;
+
+	if (r->raw) {
+		r->fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (r->fd < 0 || fstat(r->fd, &st) < 0) {
+			perror("open recording");
+			return -1;
+		}
+		r->size = st.st_size;
+		capture_layout(&l, r->fmt, r->width, r->height, 0, 0);
+		p = &l.planes[l.nplanes - 1];
+		r->bytesperline = l.planes[0].stride;
+		r->sizeimage = p->offset + p->stride * p->height;
+		r->count = r->sizeimage ? r->size / r->sizeimage : 0;
+	} else {
+		if (capfile_open(&r->file, path) < 0)
+			return -1;
+		r->fd = r->file.fd;
+		r->size = r->file.size;
+		r->width = r->file.hdr.width;
+		r->height = r->file.hdr.height;
+		r->fmt = r->file.hdr.fmt;
+		r->bytesperline = r->file.hdr.bytesperline;
+		r->sizeimage = r->file.hdr.sizeimage;
+		r->count = r->file.count;
+	}
+
+	if (!r->count) {
+		printf("%s: no frames to replay.\n", path);
+		return -1;
+	}
+
+	if (r->size <= SIZE_MAX) {
+		map = mmap(NULL, r->size, PROT_READ, MAP_SHARED, r->fd, 0);
+		if (map != MAP_FAILED) {
+			madvise(map, r->size, MADV_SEQUENTIAL);
+			r->map = map;
+		}
+	}
+
+	return 0;
+}
+
+static void replay_close(struct replay *r)
+{
+	if (r->map)
+		munmap((void *)r->map, r->size);
+	if (r->win)
+		munmap(r->win, r->win_len);
+	if (r->raw)
+		close(r->fd);
+	else
+		capfile_close(&r->file);
+}
+
+static int replay_create_pool(struct replay *r, const char *name,
+				unsigned int slots, unsigned int flags)
+{
+	size_t size;
+
+	size = capture_data_size(slots) +
+			capture_slot_size(r->sizeimage) * slots;
+	r->shm = capture_pool_create(&r->pool, name, size, flags);
+	if (!r->shm) {
+		printf("Failed to init shm.\n");
+		return -1;
+	}
+	r->shm->width = r->width;
+	r->shm->height = r->height;
+	r->shm->fmt = r->fmt;
+	r->shm->bytesperline = r->bytesperline;
+	ring_init(r->shm, slots, r->sizeimage);
+
+	return 0;
+}
+
+static void sleep_until(uint64_t us)
+{
+	struct timespec ts;
+
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = us % 1000000 * 1000;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+static void replay_stats(struct replay *r, uint64_t start)
+{
+	uint64_t t = capture_now_us() - start;
+
+	printf("replay: %llu frames in %llu.%03llus, %.1f fps, %llu late, "
+		"%u skipped, %u stalls\n", (unsigned long long)r->published,
+		(unsigned long long)(t / 1000000),
+		(unsigned long long)(t / 1000 % 1000),
+		t ? r->published * 1e6 / t : 0.0,
+		(unsigned long long)r->late, READ_ONCE(r->shm->skipped),
+		READ_ONCE(r->shm->stalls));
+}
+
+/*
+ * Publish every frame of the recording, over and over with -l. Frames
+ * are stamped with the time they are published, as if just captured,
+ * and on each pass the sequence numbers continue where the last one
+ * ended, keeping the gaps of the original, so readers' latency and loss
+ * accounting stays meaningful.
+ */
+static void replay_run(struct replay *r)
+{
+	uint64_t off, ts, ts0, last_ts, span, due = 0, period;
+	unsigned int size, seq, seq0, last_seq, seq_span;
+	uint64_t start, report, i, pass = 0;
+	const unsigned char *src;
+	struct capture_meta meta;
+	char *slot;
+
+	replay_frame_info(r, 0, &off, &size, &seq0, &ts0);
+	replay_frame_info(r, r->count - 1, &off, &size, &last_seq, &last_ts);
+	period = 1000000 / (r->fps ? r->fps : REPLAY_DEFAULT_FPS);
+	/* one pass lasts until the frame after the last one */
+	span = last_ts - ts0 + (r->count > 1 ?
+			(last_ts - ts0) / (r->count - 1) : period);
+	seq_span = last_seq - seq0 + 1;
+
+	start = capture_now_us();
+	report = start + 1000000;
+	for (i = 0; !quit; i++) {
+		if (i == r->count) {
+			if (!r->loop)
+				break;
+			i = 0;
+			pass++;
+		}
+		replay_frame_info(r, i, &off, &size, &seq, &ts);
+
+		switch (r->pacing) {
+		case PACE_ORIGINAL:
+			due = start + pass * span + (ts - ts0);
+			break;
+		case PACE_FPS:
+			due = start + (pass * r->count + i) * period;
+			break;
+		case PACE_ASAP:
+			due = 0;
+			break;
+		}
+		if (due) {
+			sleep_until(due);
+			if (quit)
+				break;
+			if (capture_now_us() > due + period)
+				r->late++;
+		}
+
+		memset(&meta, 0, sizeof(meta));
+		meta.sequence = seq + pass * seq_span;
+		meta.bytesused = size;
+		meta.timestamp_us = capture_now_us();
+		if (!capture_publish_want(r->shm, &r->demand, &meta))
+			goto next;
+
+		src = replay_map(r, off, size);
+		if (!src)
+			break;
+		if (r->map && i + 1 < r->count)
+			madvise((void *)((uintptr_t)(r->map + off + size) &
+					~(uintptr_t)(CAPTURE_PAGE_SIZE - 1)),
+					size, MADV_WILLNEED);
+
+		slot = ring_write_begin(r->shm);
+		r->copy->fn(slot, src, size);
+		ring_write_end(r->shm, &meta);
+		r->published++;
+next:
+		if (capture_now_us() >= report) {
+			capture_reap_readers(r->shm);
+			replay_stats(r, start);
+			report += 1000000;
+		}
+	}
+
+	replay_stats(r, start);
+}
+
+/* WxH:FOURCC, e.g. 640x480:NV12 */
+static int parse_raw(struct replay *r, const char *arg)
+{
+	char fourcc[5];
+
+	if (sscanf(arg, "%ux%u:%4s", &r->width, &r->height, fourcc) != 3 ||
+			strlen(fourcc) != 4) {
+		printf("raw format is WxH:FOURCC, not %s\n", arg);
+		return -1;
+	}
+	r->fmt = v4l2_fourcc(fourcc[0], fourcc[1], fourcc[2], fourcc[3]);
+	r->raw = true;
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	printf("usage: %s [-n stream] [-p orig|asap|<fps>] [-l] [-s slots]\n"
+		"\t[-k copy kernel] [-r WxH:FOURCC] file\n"
+		"  -r replays a headerless dump of raw frames, orig pacing\n"
+		"     then means %u fps\n", prog, REPLAY_DEFAULT_FPS);
+}
+
+int main(int argc, char **argv)
+{
+	struct replay r;
+	const char *name = CAPTURE_DEFAULT_STREAM;
+	const char *kernel = NULL;
+	unsigned int slots = REPLAY_SLOTS;
+	struct sigaction sa;
+	int opt;
+
+	memset(&r, 0, sizeof(r));
+	r.pacing = PACE_ORIGINAL;
+	r.fps = REPLAY_DEFAULT_FPS;
+	while ((opt = getopt(argc, argv, "n:p:ls:k:r:")) != -1) {
+		switch (opt) {
+		case 'n':
+			name = optarg;
+			break;
+		case 'p':
+			if (!strcmp(optarg, "orig")) {
+				r.pacing = PACE_ORIGINAL;
+			} else if (!strcmp(optarg, "asap")) {
+				r.pacing = PACE_ASAP;
+			} else {
+				r.pacing = PACE_FPS;
+				r.fps = strtoul(optarg, NULL, 0);
+			}
+			break;
+		case 'l':
+			r.loop = true;
+			break;
+		case 's':
+			slots = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			kernel = optarg;
+			break;
+		case 'r':
+			if (parse_raw(&r, optarg) < 0)
+				return -1;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	if (optind >= argc || !r.fps || !slots || (slots & (slots - 1))) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_quit;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (replay_open(&r, argv[optind]) < 0)
+		return -1;
+	if (replay_create_pool(&r, name, slots, 0) < 0) {
+		replay_close(&r);
+		return -1;
+	}
+	r.copy = copy_kernel_select(kernel);
+
+	printf("%s: %llu frames %ux%u, copy kernel %s\n", name,
+			(unsigned long long)r.count, r.width, r.height,
+			r.copy->name);
+	replay_run(&r);
+
+	capture_pool_destroy(&r.pool);
+	replay_close(&r);
+
+	return 0;
+}
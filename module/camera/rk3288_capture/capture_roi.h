@@ -0,0 +1,158 @@
+/*
+ * Frame layout and regions of interest.
+ *
+ * Copyright (C) 2017 zhujiongfu
+ *
+ * A reader that only looks at parts of the frame registers them as
+ * named ROIs (see capture_roi_add() in libcapture.h) and reads them
+ * through views into the published frame, without a copy. While every
+ * active reader has ROIs registered the producer publishes only those
+ * rectangles, so the publish copy scales with the area that is actually
+ * read. Such frames carry CAPTURE_META_PARTIAL; whole-frame readers
+ * never see them.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ */
+
+#ifndef __CAPTURE_ROI_H
+#define __CAPTURE_ROI_H
+
+#include <linux/videodev2.h>
+#include "v4l2_capture.h"
+
+#define CAPTURE_MAX_PLANES	3
+
+struct capture_layout_plane {
+	unsigned int		offset;		/* from the start of the frame */
+	unsigned int		stride;
+	unsigned int		width;		/* in bytes */
+	unsigned int		height;
+	/* subsampling and bytes per sample, to map pixels to bytes */
+	unsigned int		xshift;
+	unsigned int		yshift;
+	unsigned int		cpp;
+};
+
+struct capture_layout {
+	unsigned int		nplanes;
+	/* ROIs are rounded out to these, in pixels */
+	unsigned int		x_align;
+	unsigned int		y_align;
+	struct capture_layout_plane planes[CAPTURE_MAX_PLANES];
+};
+
+static inline void layout_plane(struct capture_layout_plane *p,
+				unsigned int offset, unsigned int stride,
+				unsigned int width, unsigned int height,
+				unsigned int xshift, unsigned int yshift,
+				unsigned int cpp)
+{
+	p->offset = offset;
+	p->stride = stride;
+	p->width = width;
+	p->height = height;
+	p->xshift = xshift;
+	p->yshift = yshift;
+	p->cpp = cpp;
+}
+
+/*
+ * Lay the planes of fmt out over a contiguous V4L2 single-planar buffer
+ * of w x h pixels, bpl bytes per luma line and size bytes in total.
+ */
+static inline void capture_layout(struct capture_layout *l, unsigned int fmt,
+				unsigned int w, unsigned int h, unsigned int bpl,
+				unsigned int size)
+{
+	unsigned int cpp;
+
+	l->x_align = 1;
+	l->y_align = 1;
+
+	switch (fmt) {
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_NV21:
+		bpl = bpl ? bpl : w;
+		l->nplanes = 2;
+		l->x_align = 2;
+		l->y_align = 2;
+		layout_plane(&l->planes[0], 0, bpl, w, h, 0, 0, 1);
+		layout_plane(&l->planes[1], bpl * h, bpl, w, h / 2, 1, 1, 2);
+		break;
+	case V4L2_PIX_FMT_YUV420:
+		bpl = bpl ? bpl : w;
+		l->nplanes = 3;
+		l->x_align = 2;
+		l->y_align = 2;
+		layout_plane(&l->planes[0], 0, bpl, w, h, 0, 0, 1);
+		layout_plane(&l->planes[1], bpl * h, bpl / 2,
+					w / 2, h / 2, 1, 1, 1);
+		layout_plane(&l->planes[2], bpl * h + bpl / 2 * (h / 2),
+					bpl / 2, w / 2, h / 2, 1, 1, 1);
+		break;
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_UYVY:
+		l->x_align = 2;
+		/* fall through */
+	case V4L2_PIX_FMT_RGB565:
+		bpl = bpl ? bpl : w * 2;
+		l->nplanes = 1;
+		layout_plane(&l->planes[0], 0, bpl, w * 2, h, 0, 0, 2);
+		break;
+	default:
+		/* unknown layout: one plane covering the whole image */
+		bpl = bpl ? bpl : size / (h ? h : 1);
+		cpp = w ? bpl / w : 0;
+		l->nplanes = 1;
+		layout_plane(&l->planes[0], 0, bpl, bpl, h, 0, 0,
+					cpp ? cpp : 1);
+		break;
+	}
+}
+
+/* round roi out to the format's alignment and clip it to the frame */
+static inline void capture_roi_fit(const struct capture_layout *l,
+				struct capture_roi *roi, unsigned int w,
+				unsigned int h)
+{
+	unsigned int x1 = roi->x + roi->width, y1 = roi->y + roi->height;
+
+	x1 = ALIGN(x1 < w ? x1 : w, l->x_align);
+	y1 = ALIGN(y1 < h ? y1 : h, l->y_align);
+	roi->x &= ~(l->x_align - 1);
+	roi->y &= ~(l->y_align - 1);
+	roi->width = x1 > roi->x ? x1 - roi->x : 0;
+	roi->height = y1 > roi->y ? y1 - roi->y : 0;
+}
+
+/*
+ * Byte offset, bytes per row and rows of roi within plane i. The result
+ * stays inside the plane whatever roi holds, the producer relies on that
+ * when it reads ROIs a reader may be rewriting.
+ */
+static inline unsigned int capture_roi_rect(const struct capture_layout *l,
+				unsigned int i, const struct capture_roi *roi,
+				unsigned int *len, unsigned int *rows)
+{
+	const struct capture_layout_plane *p = &l->planes[i];
+	unsigned int x = (roi->x >> p->xshift) * p->cpp;
+	unsigned int y = roi->y >> p->yshift;
+
+	*len = (roi->width >> p->xshift) * p->cpp;
+	*rows = roi->height >> p->yshift;
+	if (x >= p->width || y >= p->height) {
+		*len = 0;
+		*rows = 0;
+		return p->offset;
+	}
+	if (*len > p->width - x)
+		*len = p->width - x;
+	if (*rows > p->height - y)
+		*rows = p->height - y;
+
+	return p->offset + y * p->stride + x;
+}
+
+#endif
@@ -0,0 +1,204 @@
+/*
+ * Hot path latency histograms.
+ *
+ * Copyright (C) 2017 zhujiongfu
+ *
+ * With --stats the daemon creates a second, small pool next to each
+ * stream, "<stream>-stats" (a little over 4KB, so two pages), and times
+ * every stage a frame goes through: the dequeue, waiting for the slot,
+ * the copy into it, the publish, the requeue, and on the consumer side
+ * the delivery (publish to acquire) and how long the frame is held. Each
+ * stage is a log-linear histogram of plain counters that are only ever
+ * incremented, so capstat can read them at any time, without a lock, and
+ * work out rates and percentiles from the deltas.
+ *
+ * A stage costs two vDSO clock reads and a counter increment, and with
+ * stats off it costs a branch.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ */
+
+#ifndef __CAPTURE_STATS_H
+#define __CAPTURE_STATS_H
+
+#include "v4l2_capture.h"
+#include "capture_pool.h"
+
+#define CAPTURE_STATS_MAGIC	0x54535043	/* "CPST" */
+#define CAPTURE_STATS_VERSION	1
+
+/* 4 buckets per power of two, nanoseconds up to 2^33 (8.6s) */
+#define STAT_SUB_BITS		2
+#define STAT_SUB		(1 << STAT_SUB_BITS)
+#define STAT_BUCKETS		128
+
+enum capture_stage {
+	STAT_DQBUF,		/* VIDIOC_DQBUF */
+	STAT_WAIT,		/* ring_write_begin(), block-producer readers */
+	STAT_COPY,		/* driver buffer to shm slot */
+	STAT_PUBLISH,		/* ring_write_end(), including the wakeup */
+	STAT_REQUEUE,		/* VIDIOC_QBUF of a batch */
+	STAT_ACQUIRE,		/* publish to consumer acquire */
+	STAT_HOLD,		/* consumer acquire to release */
+	STAT_NR_STAGES,
+};
+
+/*
+ * 32-bit counters so that a reader never sees a torn value on 32-bit
+ * targets; they wrap after 4G events, deltas don't care.
+ */
+struct capture_hist {
+	unsigned int		count;
+	unsigned int		buckets[STAT_BUCKETS];
+} __cacheline_aligned;
+
+struct capture_stats {
+	unsigned int		magic;
+	unsigned int		version;
+	struct capture_hist	hist[STAT_NR_STAGES];
+	/* releases that found the frame overwritten */
+	unsigned int		torn;
+};
+
+static inline unsigned int stat_bucket(uint64_t ns)
+{
+	unsigned int msb, b;
+
+	if (ns < STAT_SUB)
+		return ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	b = (msb - STAT_SUB_BITS + 1) * STAT_SUB +
+			((ns >> (msb - STAT_SUB_BITS)) & (STAT_SUB - 1));
+
+	return b < STAT_BUCKETS ? b : STAT_BUCKETS - 1;
+}
+
+/* smallest value that lands in bucket b */
+static inline uint64_t stat_bucket_ns(unsigned int b)
+{
+	unsigned int msb;
+
+	if (b < STAT_SUB)
+		return b;
+
+	msb = b / STAT_SUB + STAT_SUB_BITS - 1;
+	return (1ull << msb) + ((uint64_t)(b % STAT_SUB) <<
+					(msb - STAT_SUB_BITS));
+}
+
+static inline uint64_t stat_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* start timing a stage, 0 when stats are off */
+static inline uint64_t stat_begin(struct capture_stats *st)
+{
+	return st ? stat_now() : 0;
+}
+
+/*
+ * Account the time since start to stage and return now, which can
+ * start the next stage. Producer stages have a single writer; consumer
+ * stages are shared by every reader of the stream, hence the atomics.
+ */
+static inline uint64_t stat_end(struct capture_stats *st,
+				enum capture_stage stage, uint64_t start)
+{
+	struct capture_hist *h;
+	unsigned int *bucket;
+	uint64_t now;
+
+	if (!st)
+		return 0;
+
+	now = stat_now();
+	h = &st->hist[stage];
+	bucket = &h->buckets[stat_bucket(now - start)];
+	if (stage >= STAT_ACQUIRE) {
+		__atomic_fetch_add(bucket, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	} else {
+		WRITE_ONCE(*bucket, *bucket + 1);
+		WRITE_ONCE(h->count, h->count + 1);
+	}
+
+	return now;
+}
+
+static inline int stats_pool_name(char *buf, size_t len, const char *name)
+{
+	int n;
+
+	n = snprintf(buf, len, "%s-stats", name);
+	if (n < 0 || (size_t)n >= len) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return 0;
+}
+
+static inline struct capture_stats *capture_stats_create(
+				struct capture_pool *pool, const char *name)
+{
+	struct capture_stats *st;
+	char path[NAME_MAX + 1];
+
+	if (stats_pool_name(path, sizeof(path), name) < 0) {
+		fprintf(stderr, "capture stream name %s too long\n", name);
+		return NULL;
+	}
+	st = capture_pool_create(pool, path, ALIGN(sizeof(*st),
+				CAPTURE_PAGE_SIZE), 0);
+	if (!st)
+		return NULL;
+
+	memset(st, 0, sizeof(*st));
+	st->version = CAPTURE_STATS_VERSION;
+	smp_store_release(&st->magic, CAPTURE_STATS_MAGIC);
+
+	return st;
+}
+
+/* drop the page a previous run with stats left behind */
+static inline void capture_stats_remove(const char *name)
+{
+	char path[NAME_MAX + 1];
+
+	if (stats_pool_name(path, sizeof(path), name) == 0)
+		pool_unlink(path, false);
+}
+
+/* NULL, quietly, if the stream runs without stats */
+static inline struct capture_stats *capture_stats_attach(
+				struct capture_pool *pool, const char *name)
+{
+	struct capture_stats *st;
+	char path[NAME_MAX + 1];
+
+	if (stats_pool_name(path, sizeof(path), name) < 0 ||
+			pool_open(pool, path, false, O_RDONLY) < 0)
+		return NULL;
+	close(pool->fd);
+
+	st = capture_pool_attach(pool, path);
+	if (!st)
+		return NULL;
+	if (pool->size < sizeof(*st) ||
+			smp_load_acquire(&st->magic) != CAPTURE_STATS_MAGIC ||
+			st->version != CAPTURE_STATS_VERSION) {
+		capture_pool_detach(pool);
+		return NULL;
+	}
+
+	return st;
+}
+
+#endif
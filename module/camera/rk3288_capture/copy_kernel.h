@@ -0,0 +1,201 @@
+/*
+ * Frame copy kernels for the capture -> shm path.
+ *
+ * Copyright (C) 2017 zhujiongfu
+ *
+ * The source is a V4L2 buffer the CPU has never touched (uncached or
+ * write-combined on RK3288) and the destination is a shm slot that is
+ * not read again by this core, so the kernels stream: wide loads and,
+ * where the ISA has them, non-temporal stores that don't pull the
+ * destination into the cache. x86 leaves the prefetching to the
+ * hardware, which follows a linear stream better than prefetchnta does.
+ * The best kernel the CPU supports is picked at runtime.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ */
+
+#ifndef __COPY_KERNEL_H
+#define __COPY_KERNEL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef __aarch64__
+#include <asm/hwcap.h>
+#endif
+#endif
+
+/* NEON: how far ahead of the loads to issue pld */
+#define COPY_PREFETCH	512
+
+typedef void (*copy_fn)(void *dst, const void *src, size_t n);
+
+struct copy_kernel {
+	const char		*name;
+	copy_fn			fn;
+	bool			(*supported)(void);
+};
+
+static bool copy_always(void)
+{
+	return true;
+}
+
+static void copy_generic(void *dst, const void *src, size_t n)
+{
+	memcpy(dst, src, n);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static bool copy_has_sse2(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+static bool copy_has_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("sse2")))
+static void copy_sse2_nt(void *dst, const void *src, size_t n)
+{
+	unsigned char *d = dst;
+	const unsigned char *s = src;
+	size_t head = -(uintptr_t)d & 15;
+	__m128i a, b, c, e;
+
+	if (n < 256) {
+		memcpy(d, s, n);
+		return;
+	}
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	n -= head;
+
+	for (; n >= 64; n -= 64, s += 64, d += 64) {
+		a = _mm_loadu_si128((const __m128i *)s);
+		b = _mm_loadu_si128((const __m128i *)(s + 16));
+		c = _mm_loadu_si128((const __m128i *)(s + 32));
+		e = _mm_loadu_si128((const __m128i *)(s + 48));
+		_mm_stream_si128((__m128i *)d, a);
+		_mm_stream_si128((__m128i *)(d + 16), b);
+		_mm_stream_si128((__m128i *)(d + 32), c);
+		_mm_stream_si128((__m128i *)(d + 48), e);
+	}
+	_mm_sfence();
+	memcpy(d, s, n);
+}
+
+__attribute__((target("avx2")))
+static void copy_avx2_nt(void *dst, const void *src, size_t n)
+{
+	unsigned char *d = dst;
+	const unsigned char *s = src;
+	size_t head = -(uintptr_t)d & 31;
+	__m256i a, b, c, e;
+
+	if (n < 512) {
+		memcpy(d, s, n);
+		return;
+	}
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	n -= head;
+
+	for (; n >= 128; n -= 128, s += 128, d += 128) {
+		a = _mm256_loadu_si256((const __m256i *)s);
+		b = _mm256_loadu_si256((const __m256i *)(s + 32));
+		c = _mm256_loadu_si256((const __m256i *)(s + 64));
+		e = _mm256_loadu_si256((const __m256i *)(s + 96));
+		_mm256_stream_si256((__m256i *)d, a);
+		_mm256_stream_si256((__m256i *)(d + 32), b);
+		_mm256_stream_si256((__m256i *)(d + 64), c);
+		_mm256_stream_si256((__m256i *)(d + 96), e);
+	}
+	_mm_sfence();
+	memcpy(d, s, n);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+static bool copy_has_neon(void)
+{
+#ifdef __aarch64__
+	return true;
+#else
+	return getauxval(AT_HWCAP) & HWCAP_NEON;
+#endif
+}
+
+/*
+ * 64 bytes per iteration with the source prefetched well ahead: on the
+ * A17 the uncached V4L2 buffer is the bottleneck, so keeping several
+ * line fills in flight matters more than the store side.
+ */
+static void copy_neon(void *dst, const void *src, size_t n)
+{
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	uint8x16_t a, b, c, e;
+
+	for (; n >= 64; n -= 64, s += 64, d += 64) {
+		__builtin_prefetch(s + COPY_PREFETCH);
+		a = vld1q_u8(s);
+		b = vld1q_u8(s + 16);
+		c = vld1q_u8(s + 32);
+		e = vld1q_u8(s + 48);
+		vst1q_u8(d, a);
+		vst1q_u8(d + 16, b);
+		vst1q_u8(d + 32, c);
+		vst1q_u8(d + 48, e);
+	}
+	memcpy(d, s, n);
+}
+#endif
+
+/* best first */
+static const struct copy_kernel copy_kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+	{ "avx2-nt", copy_avx2_nt, copy_has_avx2 },
+	{ "sse2-nt", copy_sse2_nt, copy_has_sse2 },
+#endif
+#if defined(__ARM_NEON) || defined(__aarch64__)
+	{ "neon", copy_neon, copy_has_neon },
+#endif
+	{ "generic", copy_generic, copy_always },
+};
+
+#define NR_COPY_KERNELS	(sizeof(copy_kernels) / sizeof(copy_kernels[0]))
+
+/*
+ * The named kernel if it is supported here, otherwise the best one the
+ * CPU has. name may be NULL.
+ */
+static inline const struct copy_kernel *copy_kernel_select(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; name && i < NR_COPY_KERNELS; i++)
+		if (!strcmp(copy_kernels[i].name, name) &&
+				copy_kernels[i].supported())
+			return &copy_kernels[i];
+
+	for (i = 0; i < NR_COPY_KERNELS; i++)
+		if (copy_kernels[i].supported())
+			break;
+
+	return &copy_kernels[i];
+}
+
+#endif
@@ -0,0 +1,224 @@
+/*
+ * Striped frame copy on a small pool of pinned worker threads.
+ *
+ * Copyright (C) 2017 zhujiongfu
+ *
+ * One core can't move a UXGA frame out of uncached V4L2 memory at full
+ * frame rate, so the publish copy is cut into row stripes: the caller
+ * copies the first one itself and the workers take the rest. Workers
+ * are created once and sleep on a futex between frames; the caller is
+ * woken by the last worker to finish. Small frames are copied inline.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ */
+
+#ifndef __COPY_POOL_H
+#define __COPY_POOL_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "v4l2_capture.h"
+#include "copy_kernel.h"
+
+#define COPY_POOL_MAX		4
+/* below this one thread is faster than waking the others */
+#define COPY_POOL_MIN_SPLIT	(512 * 1024)
+
+struct copy_pool;
+
+/* a row band job, part runs from 0 to parts - 1 */
+typedef void (*copy_pool_band_fn)(void *arg, unsigned int part,
+				unsigned int parts);
+
+struct copy_worker {
+	pthread_t		tid;
+	struct copy_pool	*pool;
+	unsigned int		id;
+};
+
+struct copy_pool {
+	copy_fn			fn;
+	unsigned int		nr_workers;
+	size_t			min_split;
+	struct copy_worker	workers[COPY_POOL_MAX];
+
+	/* current job, stripe 0 is the caller's */
+	unsigned char		*dst;
+	const unsigned char	*src;
+	size_t			stripe;
+	size_t			size;
+	/* or, instead of the copy, one band of a generic job */
+	copy_pool_band_fn	band;
+	void			*arg;
+
+	unsigned int		gen __cacheline_aligned;
+	unsigned int		pending __cacheline_aligned;
+	int			stop;
+};
+
+static inline void copy_pool_wait(unsigned int *uaddr, unsigned int val)
+{
+	syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void copy_pool_wake(unsigned int *uaddr)
+{
+	syscall(SYS_futex, uaddr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static inline void copy_pool_stripe(struct copy_pool *pool, unsigned int i)
+{
+	size_t off = pool->stripe * i;
+	size_t len;
+
+	if (pool->band) {
+		pool->band(pool->arg, i, pool->nr_workers + 1);
+		return;
+	}
+	if (off >= pool->size)
+		return;
+	len = pool->size - off < pool->stripe ? pool->size - off :
+					pool->stripe;
+	pool->fn(pool->dst + off, pool->src + off, len);
+}
+
+static inline void *copy_worker_fn(void *arg)
+{
+	struct copy_worker *w = arg;
+	struct copy_pool *pool = w->pool;
+	unsigned int gen = 0;
+
+	for (;;) {
+		while (smp_load_acquire(&pool->gen) == gen)
+			copy_pool_wait(&pool->gen, gen);
+		gen = smp_load_acquire(&pool->gen);
+		if (READ_ONCE(pool->stop))
+			break;
+
+		copy_pool_stripe(pool, w->id + 1);
+		if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL) == 0)
+			copy_pool_wake(&pool->pending);
+	}
+
+	return NULL;
+}
+
+/*
+ * Worker i is pinned to the i-th core after first_cpu, so that the
+ * caller keeps its own core to itself.
+ */
+static inline int copy_pool_init(struct copy_pool *pool, unsigned int threads,
+				copy_fn fn, int first_cpu)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t set;
+	unsigned int i;
+
+	memset(pool, 0, sizeof(*pool));
+	pool->fn = fn;
+	pool->min_split = COPY_POOL_MIN_SPLIT;
+	if (threads > COPY_POOL_MAX)
+		threads = COPY_POOL_MAX;
+	if (threads <= 1)
+		return 0;
+
+	for (i = 0; i < threads - 1; i++) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].id = i;
+		if (pthread_create(&pool->workers[i].tid, NULL,
+					copy_worker_fn, &pool->workers[i])) {
+			printf("Failed to create copy worker %u.\n", i);
+			break;
+		}
+		pool->nr_workers++;
+
+		if (ncpu > 1) {
+			CPU_ZERO(&set);
+			CPU_SET((first_cpu + 1 + i) % ncpu, &set);
+			pthread_setaffinity_np(pool->workers[i].tid,
+						sizeof(set), &set);
+		}
+	}
+
+	return pool->nr_workers ? 0 : -1;
+}
+
+/*
+ * Copy size bytes in stripes of whole rows of row_bytes. Returns once
+ * the whole frame has landed.
+ */
+static inline void copy_pool_run(struct copy_pool *pool, void *dst,
+				const void *src, size_t size, size_t row_bytes)
+{
+	unsigned int parts = pool->nr_workers + 1;
+	size_t rows;
+	unsigned int pending;
+
+	if (!pool->nr_workers || size < pool->min_split || !row_bytes) {
+		pool->fn(dst, src, size);
+		return;
+	}
+
+	rows = (size + row_bytes - 1) / row_bytes;
+	pool->band = NULL;
+	pool->dst = dst;
+	pool->src = src;
+	pool->size = size;
+	pool->stripe = (rows + parts - 1) / parts * row_bytes;
+	WRITE_ONCE(pool->pending, pool->nr_workers);
+	__atomic_fetch_add(&pool->gen, 1, __ATOMIC_RELEASE);
+	copy_pool_wake(&pool->gen);
+
+	copy_pool_stripe(pool, 0);
+
+	while ((pending = smp_load_acquire(&pool->pending)) != 0)
+		copy_pool_wait(&pool->pending, pending);
+}
+
+/*
+ * Run fn once on the caller and once on every worker, each with its own
+ * part, for stages that split a frame into row bands themselves. pool
+ * may be NULL, then the caller does the whole job as part 0 of 1.
+ */
+static inline void copy_pool_bands(struct copy_pool *pool,
+				copy_pool_band_fn fn, void *arg)
+{
+	unsigned int pending;
+
+	if (!pool || !pool->nr_workers) {
+		fn(arg, 0, 1);
+		return;
+	}
+
+	pool->band = fn;
+	pool->arg = arg;
+	WRITE_ONCE(pool->pending, pool->nr_workers);
+	__atomic_fetch_add(&pool->gen, 1, __ATOMIC_RELEASE);
+	copy_pool_wake(&pool->gen);
+
+	fn(arg, 0, pool->nr_workers + 1);
+
+	while ((pending = smp_load_acquire(&pool->pending)) != 0)
+		copy_pool_wait(&pool->pending, pending);
+}
+
+static inline void copy_pool_exit(struct copy_pool *pool)
+{
+	unsigned int i;
+
+	WRITE_ONCE(pool->stop, 1);
+	__atomic_fetch_add(&pool->gen, 1, __ATOMIC_RELEASE);
+	copy_pool_wake(&pool->gen);
+	for (i = 0; i < pool->nr_workers; i++)
+		pthread_join(pool->workers[i].tid, NULL);
+	pool->nr_workers = 0;
+}
+
+#endif
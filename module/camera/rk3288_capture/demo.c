@@ -12,85 +12,133 @@
  */
 
 #include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
 #include<sys/types.h>
-#include "v4l2_capture.h"
+#include <signal.h>
+#include "libcapture.h"
+#include "capture_file.h"
 
-static unsigned int get_rdy_buf_index(struct capture_data *shd)
+static volatile sig_atomic_t quit;
+
+static void on_quit(int sig)
 {
-	unsigned int out;
-
-	do {
-		sem_lock(shd->sem_id);
-		printf("flag: 0x%0x\n", shd->buf_flag);
-		switch (shd->buf_flag) {
-		case 0x3:
-		case 0x1:
-			out = 1;
-			break;
-		case 0x2:
-			out = 2;
-			break;
-		default:
-			out = 0;
-		}
-		sem_unlock(shd->sem_id);
-		if (out == 0)
-			usleep(10000);
-	} while (out == 0);
+	quit = 1;
+}
+
+static enum reader_policy parse_policy(const char *arg)
+{
+	if (!strcmp(arg, "drop"))
+		return READER_DROP_OLDEST;
+	if (!strcmp(arg, "block"))
+		return READER_BLOCK_PRODUCER;
+	if (!strcmp(arg, "latest"))
+		return READER_LATEST_ONLY;
 
-	return out;
+	printf("unknown policy %s, use drop|block|latest\n", arg);
+	return READER_DROP_OLDEST;
 }
 
-int main(void)
+int main(int argc, char **argv)
 {
-	struct capture_data *shd;
-	FILE *file;
-	char *shb;
-	int shd_id, shb_id;
-	int semid;
-	int out;
+	struct capture_client client;
+	struct capture_frame frame;
+	struct capfile_writer rec;
+	enum reader_policy policy = READER_DROP_OLDEST;
+	const char *name = CAPTURE_DEFAULT_STREAM;
+	const char *path = "/tmp/stream.out";
+	unsigned int rec_flags = 0;
+	struct sigaction sa;
+	unsigned int max_fps = 0, every = 0;
+	uint64_t report_us;
 	int ret = 0;
+	int opt;
 
-	file = fopen("/tmp/stream.out", "wb");
-	if (file == NULL) {
-		printf("failed to create file.\n");
-		return -1;
+	while ((opt = getopt(argc, argv, "n:p:o:dr:e:")) != -1) {
+		switch (opt) {
+		case 'n':
+			name = optarg;
+			break;
+		case 'p':
+			policy = parse_policy(optarg);
+			break;
+		case 'o':
+			path = optarg;
+			break;
+		case 'd':
+			rec_flags |= RECORD_F_DIRECT;
+			break;
+		case 'r':
+			max_fps = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			every = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			printf("usage: %s [-n stream] [-p drop|block|latest] "
+				"[-o file] [-d] [-r max fps] [-e every nth]\n",
+				argv[0]);
+			return -1;
+		}
 	}
 
-	shd = (struct capture_data *)alloc_shm(&shd_id,
-						MODULE_SHM_ID, 0, 0666);
-	if ((void *)shd == (void *)-1) {
-		printf("%s: failed to init shd.\n", __FILE__);
-		ret = -1;
-		goto err_shd;
+	/* leave the loop within a second and flush what was recorded */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_quit;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (capture_attach(&client, name, policy) < 0) {
+		printf("%s: failed to attach %s.\n", __FILE__, name);
+		return -1;
 	}
-	shb = ((char *)shd) + sizeof(struct capture_data);
 
-	printf("get shd size: %u\n", shd->sizeimage);
+	printf("get shd size: %u\n", client.shm->sizeimage);
+	if (max_fps || every)
+		capture_subscribe(&client, max_fps, every);
 
-	semid = get_and_init_sem(KEY_PATH, MODULE_SEM_ID);
-	if (semid < 0) {
-		printf("%s: failed to get sem.\n", __FILE__);
+	if (capfile_create(&rec, path, client.shm, rec_flags) < 0) {
+		printf("failed to create file.\n");
 		ret = -1;
-		goto err_sem;
+		goto err_file;
 	}
 
-	for (;;) {
-		out = get_rdy_buf_index(shd);		
-		out--;
-		fwrite(shb + shd->sizeimage * out, shd->sizeimage, 1, file);
-		printf("index: %u\n", out);
-		/* sleep(1); */
-		usleep(100000);
-		sem_lock(shd->sem_id);
-		shd->buf_flag &= ~(1 << out);
-		sem_unlock(shd->sem_id);
+	report_us = capture_now_us() + 1000000;
+	while (!quit) {
+		ret = capture_acquire_frame(&client, &frame, 1000);
+		if (ret == -ETIMEDOUT) {
+			if (!quit)
+				printf("no frame for 1s\n");
+			continue;
+		} else if (ret < 0) {
+			break;
+		}
+
+		/* straight from the view, the writer thread does the I/O */
+		ret = capfile_frame(&rec, &frame.meta, frame.data,
+					frame.meta.bytesused);
+		if (capture_release_frame(&client, &frame) < 0) {
+			printf("frame %u overwritten, dropped\n",
+						frame.meta.sequence);
+			if (ret == 0)
+				capfile_abort(&rec);
+		} else if (ret == 0) {
+			capfile_commit(&rec);
+		}
+
+		if (capture_now_us() >= report_us) {
+			printf("seq: %u latency: %uus lag: %u drops: %u "
+				"lost: %u\n", frame.meta.sequence,
+				client.reader->latency_us, client.reader->lag,
+				client.reader->drops, client.reader->lost);
+			record_print_stats(&rec.rec);
+			report_us += 1000000;
+		}
 	}
 
-err_sem:
-	free_shm(shd_id);
-err_shd:
-	fclose(file);
+	capfile_finish(&rec);
+err_file:
+	capture_detach(&client);
 
 	return ret;
 }
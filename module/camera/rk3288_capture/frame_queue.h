@@ -0,0 +1,158 @@
+/*
+ * Bounded lock-free queue of frame descriptors between two threads.
+ *
+ * Copyright (C) 2017 zhujiongfu
+ *
+ * Hands buffer indices, with the capture metadata, from the thread that
+ * fills buffers to the one that shows them. One thread pushes; popping
+ * claims the tail with a CAS, so besides the consumer the producer may
+ * take its oldest frame back too, which is how latest-frame-wins is
+ * done without a lock: a push to a full FQ_F_LATEST queue evicts the
+ * oldest entry and hands it back to the producer to recycle. Without
+ * it a full queue refuses the push.
+ *
+ * The consumer sleeps on the head futex only when the queue is empty,
+ * and the producer only makes the FUTEX_WAKE call when somebody sleeps.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ */
+
+#ifndef __FRAME_QUEUE_H
+#define __FRAME_QUEUE_H
+
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "v4l2_capture.h"
+
+#define FQ_MAX_DEPTH		16
+
+/* a full queue drops its oldest frame rather than the new one */
+#define FQ_F_LATEST		BIT(0)
+
+struct frame_desc {
+	int			index;
+	unsigned int		sequence;
+	/* V4L2 buffer timestamp, and when the frame was queued */
+	uint64_t		timestamp_us;
+	uint64_t		queued_us;
+};
+
+struct frame_queue {
+	unsigned int		depth;
+	unsigned int		mask;
+	unsigned int		flags;
+	struct frame_desc	slots[FQ_MAX_DEPTH];
+
+	/* producer */
+	unsigned int		head __cacheline_aligned;
+	unsigned int		pushed;
+	unsigned int		dropped;
+	unsigned int		max_fill;
+	uint64_t		fill_sum;
+
+	/* consumers */
+	unsigned int		tail __cacheline_aligned;
+	unsigned int		waiters;
+};
+
+static inline void fq_init(struct frame_queue *q, unsigned int depth,
+				unsigned int flags)
+{
+	unsigned int size = 1;
+
+	memset(q, 0, sizeof(*q));
+	if (depth < 1)
+		depth = 1;
+	if (depth > FQ_MAX_DEPTH)
+		depth = FQ_MAX_DEPTH;
+	while (size < depth)
+		size <<= 1;
+	q->depth = depth;
+	q->mask = size - 1;
+	q->flags = flags;
+}
+
+/*
+ * Take the oldest entry. The slot is read before the tail is claimed;
+ * if the claim fails the copy may be torn and is simply thrown away.
+ */
+static inline int fq_pop(struct frame_queue *q, struct frame_desc *d)
+{
+	unsigned int tail = smp_load_acquire(&q->tail);
+
+	for (;;) {
+		if (tail == smp_load_acquire(&q->head))
+			return -EAGAIN;
+		*d = q->slots[tail & q->mask];
+		if (__atomic_compare_exchange_n(&q->tail, &tail, tail + 1,
+					false, __ATOMIC_ACQ_REL,
+					__ATOMIC_ACQUIRE))
+			return 0;
+	}
+}
+
+/*
+ * Queue d. Returns 0, 1 if the queue was full and the oldest entry was
+ * evicted into *old, or -ENOSPC if it was full and d wasn't queued;
+ * either way the buffer the caller gets back is its to recycle.
+ */
+static inline int fq_push(struct frame_queue *q, const struct frame_desc *d,
+				struct frame_desc *old)
+{
+	unsigned int head = q->head;
+	unsigned int fill;
+	int ret = 0;
+
+	while (head - smp_load_acquire(&q->tail) >= q->depth) {
+		if (!(q->flags & FQ_F_LATEST)) {
+			q->dropped++;
+			return -ENOSPC;
+		}
+		if (fq_pop(q, old) == 0) {
+			q->dropped++;
+			ret = 1;
+		}
+	}
+
+	q->slots[head & q->mask] = *d;
+	smp_store_release(&q->head, head + 1);
+	q->pushed++;
+	fill = head + 1 - READ_ONCE(q->tail);
+	q->fill_sum += fill;
+	if (fill > q->max_fill)
+		q->max_fill = fill;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (READ_ONCE(q->waiters))
+		syscall(SYS_futex, &q->head, FUTEX_WAKE_PRIVATE, INT_MAX,
+					NULL, NULL, 0);
+
+	return ret;
+}
+
+/* frames waiting, racy but good for stats */
+static inline unsigned int fq_fill(struct frame_queue *q)
+{
+	return READ_ONCE(q->head) - READ_ONCE(q->tail);
+}
+
+/* fq_pop(), sleeping while the queue is empty */
+static inline void fq_pop_wait(struct frame_queue *q, struct frame_desc *d)
+{
+	unsigned int head;
+
+	while (fq_pop(q, d) < 0) {
+		head = smp_load_acquire(&q->head);
+		__atomic_fetch_add(&q->waiters, 1, __ATOMIC_SEQ_CST);
+		if (head == smp_load_acquire(&q->tail))
+			syscall(SYS_futex, &q->head, FUTEX_WAIT_PRIVATE, head,
+						NULL, NULL, 0);
+		__atomic_fetch_sub(&q->waiters, 1, __ATOMIC_RELAXED);
+	}
+}
+
+#endif
@@ -0,0 +1,641 @@
+/*
+ * KMS output through the atomic API.
+ *
+ * Copyright (C) 2017 zhujiongfu
+ *
+ * For boards that only have DRM. kms_open() takes the first connected
+ * connector, its preferred mode, a CRTC its encoder can drive and that
+ * CRTC's primary plane. Frames live in a few dumb buffers mapped for
+ * the CPU, or in DMABUFs imported from V4L2, and are shown with
+ * nonblocking atomic commits. The page flip event tells when a frame
+ * reached the screen, and waiting for it is what paces the caller:
+ *
+ *	kms_open(&k, "/dev/dri/card0");
+ *	kms_alloc_dumb(&k, 3);
+ *	(render into k.bufs[i].map)
+ *	kms_flip(&k, i, &vblank_us);
+ *
+ * Only the kernel uapi headers are needed, not libdrm. vkms has all
+ * of it, for testing without a panel.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ */
+
+#ifndef __KMS_OUTPUT_H
+#define __KMS_OUTPUT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <drm/drm.h>
+#include <drm/drm_mode.h>
+#include <drm/drm_fourcc.h>
+
+#define KMS_MAX_BUFFERS		4
+/* a flip that takes longer than this is stuck */
+#define KMS_FLIP_TIMEOUT_MS	1000
+
+struct kms_buffer {
+	uint32_t		handle;
+	uint32_t		fb_id;
+	uint32_t		pitch;
+	uint64_t		size;
+	/* NULL for imported buffers */
+	void			*map;
+	bool			imported;
+};
+
+enum kms_prop {
+	KMS_CONN_CRTC_ID,
+	KMS_CRTC_ACTIVE,
+	KMS_CRTC_MODE_ID,
+	KMS_PLANE_FB_ID,
+	KMS_PLANE_CRTC_ID,
+	KMS_PLANE_SRC_X,
+	KMS_PLANE_SRC_Y,
+	KMS_PLANE_SRC_W,
+	KMS_PLANE_SRC_H,
+	KMS_PLANE_CRTC_X,
+	KMS_PLANE_CRTC_Y,
+	KMS_PLANE_CRTC_W,
+	KMS_PLANE_CRTC_H,
+	KMS_NR_PROPS,
+};
+
+struct kms_output {
+	int			fd;
+	uint32_t		conn_id;
+	uint32_t		crtc_id;
+	uint32_t		plane_id;
+	struct drm_mode_modeinfo mode;
+	uint32_t		mode_blob;
+	uint32_t		props[KMS_NR_PROPS];
+	unsigned int		width;
+	unsigned int		height;
+	/* refresh period of the mode */
+	unsigned int		period_us;
+	/* the first commit also sets the mode */
+	bool			modeset;
+
+	unsigned int		nr_bufs;
+	struct kms_buffer	bufs[KMS_MAX_BUFFERS];
+};
+
+static inline uint64_t kms_ptr(const void *p)
+{
+	return (uint64_t)(uintptr_t)p;
+}
+
+static inline int kms_ioctl(int fd, unsigned long req, void *arg)
+{
+	int ret;
+
+	do {
+		ret = ioctl(fd, req, arg);
+	} while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+
+	return ret;
+}
+
+/* id of property name of an object, and its current value */
+static inline uint32_t kms_prop_id(int fd, uint32_t obj, uint32_t type,
+				const char *name, uint64_t *value)
+{
+	struct drm_mode_obj_get_properties op;
+	struct drm_mode_get_property prop;
+	uint64_t *values = NULL;
+	uint32_t *ids = NULL, id = 0;
+	unsigned int i;
+
+	memset(&op, 0, sizeof(op));
+	op.obj_id = obj;
+	op.obj_type = type;
+	if (kms_ioctl(fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &op) < 0)
+		return 0;
+	ids = calloc(op.count_props, sizeof(*ids));
+	values = calloc(op.count_props, sizeof(*values));
+	if (!ids || !values)
+		goto out;
+	op.props_ptr = kms_ptr(ids);
+	op.prop_values_ptr = kms_ptr(values);
+	if (kms_ioctl(fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &op) < 0)
+		goto out;
+
+	for (i = 0; i < op.count_props; i++) {
+		memset(&prop, 0, sizeof(prop));
+		prop.prop_id = ids[i];
+		if (kms_ioctl(fd, DRM_IOCTL_MODE_GETPROPERTY, &prop) < 0)
+			continue;
+		if (!strncmp(prop.name, name, DRM_PROP_NAME_LEN)) {
+			id = ids[i];
+			if (value)
+				*value = values[i];
+			break;
+		}
+	}
+out:
+	free(ids);
+	free(values);
+	return id;
+}
+
+static inline int kms_find_props(struct kms_output *k)
+{
+	static const struct {
+		uint32_t	type;
+		const char	*name;
+	} names[KMS_NR_PROPS] = {
+		[KMS_CONN_CRTC_ID]	= { DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID" },
+		[KMS_CRTC_ACTIVE]	= { DRM_MODE_OBJECT_CRTC, "ACTIVE" },
+		[KMS_CRTC_MODE_ID]	= { DRM_MODE_OBJECT_CRTC, "MODE_ID" },
+		[KMS_PLANE_FB_ID]	= { DRM_MODE_OBJECT_PLANE, "FB_ID" },
+		[KMS_PLANE_CRTC_ID]	= { DRM_MODE_OBJECT_PLANE, "CRTC_ID" },
+		[KMS_PLANE_SRC_X]	= { DRM_MODE_OBJECT_PLANE, "SRC_X" },
+		[KMS_PLANE_SRC_Y]	= { DRM_MODE_OBJECT_PLANE, "SRC_Y" },
+		[KMS_PLANE_SRC_W]	= { DRM_MODE_OBJECT_PLANE, "SRC_W" },
+		[KMS_PLANE_SRC_H]	= { DRM_MODE_OBJECT_PLANE, "SRC_H" },
+		[KMS_PLANE_CRTC_X]	= { DRM_MODE_OBJECT_PLANE, "CRTC_X" },
+		[KMS_PLANE_CRTC_Y]	= { DRM_MODE_OBJECT_PLANE, "CRTC_Y" },
+		[KMS_PLANE_CRTC_W]	= { DRM_MODE_OBJECT_PLANE, "CRTC_W" },
+		[KMS_PLANE_CRTC_H]	= { DRM_MODE_OBJECT_PLANE, "CRTC_H" },
+	};
+	uint32_t obj;
+	int i;
+
+	for (i = 0; i < KMS_NR_PROPS; i++) {
+		if (names[i].type == DRM_MODE_OBJECT_CONNECTOR)
+			obj = k->conn_id;
+		else if (names[i].type == DRM_MODE_OBJECT_CRTC)
+			obj = k->crtc_id;
+		else
+			obj = k->plane_id;
+		k->props[i] = kms_prop_id(k->fd, obj, names[i].type,
+					names[i].name, NULL);
+		if (!k->props[i]) {
+			printf("kms: no %s property.\n", names[i].name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* a connected connector and its mode, and the CRTC to drive it with */
+static inline int kms_find_crtc(struct kms_output *k, int *crtc_index)
+{
+	struct drm_mode_card_res res;
+	struct drm_mode_get_connector conn;
+	struct drm_mode_get_encoder enc;
+	struct drm_mode_modeinfo *modes = NULL;
+	uint32_t *crtcs = NULL, *conns = NULL, *encs = NULL;
+	unsigned int i, j, m, nr_modes;
+	int ret = -1;
+
+	memset(&res, 0, sizeof(res));
+	if (kms_ioctl(k->fd, DRM_IOCTL_MODE_GETRESOURCES, &res) < 0) {
+		perror("kms: DRM_IOCTL_MODE_GETRESOURCES");
+		return -1;
+	}
+	crtcs = calloc(res.count_crtcs, sizeof(*crtcs));
+	conns = calloc(res.count_connectors, sizeof(*conns));
+	if (!crtcs || !conns)
+		goto out;
+	res.count_fbs = 0;
+	res.count_encoders = 0;
+	res.crtc_id_ptr = kms_ptr(crtcs);
+	res.connector_id_ptr = kms_ptr(conns);
+	if (kms_ioctl(k->fd, DRM_IOCTL_MODE_GETRESOURCES, &res) < 0)
+		goto out;
+
+	for (i = 0; i < res.count_connectors; i++) {
+		free(modes);
+		free(encs);
+		modes = NULL;
+		encs = NULL;
+
+		/* the first call probes the connector */
+		memset(&conn, 0, sizeof(conn));
+		conn.connector_id = conns[i];
+		if (kms_ioctl(k->fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn) < 0 ||
+				conn.connection != DRM_MODE_CONNECTED ||
+				!conn.count_modes)
+			continue;
+		modes = calloc(conn.count_modes, sizeof(*modes));
+		encs = calloc(conn.count_encoders + 1, sizeof(*encs));
+		if (!modes || !encs)
+			goto out;
+		nr_modes = conn.count_modes;
+		conn.count_props = 0;
+		conn.modes_ptr = kms_ptr(modes);
+		conn.encoders_ptr = kms_ptr(encs);
+		/* nothing is copied out if the list grew in between */
+		if (kms_ioctl(k->fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn) < 0 ||
+				conn.count_modes > nr_modes || !conn.count_modes)
+			continue;
+
+		memset(&enc, 0, sizeof(enc));
+		enc.encoder_id = conn.encoder_id ? conn.encoder_id : encs[0];
+		if (kms_ioctl(k->fd, DRM_IOCTL_MODE_GETENCODER, &enc) < 0)
+			continue;
+		for (j = 0; j < res.count_crtcs; j++) {
+			if (enc.crtc_id ? crtcs[j] == enc.crtc_id :
+					(enc.possible_crtcs & (1u << j)) != 0)
+				break;
+		}
+		if (j == res.count_crtcs)
+			continue;
+
+		for (m = 0; m < conn.count_modes; m++)
+			if (modes[m].type & DRM_MODE_TYPE_PREFERRED)
+				break;
+		k->mode = modes[m < conn.count_modes ? m : 0];
+		k->conn_id = conns[i];
+		k->crtc_id = crtcs[j];
+		*crtc_index = j;
+		ret = 0;
+		break;
+	}
+	if (ret < 0)
+		printf("kms: no connected output.\n");
+out:
+	free(modes);
+	free(encs);
+	free(crtcs);
+	free(conns);
+	return ret;
+}
+
+/* the primary plane of the CRTC, if it can scan XRGB8888 out */
+static inline int kms_find_plane(struct kms_output *k, int crtc_index)
+{
+	struct drm_mode_get_plane_res res;
+	struct drm_mode_get_plane plane;
+	uint32_t *ids = NULL, formats[64];
+	uint64_t type;
+	unsigned int i, f;
+
+	memset(&res, 0, sizeof(res));
+	if (kms_ioctl(k->fd, DRM_IOCTL_MODE_GETPLANERESOURCES, &res) < 0)
+		return -1;
+	ids = calloc(res.count_planes, sizeof(*ids));
+	if (!ids)
+		return -1;
+	res.plane_id_ptr = kms_ptr(ids);
+	if (kms_ioctl(k->fd, DRM_IOCTL_MODE_GETPLANERESOURCES, &res) < 0)
+		goto out;
+
+	for (i = 0; i < res.count_planes; i++) {
+		memset(&plane, 0, sizeof(plane));
+		plane.plane_id = ids[i];
+		plane.count_format_types = sizeof(formats) / sizeof(formats[0]);
+		plane.format_type_ptr = kms_ptr(formats);
+		/* the formats aren't copied out if they don't all fit */
+		if (kms_ioctl(k->fd, DRM_IOCTL_MODE_GETPLANE, &plane) < 0 ||
+				plane.count_format_types >
+				sizeof(formats) / sizeof(formats[0]) ||
+				!(plane.possible_crtcs & (1u << crtc_index)))
+			continue;
+		if (!kms_prop_id(k->fd, ids[i], DRM_MODE_OBJECT_PLANE, "type",
+					&type) || type != DRM_PLANE_TYPE_PRIMARY)
+			continue;
+		for (f = 0; f < plane.count_format_types; f++)
+			if (formats[f] == DRM_FORMAT_XRGB8888)
+				break;
+		if (f == plane.count_format_types)
+			continue;
+
+		k->plane_id = ids[i];
+		break;
+	}
+out:
+	free(ids);
+	if (!k->plane_id) {
+		printf("kms: no XRGB8888 primary plane.\n");
+		return -1;
+	}
+	return 0;
+}
+
+static inline int kms_open(struct kms_output *k, const char *path)
+{
+	struct drm_set_client_cap cap;
+	struct drm_mode_create_blob blob;
+	int crtc_index;
+
+	memset(k, 0, sizeof(*k));
+	k->fd = open(path, O_RDWR | O_CLOEXEC);
+	if (k->fd < 0) {
+		perror("kms: open");
+		return -1;
+	}
+
+	cap.capability = DRM_CLIENT_CAP_UNIVERSAL_PLANES;
+	cap.value = 1;
+	if (kms_ioctl(k->fd, DRM_IOCTL_SET_CLIENT_CAP, &cap) < 0)
+		goto no_atomic;
+	cap.capability = DRM_CLIENT_CAP_ATOMIC;
+	if (kms_ioctl(k->fd, DRM_IOCTL_SET_CLIENT_CAP, &cap) < 0)
+		goto no_atomic;
+
+	if (kms_find_crtc(k, &crtc_index) < 0 ||
+			kms_find_plane(k, crtc_index) < 0 ||
+			kms_find_props(k) < 0)
+		goto err;
+
+	k->width = k->mode.hdisplay;
+	k->height = k->mode.vdisplay;
+	if (k->mode.clock)
+		k->period_us = (uint64_t)k->mode.htotal * k->mode.vtotal *
+					1000 / k->mode.clock;
+	if (!k->period_us)
+		k->period_us = 1000000 / 60;
+
+	memset(&blob, 0, sizeof(blob));
+	blob.data = kms_ptr(&k->mode);
+	blob.length = sizeof(k->mode);
+	if (kms_ioctl(k->fd, DRM_IOCTL_MODE_CREATEPROPBLOB, &blob) < 0) {
+		perror("kms: DRM_IOCTL_MODE_CREATEPROPBLOB");
+		goto err;
+	}
+	k->mode_blob = blob.blob_id;
+	k->modeset = true;
+
+	printf("kms: %s connector %u crtc %u plane %u, %ux%u@%uHz\n", path,
+			k->conn_id, k->crtc_id, k->plane_id, k->width,
+			k->height, 1000000 / k->period_us);
+	return 0;
+
+no_atomic:
+	printf("kms: %s has no atomic modesetting.\n", path);
+err:
+	close(k->fd);
+	return -1;
+}
+
+static inline int kms_add_fb(struct kms_output *k, struct kms_buffer *b)
+{
+	struct drm_mode_fb_cmd2 f;
+
+	memset(&f, 0, sizeof(f));
+	f.width = k->width;
+	f.height = k->height;
+	f.pixel_format = DRM_FORMAT_XRGB8888;
+	f.handles[0] = b->handle;
+	f.pitches[0] = b->pitch;
+	if (kms_ioctl(k->fd, DRM_IOCTL_MODE_ADDFB2, &f) < 0) {
+		perror("kms: DRM_IOCTL_MODE_ADDFB2");
+		return -1;
+	}
+	b->fb_id = f.fb_id;
+
+	return 0;
+}
+
+static inline void kms_free_buffers(struct kms_output *k)
+{
+	struct drm_mode_destroy_dumb dd;
+	struct drm_gem_close gc;
+	struct kms_buffer *b;
+	unsigned int i;
+
+	for (i = 0; i < k->nr_bufs; i++) {
+		b = &k->bufs[i];
+		if (b->fb_id)
+			kms_ioctl(k->fd, DRM_IOCTL_MODE_RMFB, &b->fb_id);
+		if (b->map)
+			munmap(b->map, b->size);
+		if (b->imported) {
+			memset(&gc, 0, sizeof(gc));
+			gc.handle = b->handle;
+			kms_ioctl(k->fd, DRM_IOCTL_GEM_CLOSE, &gc);
+		} else {
+			dd.handle = b->handle;
+			kms_ioctl(k->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dd);
+		}
+	}
+	memset(k->bufs, 0, sizeof(k->bufs));
+	k->nr_bufs = 0;
+}
+
+/* n mode sized XRGB8888 buffers for the CPU to render into */
+static inline int kms_alloc_dumb(struct kms_output *k, unsigned int n)
+{
+	struct drm_mode_create_dumb cd;
+	struct drm_mode_map_dumb md;
+	struct kms_buffer *b;
+	void *map;
+
+	while (k->nr_bufs < n && k->nr_bufs < KMS_MAX_BUFFERS) {
+		b = &k->bufs[k->nr_bufs];
+		memset(&cd, 0, sizeof(cd));
+		cd.width = k->width;
+		cd.height = k->height;
+		cd.bpp = 32;
+		if (kms_ioctl(k->fd, DRM_IOCTL_MODE_CREATE_DUMB, &cd) < 0) {
+			perror("kms: DRM_IOCTL_MODE_CREATE_DUMB");
+			goto err;
+		}
+		b->handle = cd.handle;
+		b->pitch = cd.pitch;
+		b->size = cd.size;
+		k->nr_bufs++;
+
+		memset(&md, 0, sizeof(md));
+		md.handle = b->handle;
+		if (kms_ioctl(k->fd, DRM_IOCTL_MODE_MAP_DUMB, &md) < 0) {
+			perror("kms: DRM_IOCTL_MODE_MAP_DUMB");
+			goto err;
+		}
+		map = mmap(NULL, b->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+					k->fd, md.offset);
+		if (map == MAP_FAILED) {
+			perror("kms: mmap");
+			goto err;
+		}
+		b->map = map;
+		memset(b->map, 0, b->size);
+		if (kms_add_fb(k, b) < 0)
+			goto err;
+	}
+
+	return 0;
+err:
+	kms_free_buffers(k);
+	return -1;
+}
+
+/* scan out a mode sized XRGB8888 DMABUF, returns its buffer index */
+static inline int kms_import(struct kms_output *k, int dmabuf_fd,
+				uint32_t pitch)
+{
+	struct drm_prime_handle prime;
+	struct drm_gem_close gc;
+	struct kms_buffer *b;
+
+	if (k->nr_bufs == KMS_MAX_BUFFERS)
+		return -1;
+
+	memset(&prime, 0, sizeof(prime));
+	prime.fd = dmabuf_fd;
+	if (kms_ioctl(k->fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, &prime) < 0) {
+		perror("kms: DRM_IOCTL_PRIME_FD_TO_HANDLE");
+		return -1;
+	}
+	b = &k->bufs[k->nr_bufs];
+	b->handle = prime.handle;
+	b->pitch = pitch;
+	b->imported = true;
+	if (kms_add_fb(k, b) < 0) {
+		memset(&gc, 0, sizeof(gc));
+		gc.handle = prime.handle;
+		kms_ioctl(k->fd, DRM_IOCTL_GEM_CLOSE, &gc);
+		memset(b, 0, sizeof(*b));
+		return -1;
+	}
+
+	return k->nr_bufs++;
+}
+
+struct kms_req {
+	uint32_t		objs[3];
+	uint32_t		counts[3];
+	uint32_t		props[KMS_NR_PROPS];
+	uint64_t		values[KMS_NR_PROPS];
+	unsigned int		nr_objs;
+	unsigned int		nr_props;
+};
+
+/* properties of one object have to be consecutive */
+static inline void kms_req_add(struct kms_req *req, uint32_t obj,
+				uint32_t prop, uint64_t value)
+{
+	if (!req->nr_objs || req->objs[req->nr_objs - 1] != obj)
+		req->objs[req->nr_objs++] = obj;
+	req->counts[req->nr_objs - 1]++;
+	req->props[req->nr_props] = prop;
+	req->values[req->nr_props++] = value;
+}
+
+/*
+ * Queue buffer i for the next vblank. Fails with EBUSY while the last
+ * flip is still pending.
+ */
+static inline int kms_commit(struct kms_output *k, unsigned int i)
+{
+	struct drm_mode_atomic atomic;
+	struct kms_req req;
+	uint32_t *p = k->props;
+
+	memset(&req, 0, sizeof(req));
+	if (k->modeset) {
+		kms_req_add(&req, k->conn_id, p[KMS_CONN_CRTC_ID], k->crtc_id);
+		kms_req_add(&req, k->crtc_id, p[KMS_CRTC_ACTIVE], 1);
+		kms_req_add(&req, k->crtc_id, p[KMS_CRTC_MODE_ID],
+					k->mode_blob);
+		kms_req_add(&req, k->plane_id, p[KMS_PLANE_CRTC_ID],
+					k->crtc_id);
+		kms_req_add(&req, k->plane_id, p[KMS_PLANE_SRC_X], 0);
+		kms_req_add(&req, k->plane_id, p[KMS_PLANE_SRC_Y], 0);
+		kms_req_add(&req, k->plane_id, p[KMS_PLANE_SRC_W],
+					(uint64_t)k->width << 16);
+		kms_req_add(&req, k->plane_id, p[KMS_PLANE_SRC_H],
+					(uint64_t)k->height << 16);
+		kms_req_add(&req, k->plane_id, p[KMS_PLANE_CRTC_X], 0);
+		kms_req_add(&req, k->plane_id, p[KMS_PLANE_CRTC_Y], 0);
+		kms_req_add(&req, k->plane_id, p[KMS_PLANE_CRTC_W], k->width);
+		kms_req_add(&req, k->plane_id, p[KMS_PLANE_CRTC_H], k->height);
+	}
+	kms_req_add(&req, k->plane_id, p[KMS_PLANE_FB_ID], k->bufs[i].fb_id);
+
+	memset(&atomic, 0, sizeof(atomic));
+	atomic.flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
+	if (k->modeset)
+		atomic.flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+	atomic.count_objs = req.nr_objs;
+	atomic.objs_ptr = kms_ptr(req.objs);
+	atomic.count_props_ptr = kms_ptr(req.counts);
+	atomic.props_ptr = kms_ptr(req.props);
+	atomic.prop_values_ptr = kms_ptr(req.values);
+	atomic.user_data = i;
+	if (kms_ioctl(k->fd, DRM_IOCTL_MODE_ATOMIC, &atomic) < 0)
+		return -1;
+	k->modeset = false;
+
+	return 0;
+}
+
+/* wait for the flip event, the vblank time is CLOCK_MONOTONIC */
+static inline int kms_wait_flip(struct kms_output *k, uint64_t *vblank_us)
+{
+	struct pollfd pfd = { .fd = k->fd, .events = POLLIN };
+	const struct drm_event_vblank *vbl;
+	const struct drm_event *e;
+	char buf[256];
+	ssize_t len, off;
+	int ret;
+
+	for (;;) {
+		ret = poll(&pfd, 1, KMS_FLIP_TIMEOUT_MS);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			printf("kms: no flip event.\n");
+			return -1;
+		}
+		len = read(k->fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			perror("kms: read event");
+			return -1;
+		}
+		for (off = 0; off + (ssize_t)sizeof(*e) <= len;
+						off += e->length) {
+			e = (const struct drm_event *)(buf + off);
+			if (e->length < sizeof(*e))
+				break;
+			if (e->type != DRM_EVENT_FLIP_COMPLETE)
+				continue;
+			vbl = (const struct drm_event_vblank *)e;
+			*vblank_us = (uint64_t)vbl->tv_sec * 1000000 +
+						vbl->tv_usec;
+			return 0;
+		}
+	}
+}
+
+/* show buffer i, returns once it is on screen */
+static inline int kms_flip(struct kms_output *k, unsigned int i,
+				uint64_t *vblank_us)
+{
+	if (kms_commit(k, i) < 0) {
+		perror("kms: DRM_IOCTL_MODE_ATOMIC");
+		return -1;
+	}
+
+	return kms_wait_flip(k, vblank_us);
+}
+
+static inline void kms_close(struct kms_output *k)
+{
+	struct drm_mode_destroy_blob blob;
+
+	kms_free_buffers(k);
+	if (k->mode_blob) {
+		blob.blob_id = k->mode_blob;
+		kms_ioctl(k->fd, DRM_IOCTL_MODE_DESTROYPROPBLOB, &blob);
+	}
+	close(k->fd);
+}
+
+#endif
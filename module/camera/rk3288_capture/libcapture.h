@@ -0,0 +1,410 @@
+/*
+ * libcapture: consumer side of the capture shm protocol.
+ *
+ * Copyright (C) 2017 zhujiongfu
+ *
+ * Consumers attach to a stream by name and get read-only, zero-copy
+ * views of the published frames, whether the producer copies into the
+ * shm slots or exports its V4L2 buffers. Nothing outside this file
+ * needs to know how frames get from the producer to the view.
+ *
+ *	struct capture_client c;
+ *	struct capture_frame f;
+ *
+ *	capture_attach(&c, "cam0", READER_DROP_OLDEST);
+ *	while (capture_acquire_frame(&c, &f, 1000) == 0) {
+ *		use f.planes[], f.meta;
+ *		if (capture_release_frame(&c, &f) < 0)
+ *			the frame was overwritten while in use;
+ *	}
+ *	capture_detach(&c);
+ *
+ * In copy mode the view points into the shm slot, so a drop-oldest or
+ * latest-only reader that holds a frame for longer than the ring depth
+ * may see it overwritten; capture_release_frame() tells. Readers that
+ * must keep frames stable use READER_BLOCK_PRODUCER, or export mode,
+ * where a held frame is leased and never requeued under the reader.
+ *
+ * Readers interested in parts of the frame only register them with
+ * capture_roi_add() and read them through capture_frame_view(); see
+ * capture_roi.h for what that saves on the producer side.
+ *
+ * Readers that don't need every frame say so with capture_subscribe();
+ * the producer only copies frames some reader is going to take.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ */
+
+#ifndef __LIBCAPTURE_H
+#define __LIBCAPTURE_H
+
+#include <linux/videodev2.h>
+#include "v4l2_capture.h"
+#include "capture_export.h"
+#include "capture_pool.h"
+#include "capture_roi.h"
+#include "capture_stats.h"
+
+struct capture_plane {
+	const unsigned char	*data;
+	unsigned int		stride;
+	unsigned int		width;		/* in bytes */
+	unsigned int		height;
+};
+
+struct capture_frame {
+	struct capture_meta	meta;
+	unsigned int		width;
+	unsigned int		height;
+	unsigned int		fmt;
+	const unsigned char	*data;		/* whole frame, meta.bytesused */
+	unsigned int		nplanes;
+	struct capture_plane	planes[CAPTURE_MAX_PLANES];
+
+	/* private */
+	unsigned int		frame;
+	int			buf;
+	uint64_t		acquired;
+};
+
+/*
+ * A ROI of a held frame. planes[].data points into the frame itself,
+ * offset[] is where that is relative to capture_frame.data, so the view
+ * is only valid until the frame is released.
+ */
+struct capture_view {
+	struct capture_roi	roi;
+	unsigned int		nplanes;
+	struct capture_plane	planes[CAPTURE_MAX_PLANES];
+	unsigned int		offset[CAPTURE_MAX_PLANES];
+};
+
+struct capture_client {
+	struct capture_pool	pool;
+	struct capture_data	*shm;
+	struct capture_reader	*reader;
+	/* NULL unless the producer runs with --stats */
+	struct capture_stats	*stats;
+	struct capture_pool	stats_pool;
+	struct capture_layout	layout;
+	/* capture_data.roi_gen of our last ROI registration */
+	unsigned int		roi_gen;
+	unsigned int		export_cnt;
+	unsigned int		export_len;
+	unsigned char		*maps[CAPTURE_MAX_BUFS];
+};
+
+static inline void capture_fill_planes(struct capture_frame *f,
+				const struct capture_layout *l,
+				const unsigned char *base)
+{
+	const struct capture_layout_plane *p;
+	unsigned int i;
+
+	f->nplanes = l->nplanes;
+	for (i = 0; i < l->nplanes; i++) {
+		p = &l->planes[i];
+		f->planes[i].data = base + p->offset;
+		f->planes[i].stride = p->stride;
+		f->planes[i].width = p->width;
+		f->planes[i].height = p->height;
+	}
+}
+
+static inline int capture_map_exported(struct capture_client *c,
+				const char *name)
+{
+	char path[108];
+	int fds[CAPTURE_MAX_BUFS];
+	unsigned int i;
+
+	export_sock_path(path, sizeof(path), name);
+	if (export_connect(path, fds, &c->export_cnt, &c->export_len) < 0)
+		return -1;
+
+	for (i = 0; i < c->export_cnt; i++) {
+		c->maps[i] = mmap(NULL, c->export_len, PROT_READ, MAP_SHARED,
+					fds[i], 0);
+		close(fds[i]);
+		if (c->maps[i] == MAP_FAILED) {
+			perror("mmap exported buf error");
+			while (i--)
+				munmap(c->maps[i], c->export_len);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static inline int capture_attach(struct capture_client *c, const char *name,
+				enum reader_policy policy)
+{
+	memset(c, 0, sizeof(*c));
+	c->shm = capture_pool_attach(&c->pool, name);
+	if (!c->shm)
+		return -1;
+
+	if ((c->shm->flags & CAPTURE_F_EXPORT) &&
+			capture_map_exported(c, name) < 0)
+		goto err;
+
+	capture_layout(&c->layout, c->shm->fmt, c->shm->width, c->shm->height,
+			c->shm->bytesperline, c->shm->sizeimage);
+	c->reader = reader_attach(c->shm, policy);
+	if (!c->reader) {
+		printf("%s: no free reader slot.\n", name);
+		goto err;
+	}
+	c->stats = capture_stats_attach(&c->stats_pool, name);
+
+	return 0;
+
+err:
+	capture_pool_detach(&c->pool);
+	return -1;
+}
+
+static inline void capture_detach(struct capture_client *c)
+{
+	unsigned int i;
+
+	reader_detach(c->shm, c->reader);
+	if (c->stats)
+		capture_pool_detach(&c->stats_pool);
+	for (i = 0; i < c->export_cnt; i++)
+		munmap(c->maps[i], c->export_len);
+	capture_pool_detach(&c->pool);
+}
+
+/*
+ * A partial frame holds only the ROIs registered when it was published:
+ * no use to whole-frame readers, nor to a reader whose ROIs are newer.
+ */
+static inline bool capture_frame_usable(struct capture_client *c,
+				const struct capture_meta *meta)
+{
+	if (!(meta->flags & CAPTURE_META_PARTIAL))
+		return true;
+	if (!READ_ONCE(c->reader->nr_rois))
+		return false;
+
+	return (int)(meta->roi_gen - c->roi_gen) >= 0;
+}
+
+/*
+ * Wait up to timeout_ms (-1 forever) for the next frame of this reader
+ * and return a view of it. Every successful acquire must be paired with
+ * capture_release_frame().
+ */
+static inline int capture_acquire_frame(struct capture_client *c,
+				struct capture_frame *f, int timeout_ms)
+{
+	struct capture_data *shm = c->shm;
+	const unsigned char *base;
+	uint64_t deadline = 0, now;
+	int ret;
+
+	if (timeout_ms >= 0)
+		deadline = capture_now_us() + (uint64_t)timeout_ms * 1000;
+
+	for (;;) {
+		if (shm->flags & CAPTURE_F_EXPORT) {
+			f->buf = export_acquire(shm, c->reader, &f->frame,
+						&f->meta);
+			if (f->buf >= 0) {
+				base = c->maps[f->buf];
+				break;
+			}
+		} else if (ring_read_begin(shm, c->reader, &f->frame) >= 0) {
+			f->buf = -1;
+			ring_read_meta(shm, f->frame, &f->meta);
+			base = (unsigned char *)capture_slot_buf(shm, f->frame);
+			if (!reader_wants(shm, c->reader, &f->meta)) {
+				/* published for other subscribers only */
+				smp_store_release(&c->reader->out,
+							f->frame + 1);
+				continue;
+			}
+			if (capture_frame_usable(c, &f->meta))
+				break;
+			/* published for other ROIs than ours, skip it */
+			smp_store_release(&c->reader->out, f->frame + 1);
+			WRITE_ONCE(c->reader->drops, c->reader->drops + 1);
+			continue;
+		}
+
+		if (timeout_ms < 0) {
+			ret = ring_wait(shm, c->reader, -1);
+		} else {
+			now = capture_now_us();
+			if (now >= deadline)
+				return -ETIMEDOUT;
+			ret = ring_wait(shm, c->reader,
+					(deadline - now + 999) / 1000);
+		}
+		if (ret < 0 && ret != -ETIMEDOUT)
+			return ret;
+	}
+
+	if (f->meta.bytesused > shm->sizeimage)
+		f->meta.bytesused = shm->sizeimage;
+	f->width = shm->width;
+	f->height = shm->height;
+	f->fmt = shm->fmt;
+	f->data = base;
+	capture_fill_planes(f, &c->layout, base);
+	f->acquired = stat_end(c->stats, STAT_ACQUIRE,
+				f->meta.publish_us * 1000);
+
+	return 0;
+}
+
+/*
+ * Hand the frame back. Returns -1 if, in copy mode, the producer
+ * overwrote the slot while the frame was held, in which case whatever
+ * was read from the view must be thrown away.
+ */
+static inline int capture_release_frame(struct capture_client *c,
+				struct capture_frame *f)
+{
+	stat_end(c->stats, STAT_HOLD, f->acquired);
+	if (f->buf >= 0) {
+		export_release(c->shm, c->reader, f->buf);
+	} else if (ring_read_end(c->shm, c->reader, f->frame) < 0) {
+		if (c->stats)
+			__atomic_fetch_add(&c->stats->torn, 1,
+						__ATOMIC_RELAXED);
+		return -1;
+	}
+	reader_account(c->shm, c->reader, &f->meta);
+
+	return 0;
+}
+
+/*
+ * Take at most max_fps frames a second and, with every > 1, only one
+ * frame in every that many; 0 lifts a limit. Frames no reader wants
+ * are requeued by the producer without being copied.
+ */
+static inline void capture_subscribe(struct capture_client *c,
+				unsigned int max_fps, unsigned int every)
+{
+	struct capture_reader *r = c->reader;
+
+	WRITE_ONCE(r->sub_interval_us, max_fps ? 1000000 / max_fps : 0);
+	WRITE_ONCE(r->sub_every, every > 1 ? every : 0);
+	__atomic_add_fetch(&r->sub_gen, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Register a ROI, rounded out to the chroma subsampling of the stream
+ * and clipped to the frame. Once every reader of the stream has ROIs
+ * the producer stops publishing the rest of the frame. Returns the ROI
+ * index for capture_frame_view(), or -1.
+ */
+static inline int capture_roi_add(struct capture_client *c, const char *name,
+				unsigned int x, unsigned int y,
+				unsigned int width, unsigned int height)
+{
+	struct capture_reader *r = c->reader;
+	struct capture_roi *roi;
+	unsigned int n = r->nr_rois;
+
+	if (n == CAPTURE_MAX_ROIS) {
+		printf("%s: no room for another ROI.\n", name);
+		return -1;
+	}
+
+	roi = &r->rois[n];
+	memset(roi, 0, sizeof(*roi));
+	strncpy(roi->name, name, sizeof(roi->name) - 1);
+	roi->x = x;
+	roi->y = y;
+	roi->width = width;
+	roi->height = height;
+	capture_roi_fit(&c->layout, roi, c->shm->width, c->shm->height);
+	if (!roi->width || !roi->height) {
+		printf("%s: ROI outside the frame.\n", name);
+		return -1;
+	}
+
+	smp_store_release(&r->nr_rois, n + 1);
+	c->roi_gen = __atomic_add_fetch(&c->shm->roi_gen, 1, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+/* back to whole frames, partial frames still in the ring are skipped */
+static inline void capture_roi_clear(struct capture_client *c)
+{
+	smp_store_release(&c->reader->nr_rois, 0);
+}
+
+static inline int capture_roi_find(struct capture_client *c, const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < c->reader->nr_rois; i++)
+		if (!strncmp(c->reader->rois[i].name, name,
+					sizeof(c->reader->rois[i].name)))
+			return i;
+
+	return -1;
+}
+
+/* zero-copy view of ROI idx of a held frame */
+static inline int capture_frame_view(struct capture_client *c,
+				const struct capture_frame *f, int idx,
+				struct capture_view *v)
+{
+	unsigned int i, len, rows;
+
+	if (idx < 0 || (unsigned int)idx >= c->reader->nr_rois)
+		return -EINVAL;
+
+	v->roi = c->reader->rois[idx];
+	v->nplanes = c->layout.nplanes;
+	for (i = 0; i < v->nplanes; i++) {
+		v->offset[i] = capture_roi_rect(&c->layout, i, &v->roi,
+						&len, &rows);
+		v->planes[i].data = f->data + v->offset[i];
+		v->planes[i].stride = c->layout.planes[i].stride;
+		v->planes[i].width = len;
+		v->planes[i].height = rows;
+	}
+
+	return 0;
+}
+
+/*
+ * Compact mode: copy the view into dst with the planes packed back to
+ * back and no padding between rows, for consumers that need contiguous
+ * input such as a hardware encoder. With dst NULL only the size needed
+ * is returned.
+ */
+static inline size_t capture_view_compact(const struct capture_view *v,
+				void *dst)
+{
+	const struct capture_plane *p;
+	unsigned char *out = dst;
+	size_t size = 0;
+	unsigned int i, y;
+
+	for (i = 0; i < v->nplanes; i++) {
+		p = &v->planes[i];
+		size += (size_t)p->width * p->height;
+		if (!dst)
+			continue;
+		for (y = 0; y < p->height; y++) {
+			memcpy(out, p->data + (size_t)y * p->stride, p->width);
+			out += p->width;
+		}
+	}
+
+	return size;
+}
+
+#endif
@@ -0,0 +1,623 @@
+/*
+ * YUV to RGB conversion for preview and display.
+ *
+ * Copyright (C) 2017 zhujiongfu
+ *
+ * Converts the formats we capture (YUYV, NV12, NV21, I420) to RGB32,
+ * BGR24 or RGB565 with BT.601 or BT.709 coefficients, full or limited
+ * range, without needing the FIMC block.
+ *
+ * Every kernel computes exactly what pixconv_rgb() does: 32 bit
+ * intermediates, Q13 coefficients, an arithmetic shift and a clamp.
+ * Nothing is approximated in 16 bits, so the SIMD output is bit-exact
+ * against the C reference rather than merely close to it. The row kernels
+ * take chroma as (c0, c1) pairs in memory order, and NV21 is handled by
+ * swapping the coefficients rather than the data.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ */
+
+#ifndef __PIXCONV_H
+#define __PIXCONV_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <linux/videodev2.h>
+#include "copy_kernel.h"
+
+/* B, G, R, 0xff in memory: fbdev at 32bpp, DRM XRGB8888 */
+#define PIXCONV_RGB32		0
+/* B, G, R in memory */
+#define PIXCONV_BGR24		1
+/* native endian, red in the top bits */
+#define PIXCONV_RGB565		2
+
+#define PIXCONV_BT601		0
+#define PIXCONV_BT709		1
+
+#define PIXCONV_SHIFT		13
+#define PIXCONV_ROUND		(1 << (PIXCONV_SHIFT - 1))
+
+struct pixconv;
+
+typedef void (*pixconv_row_fn)(const struct pixconv *pc, uint8_t *dst,
+				const uint8_t *y, const uint8_t *u,
+				const uint8_t *v, unsigned int width);
+
+struct pixconv_kernel {
+	const char		*name;
+	pixconv_row_fn		row;
+	bool			(*supported)(void);
+};
+
+struct pixconv {
+	const struct pixconv_kernel *kernel;
+	uint32_t		fourcc;
+	unsigned int		out;
+	unsigned int		bpp;
+	/* bytes between two luma / two chroma samples of a row */
+	unsigned int		y_step;
+	unsigned int		c_step;
+
+	int16_t			yoff;
+	int16_t			yc;
+	/* per (c0, c1) chroma pair in memory order, G already negated */
+	int16_t			rc[2];
+	int16_t			gc[2];
+	int16_t			bc[2];
+};
+
+static inline uint8_t pixconv_clamp(int32_t x)
+{
+	x >>= PIXCONV_SHIFT;
+
+	return x < 0 ? 0 : x > 255 ? 255 : x;
+}
+
+static inline void pixconv_put(const struct pixconv *pc, uint8_t *d,
+				uint8_t r, uint8_t g, uint8_t b)
+{
+	uint16_t p;
+
+	switch (pc->out) {
+	case PIXCONV_RGB32:
+		d[0] = b;
+		d[1] = g;
+		d[2] = r;
+		d[3] = 0xff;
+		break;
+	case PIXCONV_BGR24:
+		d[0] = b;
+		d[1] = g;
+		d[2] = r;
+		break;
+	default:
+		p = (r & 0xf8) << 8 | (g & 0xfc) << 3 | b >> 3;
+		memcpy(d, &p, sizeof(p));
+		break;
+	}
+}
+
+/* the reference: one pixel, chroma in memory order */
+static inline void pixconv_rgb(const struct pixconv *pc, uint8_t *d,
+				int y, int c0, int c1)
+{
+	int32_t yy = (y - pc->yoff) * pc->yc + PIXCONV_ROUND;
+
+	c0 -= 128;
+	c1 -= 128;
+	pixconv_put(pc, d,
+		pixconv_clamp(yy + c0 * pc->rc[0] + c1 * pc->rc[1]),
+		pixconv_clamp(yy + c0 * pc->gc[0] + c1 * pc->gc[1]),
+		pixconv_clamp(yy + c0 * pc->bc[0] + c1 * pc->bc[1]));
+}
+
+static void pixconv_row_c(const struct pixconv *pc, uint8_t *dst,
+				const uint8_t *y, const uint8_t *u,
+				const uint8_t *v, unsigned int width)
+{
+	/* c0 is whichever of u and v comes first in memory */
+	const uint8_t *c0 = pc->fourcc == V4L2_PIX_FMT_NV21 ? v : u;
+	const uint8_t *c1 = pc->fourcc == V4L2_PIX_FMT_NV21 ? u : v;
+	unsigned int x, c;
+
+	for (x = 0; x < width; x++) {
+		c = (x >> 1) * pc->c_step;
+		pixconv_rgb(pc, dst, y[x * pc->y_step], c0[c], c1[c]);
+		dst += pc->bpp;
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * x86 works on int16 lanes: y holds the luma of each pixel and c the
+ * chroma pairs (c0, c1) of every two pixels, both already centred.
+ * pmaddwd then does Y * yc + round and c0 * k0 + c1 * k1 in one go.
+ */
+#define PIXCONV_PAIR(lo, hi)	((uint32_t)(uint16_t)(lo) | \
+					(uint32_t)(uint16_t)(hi) << 16)
+
+/* BGR24 has no cheap SSE2/AVX2 shuffle, so it is packed from the lanes */
+static inline void pixconv_put_lanes(const struct pixconv *pc, uint8_t *d,
+				const int16_t *r, const int16_t *g,
+				const int16_t *b, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++, d += 3) {
+		d[0] = b[i];
+		d[1] = g[i];
+		d[2] = r[i];
+	}
+}
+
+__attribute__((target("sse2")))
+static inline __m128i pixconv_sse2_chan(__m128i yl, __m128i yh,
+				__m128i cl, __m128i ch, __m128i k)
+{
+	__m128i lo = _mm_add_epi32(yl, _mm_madd_epi16(cl, k));
+	__m128i hi = _mm_add_epi32(yh, _mm_madd_epi16(ch, k));
+
+	lo = _mm_srai_epi32(lo, PIXCONV_SHIFT);
+	hi = _mm_srai_epi32(hi, PIXCONV_SHIFT);
+	lo = _mm_packs_epi32(lo, hi);
+	lo = _mm_max_epi16(lo, _mm_setzero_si128());
+
+	return _mm_min_epi16(lo, _mm_set1_epi16(255));
+}
+
+/* 8 pixels per iteration */
+__attribute__((target("sse2")))
+static void pixconv_row_sse2(const struct pixconv *pc, uint8_t *dst,
+				const uint8_t *y, const uint8_t *u,
+				const uint8_t *v, unsigned int width)
+{
+	const uint8_t *c0 = pc->fourcc == V4L2_PIX_FMT_NV21 ? v : u;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi16(1);
+	const __m128i yoff = _mm_set1_epi16(pc->yoff);
+	const __m128i coff = _mm_set1_epi16(128);
+	const __m128i ky = _mm_set1_epi32(PIXCONV_PAIR(pc->yc,
+						PIXCONV_ROUND));
+	const __m128i kr = _mm_set1_epi32(PIXCONV_PAIR(pc->rc[0],
+						pc->rc[1]));
+	const __m128i kg = _mm_set1_epi32(PIXCONV_PAIR(pc->gc[0],
+						pc->gc[1]));
+	const __m128i kb = _mm_set1_epi32(PIXCONV_PAIR(pc->bc[0],
+						pc->bc[1]));
+	__m128i ys, cs, yl, yh, cl, ch, r, g, b, bg, ra;
+	int16_t lanes[3][8];
+	unsigned int x;
+	uint32_t a, e;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		switch (pc->fourcc) {
+		case V4L2_PIX_FMT_YUYV:
+			ys = _mm_loadu_si128((const __m128i *)(y + x * 2));
+			cs = _mm_srli_epi16(ys, 8);
+			ys = _mm_and_si128(ys, _mm_set1_epi16(0xff));
+			break;
+		case V4L2_PIX_FMT_YUV420:
+			memcpy(&a, u + x / 2, 4);
+			memcpy(&e, v + x / 2, 4);
+			cs = _mm_unpacklo_epi8(_mm_cvtsi32_si128(a),
+						_mm_cvtsi32_si128(e));
+			cs = _mm_unpacklo_epi8(cs, zero);
+			ys = _mm_loadl_epi64((const __m128i *)(y + x));
+			ys = _mm_unpacklo_epi8(ys, zero);
+			break;
+		default:
+			cs = _mm_loadl_epi64((const __m128i *)(c0 + x));
+			cs = _mm_unpacklo_epi8(cs, zero);
+			ys = _mm_loadl_epi64((const __m128i *)(y + x));
+			ys = _mm_unpacklo_epi8(ys, zero);
+			break;
+		}
+		ys = _mm_sub_epi16(ys, yoff);
+		cs = _mm_sub_epi16(cs, coff);
+
+		yl = _mm_madd_epi16(_mm_unpacklo_epi16(ys, one), ky);
+		yh = _mm_madd_epi16(_mm_unpackhi_epi16(ys, one), ky);
+		cl = _mm_unpacklo_epi32(cs, cs);
+		ch = _mm_unpackhi_epi32(cs, cs);
+		r = pixconv_sse2_chan(yl, yh, cl, ch, kr);
+		g = pixconv_sse2_chan(yl, yh, cl, ch, kg);
+		b = pixconv_sse2_chan(yl, yh, cl, ch, kb);
+
+		switch (pc->out) {
+		case PIXCONV_RGB32:
+			bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+			ra = _mm_or_si128(r, _mm_set1_epi16(0xff00));
+			_mm_storeu_si128((__m128i *)(dst + x * 4),
+					_mm_unpacklo_epi16(bg, ra));
+			_mm_storeu_si128((__m128i *)(dst + x * 4 + 16),
+					_mm_unpackhi_epi16(bg, ra));
+			break;
+		case PIXCONV_RGB565:
+			r = _mm_and_si128(_mm_slli_epi16(r, 8),
+						_mm_set1_epi16(0xf800));
+			g = _mm_and_si128(_mm_slli_epi16(g, 3),
+						_mm_set1_epi16(0x07e0));
+			b = _mm_srli_epi16(b, 3);
+			_mm_storeu_si128((__m128i *)(dst + x * 2),
+				_mm_or_si128(_mm_or_si128(r, g), b));
+			break;
+		default:
+			_mm_storeu_si128((__m128i *)lanes[0], r);
+			_mm_storeu_si128((__m128i *)lanes[1], g);
+			_mm_storeu_si128((__m128i *)lanes[2], b);
+			pixconv_put_lanes(pc, dst + x * 3, lanes[0],
+					lanes[1], lanes[2], 8);
+			break;
+		}
+	}
+
+	if (x < width)
+		pixconv_row_c(pc, dst + x * pc->bpp, y + x * pc->y_step,
+				u + x / 2 * pc->c_step, v + x / 2 * pc->c_step,
+				width - x);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i pixconv_avx2_chan(__m256i yl, __m256i yh,
+				__m256i cl, __m256i ch, __m256i k)
+{
+	__m256i lo = _mm256_add_epi32(yl, _mm256_madd_epi16(cl, k));
+	__m256i hi = _mm256_add_epi32(yh, _mm256_madd_epi16(ch, k));
+
+	lo = _mm256_srai_epi32(lo, PIXCONV_SHIFT);
+	hi = _mm256_srai_epi32(hi, PIXCONV_SHIFT);
+	lo = _mm256_packs_epi32(lo, hi);
+	lo = _mm256_max_epi16(lo, _mm256_setzero_si256());
+
+	return _mm256_min_epi16(lo, _mm256_set1_epi16(255));
+}
+
+/*
+ * 16 pixels per iteration. The in-lane unpacks leave pixels 0-3 and 8-11
+ * in the low halves and 4-7, 12-15 in the high ones; packs puts them
+ * back in order, so only the RGB32 store needs a lane permute.
+ */
+__attribute__((target("avx2")))
+static void pixconv_row_avx2(const struct pixconv *pc, uint8_t *dst,
+				const uint8_t *y, const uint8_t *u,
+				const uint8_t *v, unsigned int width)
+{
+	const uint8_t *c0 = pc->fourcc == V4L2_PIX_FMT_NV21 ? v : u;
+	const __m256i one = _mm256_set1_epi16(1);
+	const __m256i yoff = _mm256_set1_epi16(pc->yoff);
+	const __m256i coff = _mm256_set1_epi16(128);
+	const __m256i ky = _mm256_set1_epi32(PIXCONV_PAIR(pc->yc,
+						PIXCONV_ROUND));
+	const __m256i kr = _mm256_set1_epi32(PIXCONV_PAIR(pc->rc[0],
+						pc->rc[1]));
+	const __m256i kg = _mm256_set1_epi32(PIXCONV_PAIR(pc->gc[0],
+						pc->gc[1]));
+	const __m256i kb = _mm256_set1_epi32(PIXCONV_PAIR(pc->bc[0],
+						pc->bc[1]));
+	__m256i ys, cs, yl, yh, cl, ch, r, g, b, bg, ra, lo, hi;
+	int16_t lanes[3][16];
+	unsigned int x;
+	__m128i t;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		switch (pc->fourcc) {
+		case V4L2_PIX_FMT_YUYV:
+			ys = _mm256_loadu_si256((const __m256i *)(y + x * 2));
+			cs = _mm256_srli_epi16(ys, 8);
+			ys = _mm256_and_si256(ys, _mm256_set1_epi16(0xff));
+			break;
+		case V4L2_PIX_FMT_YUV420:
+			t = _mm_unpacklo_epi8(
+				_mm_loadl_epi64((const __m128i *)(u + x / 2)),
+				_mm_loadl_epi64((const __m128i *)(v + x / 2)));
+			cs = _mm256_cvtepu8_epi16(t);
+			ys = _mm256_cvtepu8_epi16(
+				_mm_loadu_si128((const __m128i *)(y + x)));
+			break;
+		default:
+			cs = _mm256_cvtepu8_epi16(
+				_mm_loadu_si128((const __m128i *)(c0 + x)));
+			ys = _mm256_cvtepu8_epi16(
+				_mm_loadu_si128((const __m128i *)(y + x)));
+			break;
+		}
+		ys = _mm256_sub_epi16(ys, yoff);
+		cs = _mm256_sub_epi16(cs, coff);
+
+		yl = _mm256_madd_epi16(_mm256_unpacklo_epi16(ys, one), ky);
+		yh = _mm256_madd_epi16(_mm256_unpackhi_epi16(ys, one), ky);
+		cl = _mm256_unpacklo_epi32(cs, cs);
+		ch = _mm256_unpackhi_epi32(cs, cs);
+		r = pixconv_avx2_chan(yl, yh, cl, ch, kr);
+		g = pixconv_avx2_chan(yl, yh, cl, ch, kg);
+		b = pixconv_avx2_chan(yl, yh, cl, ch, kb);
+
+		switch (pc->out) {
+		case PIXCONV_RGB32:
+			bg = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));
+			ra = _mm256_or_si256(r, _mm256_set1_epi16(0xff00));
+			lo = _mm256_unpacklo_epi16(bg, ra);
+			hi = _mm256_unpackhi_epi16(bg, ra);
+			_mm256_storeu_si256((__m256i *)(dst + x * 4),
+				_mm256_permute2x128_si256(lo, hi, 0x20));
+			_mm256_storeu_si256((__m256i *)(dst + x * 4 + 32),
+				_mm256_permute2x128_si256(lo, hi, 0x31));
+			break;
+		case PIXCONV_RGB565:
+			r = _mm256_and_si256(_mm256_slli_epi16(r, 8),
+						_mm256_set1_epi16(0xf800));
+			g = _mm256_and_si256(_mm256_slli_epi16(g, 3),
+						_mm256_set1_epi16(0x07e0));
+			b = _mm256_srli_epi16(b, 3);
+			_mm256_storeu_si256((__m256i *)(dst + x * 2),
+				_mm256_or_si256(_mm256_or_si256(r, g), b));
+			break;
+		default:
+			_mm256_storeu_si256((__m256i *)lanes[0], r);
+			_mm256_storeu_si256((__m256i *)lanes[1], g);
+			_mm256_storeu_si256((__m256i *)lanes[2], b);
+			pixconv_put_lanes(pc, dst + x * 3, lanes[0],
+					lanes[1], lanes[2], 16);
+			break;
+		}
+	}
+
+	if (x < width)
+		pixconv_row_c(pc, dst + x * pc->bpp, y + x * pc->y_step,
+				u + x / 2 * pc->c_step, v + x / 2 * pc->c_step,
+				width - x);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+static inline int16x4_t pixconv_neon_half(int32x4_t yy, int16x4_t c0,
+				int16x4_t c1, const int16_t *k)
+{
+	yy = vmlal_n_s16(yy, c0, k[0]);
+	yy = vmlal_n_s16(yy, c1, k[1]);
+
+	return vqmovn_s32(vshrq_n_s32(yy, PIXCONV_SHIFT));
+}
+
+static inline uint8x8_t pixconv_neon_chan(int32x4_t yl, int32x4_t yh,
+				int16x4x2_t c0, int16x4x2_t c1,
+				const int16_t *k)
+{
+	int16x8_t x = vcombine_s16(pixconv_neon_half(yl, c0.val[0],
+						c1.val[0], k),
+				pixconv_neon_half(yh, c0.val[1], c1.val[1], k));
+
+	/* the saturating narrow clamps to 0..255 */
+	return vqmovun_s16(x);
+}
+
+/* 8 pixels per iteration, vst3/vst4 do the interleaving */
+static void pixconv_row_neon(const struct pixconv *pc, uint8_t *dst,
+				const uint8_t *y, const uint8_t *u,
+				const uint8_t *v, unsigned int width)
+{
+	const uint8_t *c0 = pc->fourcc == V4L2_PIX_FMT_NV21 ? v : u;
+	const int32x4_t round = vdupq_n_s32(PIXCONV_ROUND);
+	uint8x8_t y8, cs8;
+	uint8x8x2_t yc;
+	int16x8_t ys, cs;
+	int16x4_t cu;
+	int16x4x2_t k0, k1;
+	int32x4_t yl, yh;
+	uint8x8x4_t bgra;
+	uint8x8x3_t bgr;
+	uint16x8_t p;
+	unsigned int x;
+	uint32_t a, e;
+
+	bgra.val[3] = vdup_n_u8(0xff);
+	for (x = 0; x + 8 <= width; x += 8) {
+		switch (pc->fourcc) {
+		case V4L2_PIX_FMT_YUYV:
+			yc = vld2_u8(y + x * 2);
+			y8 = yc.val[0];
+			cs8 = yc.val[1];
+			break;
+		case V4L2_PIX_FMT_YUV420:
+			memcpy(&a, u + x / 2, 4);
+			memcpy(&e, v + x / 2, 4);
+			cs8 = vzip_u8(vcreate_u8(a), vcreate_u8(e)).val[0];
+			y8 = vld1_u8(y + x);
+			break;
+		default:
+			cs8 = vld1_u8(c0 + x);
+			y8 = vld1_u8(y + x);
+			break;
+		}
+		ys = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(y8)),
+					vdupq_n_s16(pc->yoff));
+		cs = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(cs8)),
+					vdupq_n_s16(128));
+
+		yl = vmlal_n_s16(round, vget_low_s16(ys), pc->yc);
+		yh = vmlal_n_s16(round, vget_high_s16(ys), pc->yc);
+		/* every chroma sample covers two pixels */
+		cu = vget_low_s16(vuzpq_s16(cs, cs).val[0]);
+		k0 = vzip_s16(cu, cu);
+		cu = vget_low_s16(vuzpq_s16(cs, cs).val[1]);
+		k1 = vzip_s16(cu, cu);
+
+		bgr.val[0] = pixconv_neon_chan(yl, yh, k0, k1, pc->bc);
+		bgr.val[1] = pixconv_neon_chan(yl, yh, k0, k1, pc->gc);
+		bgr.val[2] = pixconv_neon_chan(yl, yh, k0, k1, pc->rc);
+
+		switch (pc->out) {
+		case PIXCONV_RGB32:
+			bgra.val[0] = bgr.val[0];
+			bgra.val[1] = bgr.val[1];
+			bgra.val[2] = bgr.val[2];
+			vst4_u8(dst + x * 4, bgra);
+			break;
+		case PIXCONV_RGB565:
+			p = vshlq_n_u16(vmovl_u8(vshr_n_u8(bgr.val[2], 3)), 11);
+			p = vorrq_u16(p, vshlq_n_u16(vmovl_u8(
+					vshr_n_u8(bgr.val[1], 2)), 5));
+			p = vorrq_u16(p, vmovl_u8(vshr_n_u8(bgr.val[0], 3)));
+			vst1q_u16((uint16_t *)(dst + x * 2), p);
+			break;
+		default:
+			vst3_u8(dst + x * 3, bgr);
+			break;
+		}
+	}
+
+	if (x < width)
+		pixconv_row_c(pc, dst + x * pc->bpp, y + x * pc->y_step,
+				u + x / 2 * pc->c_step, v + x / 2 * pc->c_step,
+				width - x);
+}
+#endif
+
+/* best first */
+static const struct pixconv_kernel pixconv_kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+	{ "avx2", pixconv_row_avx2, copy_has_avx2 },
+	{ "sse2", pixconv_row_sse2, copy_has_sse2 },
+#endif
+#if defined(__ARM_NEON) || defined(__aarch64__)
+	{ "neon", pixconv_row_neon, copy_has_neon },
+#endif
+	{ "c", pixconv_row_c, copy_always },
+};
+
+#define NR_PIXCONV_KERNELS	(sizeof(pixconv_kernels) / sizeof(pixconv_kernels[0]))
+
+static inline bool pixconv_supported(uint32_t fourcc)
+{
+	switch (fourcc) {
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_NV21:
+	case V4L2_PIX_FMT_YUV420:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static inline int16_t pixconv_q(double k)
+{
+	return k < 0 ? (int16_t)(k - 0.5) : (int16_t)(k + 0.5);
+}
+
+static inline unsigned int pixconv_bpp(unsigned int out)
+{
+	return out == PIXCONV_RGB32 ? 4 : out == PIXCONV_BGR24 ? 3 : 2;
+}
+
+/*
+ * kernel names the row kernel as in pixconv_kernels[], NULL or an
+ * unsupported one picks the best for this CPU.
+ */
+static inline int pixconv_init(struct pixconv *pc, uint32_t fourcc,
+				unsigned int out, unsigned int matrix,
+				bool full_range, const char *kernel)
+{
+	double kr = matrix == PIXCONV_BT709 ? 0.2126 : 0.299;
+	double kb = matrix == PIXCONV_BT709 ? 0.0722 : 0.114;
+	double kg = 1.0 - kr - kb;
+	double ys = full_range ? 1.0 : 255.0 / 219.0;
+	double cs = (full_range ? 1.0 : 255.0 / 224.0) * (1 << PIXCONV_SHIFT);
+	int16_t rv, gu, gv, bu;
+	unsigned int i;
+
+	if (!pixconv_supported(fourcc) || out > PIXCONV_RGB565)
+		return -1;
+
+	memset(pc, 0, sizeof(*pc));
+	pc->fourcc = fourcc;
+	pc->out = out;
+	pc->bpp = pixconv_bpp(out);
+	pc->y_step = fourcc == V4L2_PIX_FMT_YUYV ? 2 : 1;
+	pc->c_step = fourcc == V4L2_PIX_FMT_YUYV ? 4 :
+			fourcc == V4L2_PIX_FMT_YUV420 ? 1 : 2;
+
+	pc->yoff = full_range ? 0 : 16;
+	pc->yc = pixconv_q(ys * (1 << PIXCONV_SHIFT));
+	rv = pixconv_q(2 * (1 - kr) * cs);
+	gu = -pixconv_q(2 * (1 - kb) * kb / kg * cs);
+	gv = -pixconv_q(2 * (1 - kr) * kr / kg * cs);
+	bu = pixconv_q(2 * (1 - kb) * cs);
+	if (fourcc == V4L2_PIX_FMT_NV21) {
+		pc->rc[0] = rv;
+		pc->gc[0] = gv;
+		pc->gc[1] = gu;
+		pc->bc[1] = bu;
+	} else {
+		pc->rc[1] = rv;
+		pc->gc[0] = gu;
+		pc->gc[1] = gv;
+		pc->bc[0] = bu;
+	}
+
+	for (i = 0; kernel && i < NR_PIXCONV_KERNELS; i++)
+		if (!strcmp(pixconv_kernels[i].name, kernel) &&
+				pixconv_kernels[i].supported())
+			break;
+	if (!kernel || i == NR_PIXCONV_KERNELS)
+		for (i = 0; i < NR_PIXCONV_KERNELS; i++)
+			if (pixconv_kernels[i].supported())
+				break;
+	pc->kernel = &pixconv_kernels[i];
+
+	return 0;
+}
+
+/*
+ * Convert rows [y0, y1) so that callers can band a frame across threads.
+ * plane[] and stride[] are laid out as capture_fill_planes() does it.
+ */
+static inline void pixconv_rows(const struct pixconv *pc, uint8_t *dst,
+				unsigned int dst_stride,
+				const uint8_t *const plane[3],
+				const unsigned int stride[3],
+				unsigned int width, unsigned int y0,
+				unsigned int y1)
+{
+	const uint8_t *yr, *u, *v;
+	unsigned int row;
+
+	for (row = y0; row < y1; row++) {
+		yr = plane[0] + (size_t)row * stride[0];
+		switch (pc->fourcc) {
+		case V4L2_PIX_FMT_YUYV:
+			u = yr + 1;
+			v = yr + 3;
+			break;
+		case V4L2_PIX_FMT_YUV420:
+			u = plane[1] + (size_t)(row / 2) * stride[1];
+			v = plane[2] + (size_t)(row / 2) * stride[2];
+			break;
+		case V4L2_PIX_FMT_NV21:
+			v = plane[1] + (size_t)(row / 2) * stride[1];
+			u = v + 1;
+			break;
+		default:
+			u = plane[1] + (size_t)(row / 2) * stride[1];
+			v = u + 1;
+			break;
+		}
+		pc->kernel->row(pc, dst + (size_t)row * dst_stride, yr, u, v,
+					width);
+	}
+}
+
+static inline void pixconv_frame(const struct pixconv *pc, uint8_t *dst,
+				unsigned int dst_stride,
+				const uint8_t *const plane[3],
+				const unsigned int stride[3],
+				unsigned int width, unsigned int height)
+{
+	pixconv_rows(pc, dst, dst_stride, plane, stride, width, 0, height);
+}
+
+#endif
@@ -0,0 +1,190 @@
+/*
+ * Presentation clock: when to put a captured frame on screen.
+ *
+ * Copyright (C) 2017 zhujiongfu
+ *
+ * Frames reach the display with the jitter of the sensor, the converter
+ * and the scheduler on top of their capture interval. Showing each one
+ * as it arrives passes all of that on to the screen. Instead every frame
+ * is due a fixed delay after its V4L2 timestamp and is shown on the first
+ * refresh at or after that, which keeps the capture cadence.
+ *
+ * The delay is the smallest transit seen (capture to arrival at the
+ * display), which slowly creeps up so a lasting change is followed, plus
+ * an adaptive margin. The margin never goes below smooth times the mean
+ * transit jitter (nor min_us), jumps by half a refresh whenever a frame
+ * arrives too late for its refresh, and decays while frames keep waiting
+ * for theirs. smooth trades latency for smoothness: 0 shows frames about
+ * as soon as they come, bigger values ride out longer hiccups.
+ *
+ * Glass to glass latency is estimated as timestamp to the vsync that put
+ * the frame on screen plus half a refresh of scanout; whatever the sensor
+ * does before the timestamp isn't in it.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ */
+
+#ifndef __PRESENT_CLOCK_H
+#define __PRESENT_CLOCK_H
+
+#include "v4l2_capture.h"
+
+#define PRESENT_MAX_MARGIN_US	100000
+/* transit base creeps up by 1/2^n of the difference per frame */
+#define PRESENT_BASE_SHIFT	7
+#define PRESENT_JITTER_SHIFT	4
+#define PRESENT_DECAY_SHIFT	5
+
+struct present_stats {
+	unsigned int		shown;
+	/* shown after their refresh, each grows the margin */
+	unsigned int		late;
+	/* superseded before their refresh came */
+	unsigned int		dropped;
+	/* extra refreshes the previous frame stayed up for */
+	unsigned int		repeats;
+	uint64_t		glass_us;
+	unsigned int		max_glass_us;
+};
+
+struct present_clock {
+	unsigned int		period_us;
+	unsigned int		smooth;
+	unsigned int		min_us;
+
+	bool			synced;
+	int64_t			base_us;
+	unsigned int		jitter_us;
+	unsigned int		margin_us;
+	/* the last vsync, the phase of the refresh grid */
+	uint64_t		vsync_us;
+	/* timestamp of the frame it showed */
+	uint64_t		shown_ts_us;
+
+	struct present_stats	stats;
+};
+
+static inline void present_init(struct present_clock *pc,
+				unsigned int period_us, unsigned int smooth,
+				unsigned int min_us)
+{
+	memset(pc, 0, sizeof(*pc));
+	pc->period_us = period_us ? period_us : 16667;
+	pc->smooth = smooth;
+	pc->min_us = min_us;
+	pc->margin_us = min_us;
+}
+
+static inline unsigned int present_floor(struct present_clock *pc)
+{
+	unsigned int f = pc->smooth * pc->jitter_us;
+
+	f = f > pc->min_us ? f : pc->min_us;
+	return f < PRESENT_MAX_MARGIN_US ? f : PRESENT_MAX_MARGIN_US;
+}
+
+/*
+ * A frame captured at *ts_us reached the display at arrival_us. Drivers
+ * without a usable monotonic timestamp get the arrival time instead.
+ */
+static inline void present_arrive(struct present_clock *pc, uint64_t *ts_us,
+				uint64_t arrival_us)
+{
+	int64_t transit, dev;
+
+	if (!*ts_us || *ts_us > arrival_us)
+		*ts_us = arrival_us;
+	transit = arrival_us - *ts_us;
+
+	if (!pc->synced) {
+		pc->base_us = transit;
+		pc->synced = true;
+	} else if (transit < pc->base_us) {
+		pc->base_us = transit;
+	} else {
+		pc->base_us += (transit - pc->base_us) >> PRESENT_BASE_SHIFT;
+	}
+
+	dev = transit - pc->base_us;
+	pc->jitter_us += (dev - (int64_t)pc->jitter_us) >> PRESENT_JITTER_SHIFT;
+	if (pc->margin_us < present_floor(pc))
+		pc->margin_us = present_floor(pc);
+}
+
+/* when the frame should be on screen */
+static inline uint64_t present_due(struct present_clock *pc, uint64_t ts_us)
+{
+	return ts_us + pc->base_us + pc->margin_us;
+}
+
+/* the first vsync at or after t, on the grid of the last one seen */
+static inline uint64_t present_vsync_after(struct present_clock *pc,
+				uint64_t t)
+{
+	uint64_t v = pc->vsync_us, p = pc->period_us;
+
+	if (!v)
+		return t;
+	if (t <= v)
+		return v - (v - t) / p * p;
+	return v + (t - v + p - 1) / p * p;
+}
+
+/* the refresh a frame captured at ts_us belongs on */
+static inline uint64_t present_slot(struct present_clock *pc, uint64_t ts_us)
+{
+	return present_vsync_after(pc, present_due(pc, ts_us));
+}
+
+static inline void present_dropped(struct present_clock *pc)
+{
+	pc->stats.dropped++;
+}
+
+/*
+ * The frame captured at ts_us, that arrived at arrival_us, went on
+ * screen at vsync_us.
+ */
+static inline void present_shown(struct present_clock *pc, uint64_t ts_us,
+				uint64_t arrival_us, uint64_t vsync_us)
+{
+	struct present_stats *st = &pc->stats;
+	uint64_t slot = present_slot(pc, ts_us);
+	unsigned int glass, periods, cadence, floor = present_floor(pc);
+
+	/* a 30 fps camera on a 60Hz panel shows each frame twice, fine */
+	if (pc->vsync_us && vsync_us > pc->vsync_us &&
+			ts_us > pc->shown_ts_us) {
+		periods = (vsync_us - pc->vsync_us + pc->period_us / 2) /
+				pc->period_us;
+		cadence = (ts_us - pc->shown_ts_us + pc->period_us / 2) /
+				pc->period_us;
+		if (periods > cadence && cadence)
+			st->repeats += periods - cadence;
+	}
+
+	if (vsync_us > slot + pc->period_us / 2) {
+		st->late++;
+		pc->margin_us += pc->period_us / 2;
+		if (pc->margin_us > PRESENT_MAX_MARGIN_US)
+			pc->margin_us = PRESENT_MAX_MARGIN_US;
+	} else if (slot > arrival_us + pc->period_us &&
+			pc->margin_us > floor) {
+		/* it could have made the refresh before */
+		pc->margin_us -= (pc->margin_us - floor) >> PRESENT_DECAY_SHIFT;
+		if (pc->margin_us > floor)
+			pc->margin_us--;
+	}
+	pc->vsync_us = vsync_us;
+	pc->shown_ts_us = ts_us;
+
+	glass = vsync_us - ts_us + pc->period_us / 2;
+	st->glass_us += glass;
+	if (glass > st->max_glass_us)
+		st->max_glass_us = glass;
+	st->shown++;
+}
+
+#endif
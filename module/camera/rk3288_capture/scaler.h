@@ -0,0 +1,582 @@
+/*
+ * Software scaler for preview and display.
+ *
+ * Copyright (C) 2017 zhujiongfu
+ *
+ * Separable bilinear or area (box) resampling at any ratio, for the
+ * resize the FIMC used to do and for the sizes and chips it can't do.
+ * Each plane is scaled on its own, so NV12 and I420 keep their chroma
+ * subsampling and interleaved UV is scaled as two byte pixels.
+ *
+ * The tap positions and Q14 weights of both axes are computed once at
+ * init. Each output row then needs its source rows filtered
+ * horizontally into Q7 int16 rows, which are cached so that each source
+ * row is filtered once per band. One vertical pass then combines them.
+ * The vertical pass is the SIMD part. All its arithmetic is exact in
+ * 32 bits, so every kernel gives the same bytes as the C one. Bands of
+ * output rows can run on the copy pool's workers.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ */
+
+#ifndef __SCALER_H
+#define __SCALER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/videodev2.h>
+#include "copy_kernel.h"
+#include "copy_pool.h"
+
+#define SCALER_BILINEAR		0
+#define SCALER_AREA		1
+
+#define SCALER_WBITS		14
+#define SCALER_HBITS		7
+/* the vertical pass shifts out both weights and the horizontal Q7 */
+#define SCALER_VSHIFT		(SCALER_WBITS * 2 - SCALER_HBITS)
+#define SCALER_MAX_TAPS		16
+#define SCALER_MAX_PLANES	3
+#define SCALER_MAX_BANDS	(COPY_POOL_MAX)
+
+typedef void (*scaler_vfn)(uint8_t *dst, const int16_t *const *rows,
+				const int16_t *w, unsigned int taps,
+				unsigned int n);
+
+struct scaler_kernel {
+	const char		*name;
+	scaler_vfn		vert;
+	bool			(*supported)(void);
+};
+
+/* where each output sample along one axis comes from */
+struct scaler_axis {
+	unsigned int		taps;
+	int			*start;
+	/* taps weights per output sample, Q14, summing to 1 << 14 */
+	int16_t			*w;
+};
+
+struct scaler_plane {
+	unsigned int		cpp;
+	unsigned int		src_w;
+	unsigned int		src_h;
+	unsigned int		dst_w;
+	unsigned int		dst_h;
+	struct scaler_axis	x;
+	struct scaler_axis	y;
+	/* per band: y.taps filtered rows and the source row each holds */
+	int16_t			*cache[SCALER_MAX_BANDS];
+	int			*cached[SCALER_MAX_BANDS];
+};
+
+struct scaler {
+	const struct scaler_kernel *kernel;
+	unsigned int		filter;
+	unsigned int		nplanes;
+	struct scaler_plane	planes[SCALER_MAX_PLANES];
+	struct copy_pool	*pool;
+	unsigned int		bands;
+
+	/* the frame being scaled */
+	const uint8_t		*src[SCALER_MAX_PLANES];
+	unsigned int		src_stride[SCALER_MAX_PLANES];
+	uint8_t			*dst[SCALER_MAX_PLANES];
+	unsigned int		dst_stride[SCALER_MAX_PLANES];
+};
+
+static inline uint8_t scaler_clamp(int32_t x)
+{
+	x = (x + (1 << (SCALER_VSHIFT - 1))) >> SCALER_VSHIFT;
+
+	return x > 255 ? 255 : x;
+}
+
+static void scaler_vert_c(uint8_t *dst, const int16_t *const *rows,
+				const int16_t *w, unsigned int taps,
+				unsigned int n)
+{
+	unsigned int i, k;
+	int32_t sum;
+
+	for (i = 0; i < n; i++) {
+		sum = 0;
+		for (k = 0; k < taps; k++)
+			sum += rows[k][i] * w[k];
+		dst[i] = scaler_clamp(sum);
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Rows are taken two at a time: interleaving them lets pmaddwd do
+ * r0 * w0 + r1 * w1 per lane. An odd last row is paired with itself at
+ * weight 0. The weight pairs are the same for the whole row, so they
+ * are splatted once up front; with the area filter's many taps, doing
+ * it per block of pixels cost more than the multiplies.
+ */
+static inline uint32_t scaler_wpair(const int16_t *w, unsigned int taps,
+				unsigned int t)
+{
+	return (uint16_t)w[t] |
+		(uint32_t)(uint16_t)(t + 1 < taps ? w[t + 1] : 0) << 16;
+}
+
+__attribute__((target("sse2")))
+static void scaler_vert_sse2(uint8_t *dst, const int16_t *const *rows,
+				const int16_t *w, unsigned int taps,
+				unsigned int n)
+{
+	const __m128i round = _mm_set1_epi32(1 << (SCALER_VSHIFT - 1));
+	__m128i k[SCALER_MAX_TAPS / 2];
+	__m128i a, b, lo, hi;
+	unsigned int i, t;
+
+	for (t = 0; t < taps; t += 2)
+		k[t / 2] = _mm_set1_epi32(scaler_wpair(w, taps, t));
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		lo = round;
+		hi = round;
+		for (t = 0; t < taps; t += 2) {
+			a = _mm_loadu_si128((const __m128i *)(rows[t] + i));
+			b = t + 1 < taps ? _mm_loadu_si128(
+				(const __m128i *)(rows[t + 1] + i)) : a;
+			lo = _mm_add_epi32(lo, _mm_madd_epi16(
+					_mm_unpacklo_epi16(a, b), k[t / 2]));
+			hi = _mm_add_epi32(hi, _mm_madd_epi16(
+					_mm_unpackhi_epi16(a, b), k[t / 2]));
+		}
+		lo = _mm_srai_epi32(lo, SCALER_VSHIFT);
+		hi = _mm_srai_epi32(hi, SCALER_VSHIFT);
+		lo = _mm_packs_epi32(lo, hi);
+		_mm_storel_epi64((__m128i *)(dst + i),
+				_mm_packus_epi16(lo, lo));
+	}
+
+	if (i < n) {
+		const int16_t *tail[SCALER_MAX_TAPS];
+
+		for (t = 0; t < taps; t++)
+			tail[t] = rows[t] + i;
+		scaler_vert_c(dst + i, tail, w, taps, n - i);
+	}
+}
+
+__attribute__((target("avx2")))
+static void scaler_vert_avx2(uint8_t *dst, const int16_t *const *rows,
+				const int16_t *w, unsigned int taps,
+				unsigned int n)
+{
+	const __m256i round = _mm256_set1_epi32(1 << (SCALER_VSHIFT - 1));
+	__m256i k[SCALER_MAX_TAPS / 2];
+	__m256i a, b, lo, hi;
+	unsigned int i, t;
+
+	for (t = 0; t < taps; t += 2)
+		k[t / 2] = _mm256_set1_epi32(scaler_wpair(w, taps, t));
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		lo = round;
+		hi = round;
+		for (t = 0; t < taps; t += 2) {
+			a = _mm256_loadu_si256((const __m256i *)(rows[t] + i));
+			b = t + 1 < taps ? _mm256_loadu_si256(
+				(const __m256i *)(rows[t + 1] + i)) : a;
+			lo = _mm256_add_epi32(lo, _mm256_madd_epi16(
+					_mm256_unpacklo_epi16(a, b), k[t / 2]));
+			hi = _mm256_add_epi32(hi, _mm256_madd_epi16(
+					_mm256_unpackhi_epi16(a, b), k[t / 2]));
+		}
+		/* the in-lane unpacks are undone by the in-lane packs */
+		lo = _mm256_srai_epi32(lo, SCALER_VSHIFT);
+		hi = _mm256_srai_epi32(hi, SCALER_VSHIFT);
+		lo = _mm256_packs_epi32(lo, hi);
+		lo = _mm256_packus_epi16(lo, lo);
+		lo = _mm256_permute4x64_epi64(lo, 0x08);
+		_mm_storeu_si128((__m128i *)(dst + i),
+				_mm256_castsi256_si128(lo));
+	}
+
+	if (i < n) {
+		const int16_t *tail[SCALER_MAX_TAPS];
+
+		for (t = 0; t < taps; t++)
+			tail[t] = rows[t] + i;
+		scaler_vert_c(dst + i, tail, w, taps, n - i);
+	}
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+static void scaler_vert_neon(uint8_t *dst, const int16_t *const *rows,
+				const int16_t *w, unsigned int taps,
+				unsigned int n)
+{
+	int32x4_t lo, hi;
+	int16x8_t a;
+	unsigned int i, t;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		lo = vdupq_n_s32(1 << (SCALER_VSHIFT - 1));
+		hi = lo;
+		for (t = 0; t < taps; t++) {
+			a = vld1q_s16(rows[t] + i);
+			lo = vmlal_n_s16(lo, vget_low_s16(a), w[t]);
+			hi = vmlal_n_s16(hi, vget_high_s16(a), w[t]);
+		}
+		a = vcombine_s16(vqmovn_s32(vshrq_n_s32(lo, SCALER_VSHIFT)),
+				vqmovn_s32(vshrq_n_s32(hi, SCALER_VSHIFT)));
+		vst1_u8(dst + i, vqmovun_s16(a));
+	}
+
+	if (i < n) {
+		const int16_t *tail[SCALER_MAX_TAPS];
+
+		for (t = 0; t < taps; t++)
+			tail[t] = rows[t] + i;
+		scaler_vert_c(dst + i, tail, w, taps, n - i);
+	}
+}
+#endif
+
+/* best first */
+static const struct scaler_kernel scaler_kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+	{ "avx2", scaler_vert_avx2, copy_has_avx2 },
+	{ "sse2", scaler_vert_sse2, copy_has_sse2 },
+#endif
+#if defined(__ARM_NEON) || defined(__aarch64__)
+	{ "neon", scaler_vert_neon, copy_has_neon },
+#endif
+	{ "c", scaler_vert_c, copy_always },
+};
+
+#define NR_SCALER_KERNELS	(sizeof(scaler_kernels) / sizeof(scaler_kernels[0]))
+
+static inline unsigned int scaler_taps(unsigned int filter, unsigned int src,
+				unsigned int dst)
+{
+	unsigned int taps = 2;
+
+	if (filter == SCALER_AREA && src > dst)
+		taps = (src + dst - 1) / dst + 1;
+	if (taps > SCALER_MAX_TAPS)
+		taps = SCALER_MAX_TAPS;
+
+	return taps < src ? taps : src;
+}
+
+/*
+ * Weights of output sample o as doubles over source samples first...,
+ * folded into a window of taps samples that stays inside the source.
+ */
+static inline void scaler_axis_sample(struct scaler_axis *ax,
+				unsigned int filter, unsigned int src,
+				unsigned int dst, unsigned int o)
+{
+	double r = (double)src / dst;
+	double acc[SCALER_MAX_TAPS] = { 0 };
+	double x0, x1, f, ov;
+	int first, i, s, idx, sum, big;
+	unsigned int k;
+
+	if (filter == SCALER_AREA) {
+		x0 = o * r;
+		x1 = x0 + r;
+		first = (int)x0;
+	} else {
+		x0 = (o + 0.5) * r - 0.5;
+		first = x0 < 0 ? -1 : (int)x0;
+		x1 = 0;
+	}
+
+	s = first < 0 ? 0 : first;
+	if (s > (int)(src - ax->taps))
+		s = src - ax->taps;
+	ax->start[o] = s;
+
+	if (filter == SCALER_AREA) {
+		for (i = first; i < x1; i++) {
+			ov = (x1 < i + 1 ? x1 : i + 1) - (x0 > i ? x0 : i);
+			idx = (i < (int)src ? i : (int)src - 1) - s;
+			idx = idx < 0 ? 0 : idx >= (int)ax->taps ?
+						(int)ax->taps - 1 : idx;
+			acc[idx] += ov / r;
+		}
+	} else {
+		f = x0 - first;
+		for (k = 0; k < 2; k++) {
+			i = first + k;
+			i = i < 0 ? 0 : i >= (int)src ? (int)src - 1 : i;
+			idx = i - s;
+			idx = idx < 0 ? 0 : idx >= (int)ax->taps ?
+						(int)ax->taps - 1 : idx;
+			acc[idx] += k ? f : 1 - f;
+		}
+	}
+
+	/* quantize, then give the rounding error to the largest tap */
+	sum = 0;
+	big = 0;
+	for (k = 0; k < ax->taps; k++) {
+		ax->w[o * ax->taps + k] = (int16_t)(acc[k] *
+					(1 << SCALER_WBITS) + 0.5);
+		sum += ax->w[o * ax->taps + k];
+		if (acc[k] > acc[big])
+			big = k;
+	}
+	ax->w[o * ax->taps + big] += (1 << SCALER_WBITS) - sum;
+}
+
+static inline int scaler_axis_init(struct scaler_axis *ax, unsigned int filter,
+				unsigned int src, unsigned int dst)
+{
+	unsigned int o;
+
+	ax->taps = scaler_taps(filter, src, dst);
+	ax->start = malloc(dst * sizeof(*ax->start));
+	ax->w = malloc(dst * ax->taps * sizeof(*ax->w));
+	if (!ax->start || !ax->w)
+		return -1;
+
+	for (o = 0; o < dst; o++)
+		scaler_axis_sample(ax, filter, src, dst, o);
+
+	return 0;
+}
+
+/*
+ * One source row to Q7, cpp interleaved components per pixel. cpp is a
+ * constant in every caller, so each pixel size gets its own loop.
+ */
+static inline __attribute__((always_inline))
+void scaler_horiz_cpp(const struct scaler_plane *p, int16_t *out,
+				const uint8_t *src, const unsigned int cpp)
+{
+	const struct scaler_axis *ax = &p->x;
+	const uint8_t *s;
+	const int16_t *w;
+	unsigned int o, c, k;
+	int32_t sum;
+
+	if (ax->taps == 2) {
+		for (o = 0; o < p->dst_w; o++) {
+			s = src + ax->start[o] * cpp;
+			w = ax->w + o * 2;
+			for (c = 0; c < cpp; c++)
+				*out++ = (s[c] * w[0] + s[c + cpp] * w[1] +
+					(1 << (SCALER_WBITS - SCALER_HBITS - 1)))
+					>> (SCALER_WBITS - SCALER_HBITS);
+		}
+		return;
+	}
+
+	for (o = 0; o < p->dst_w; o++) {
+		s = src + ax->start[o] * cpp;
+		w = ax->w + o * ax->taps;
+		for (c = 0; c < cpp; c++) {
+			sum = 1 << (SCALER_WBITS - SCALER_HBITS - 1);
+			for (k = 0; k < ax->taps; k++)
+				sum += s[k * cpp + c] * w[k];
+			*out++ = sum >> (SCALER_WBITS - SCALER_HBITS);
+		}
+	}
+}
+
+static inline void scaler_horiz(const struct scaler_plane *p, int16_t *out,
+				const uint8_t *src)
+{
+	switch (p->cpp) {
+	case 1:
+		scaler_horiz_cpp(p, out, src, 1);
+		break;
+	case 2:
+		scaler_horiz_cpp(p, out, src, 2);
+		break;
+	case 3:
+		scaler_horiz_cpp(p, out, src, 3);
+		break;
+	default:
+		scaler_horiz_cpp(p, out, src, 4);
+		break;
+	}
+}
+
+static inline void scaler_plane_rows(struct scaler *sc, unsigned int pi,
+				unsigned int band, unsigned int y0,
+				unsigned int y1)
+{
+	struct scaler_plane *p = &sc->planes[pi];
+	const int16_t *rows[SCALER_MAX_TAPS];
+	unsigned int n = p->dst_w * p->cpp;
+	unsigned int y, k, slot;
+	int sy;
+
+	for (y = y0; y < y1; y++) {
+		for (k = 0; k < p->y.taps; k++) {
+			sy = p->y.start[y] + k;
+			slot = sy % p->y.taps;
+			if (p->cached[band][slot] != sy) {
+				scaler_horiz(p, p->cache[band] + slot * n,
+					sc->src[pi] + (size_t)sy *
+					sc->src_stride[pi]);
+				p->cached[band][slot] = sy;
+			}
+			rows[k] = p->cache[band] + slot * n;
+		}
+		sc->kernel->vert(sc->dst[pi] + (size_t)y * sc->dst_stride[pi],
+				rows, p->y.w + y * p->y.taps, p->y.taps, n);
+	}
+}
+
+static inline void scaler_band(void *arg, unsigned int part,
+				unsigned int parts)
+{
+	struct scaler *sc = arg;
+	struct scaler_plane *p;
+	unsigned int i, k;
+
+	for (i = 0; i < sc->nplanes; i++) {
+		p = &sc->planes[i];
+		for (k = 0; k < p->y.taps; k++)
+			p->cached[part][k] = -1;
+		scaler_plane_rows(sc, i, part, p->dst_h * part / parts,
+					p->dst_h * (part + 1) / parts);
+	}
+}
+
+/* bytes per pixel of the first plane and how many planes there are */
+static inline int scaler_layout(uint32_t fourcc, unsigned int *cpp,
+				unsigned int *nplanes)
+{
+	*nplanes = 1;
+	switch (fourcc) {
+	case V4L2_PIX_FMT_GREY:
+		*cpp = 1;
+		return 0;
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_NV21:
+		*cpp = 1;
+		*nplanes = 2;
+		return 0;
+	case V4L2_PIX_FMT_YUV420:
+		*cpp = 1;
+		*nplanes = 3;
+		return 0;
+	case V4L2_PIX_FMT_BGR24:
+	case V4L2_PIX_FMT_RGB24:
+		*cpp = 3;
+		return 0;
+	case V4L2_PIX_FMT_RGB32:
+	case V4L2_PIX_FMT_BGR32:
+	case V4L2_PIX_FMT_XBGR32:
+	case V4L2_PIX_FMT_XRGB32:
+		*cpp = 4;
+		return 0;
+	default:
+		/* YUYV and RGB565 don't separate into bytes: convert first */
+		return -1;
+	}
+}
+
+static inline void scaler_exit(struct scaler *sc)
+{
+	struct scaler_plane *p;
+	unsigned int i, b;
+
+	for (i = 0; i < sc->nplanes; i++) {
+		p = &sc->planes[i];
+		free(p->x.start);
+		free(p->x.w);
+		free(p->y.start);
+		free(p->y.w);
+		for (b = 0; b < SCALER_MAX_BANDS; b++) {
+			free(p->cache[b]);
+			free(p->cached[b]);
+		}
+	}
+	memset(sc, 0, sizeof(*sc));
+}
+
+/*
+ * pool may be NULL to scale on the calling thread only, kernel NULL to
+ * pick the best vertical pass for this CPU.
+ */
+static inline int scaler_init(struct scaler *sc, uint32_t fourcc,
+				unsigned int src_w, unsigned int src_h,
+				unsigned int dst_w, unsigned int dst_h,
+				unsigned int filter, const char *kernel,
+				struct copy_pool *pool)
+{
+	struct scaler_plane *p;
+	unsigned int cpp, i, b;
+	size_t n;
+
+	memset(sc, 0, sizeof(*sc));
+	if (!src_w || !src_h || !dst_w || !dst_h ||
+			scaler_layout(fourcc, &cpp, &sc->nplanes) < 0)
+		return -1;
+
+	sc->filter = filter;
+	sc->pool = pool;
+	sc->bands = pool ? pool->nr_workers + 1 : 1;
+	for (i = 0; i < sc->nplanes; i++) {
+		p = &sc->planes[i];
+		p->cpp = i == 1 && sc->nplanes == 2 ? 2 : cpp;
+		p->src_w = i ? (src_w + 1) / 2 : src_w;
+		p->src_h = i ? (src_h + 1) / 2 : src_h;
+		p->dst_w = i ? (dst_w + 1) / 2 : dst_w;
+		p->dst_h = i ? (dst_h + 1) / 2 : dst_h;
+		if (scaler_axis_init(&p->x, filter, p->src_w, p->dst_w) < 0 ||
+				scaler_axis_init(&p->y, filter, p->src_h,
+						p->dst_h) < 0)
+			goto err;
+
+		n = (size_t)p->dst_w * p->cpp;
+		for (b = 0; b < sc->bands; b++) {
+			p->cache[b] = malloc(n * p->y.taps * sizeof(int16_t));
+			p->cached[b] = malloc(p->y.taps * sizeof(int));
+			if (!p->cache[b] || !p->cached[b])
+				goto err;
+		}
+	}
+
+	for (i = 0; kernel && i < NR_SCALER_KERNELS; i++)
+		if (!strcmp(scaler_kernels[i].name, kernel) &&
+				scaler_kernels[i].supported())
+			break;
+	if (!kernel || i == NR_SCALER_KERNELS)
+		for (i = 0; i < NR_SCALER_KERNELS; i++)
+			if (scaler_kernels[i].supported())
+				break;
+	sc->kernel = &scaler_kernels[i];
+
+	return 0;
+err:
+	scaler_exit(sc);
+	return -1;
+}
+
+/* plane[] and stride[] as laid out by capture_fill_planes() */
+static inline void scaler_run(struct scaler *sc,
+				const uint8_t *const src[3],
+				const unsigned int src_stride[3],
+				uint8_t *const dst[3],
+				const unsigned int dst_stride[3])
+{
+	unsigned int i;
+
+	for (i = 0; i < sc->nplanes; i++) {
+		sc->src[i] = src[i];
+		sc->src_stride[i] = src_stride[i];
+		sc->dst[i] = dst[i];
+		sc->dst_stride[i] = dst_stride[i];
+	}
+	copy_pool_bands(sc->bands > 1 ? sc->pool : NULL, scaler_band, sc);
+}
+
+#endif
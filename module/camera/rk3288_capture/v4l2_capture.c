@@ -29,14 +29,28 @@
 #include <string.h>
 #include <malloc.h>
 #include "v4l2_capture.h"
+#include "capture_export.h"
+#include "capture_loop.h"
+#include "capture_roi.h"
+#include "capture_stats.h"
+#include "capture_pool.h"
+#include "capture_publish.h"
+#include "copy_kernel.h"
+#include "copy_pool.h"
 
 #define TEST_BUFFER_NUM 3
 
-#define BIT(nr)		(1UL << (nr))
+/* export mode: how often released leases are looked for */
+#define CAPTURE_RECLAIM_US	5000
+#define CAPTURE_HOUSEKEEPING_US	1000000
+
 #define find_first_zero_bit(x) find_first_bit(~(x))
 
 struct capture_config {
 	char			device[50];
+	/* names the shared frame pool and the export socket */
+	char			name[16];
+	unsigned int		pool_flags;
 	int			shb_cnt;
 	unsigned int		crop_width;
 	unsigned int		crop_height;
@@ -46,37 +60,113 @@ struct capture_config {
 	unsigned int		cap_height;
 	unsigned int		cap_fmt;
 	int			cap_buf_cnt;
+	/* hand out the V4L2 buffers as fds instead of copying into shm */
+	bool			export;
+	/* copy kernel name, NULL picks the best one for this CPU */
+	const char		*copy_kernel;
+	/* threads sharing the publish copy of large frames */
+	unsigned int		copy_threads;
+	/* per stage histograms in the <name>-stats pool */
+	bool			stats;
 };
 
 struct capture_buf {
 	unsigned char		*start;
 	size_t			offset;
 	unsigned int		length;
+	/* dmabuf or memfd, CAPTURE_F_EXPORT only */
+	int			fd;
 };
 
 struct capture_device {
 	struct capture_buf	*cap_bufs;
 	struct capture_config	*config;
 	struct capture_data	*shm;
-	char			*shb;
-	int			shm_id;
+	struct capture_pool	pool;
+	struct capture_stats	*stats;
+	struct capture_pool	stats_pool;
+	const struct copy_kernel *copy;
+	struct copy_pool	copy_pool;
+	struct capture_layout	layout;
+	struct capture_demand	demand;
+	unsigned int		memory;
+	int			fd_v4l;
+	unsigned int		queued;
+	/* CAPTURE_F_EXPORT */
+	int			listen_fd;
+	int			latest;
+
+	pthread_t		tid;
+	int			cpu;
+	int			ret;
+	/* DEV_REQ_*, posted by the main thread through req_fd */
+	unsigned int		requests;
+	int			req_fd;
+	/* written once when the device thread is done */
+	int			done_fd;
+
+	struct capture_loop	loop;
+	struct loop_source	video;
+	struct loop_source	request;
+	struct loop_source	housekeeping;
+	struct loop_source	reclaim;
+	struct loop_source	listen;
+	uint64_t		frames;
+	/* frames published as ROIs only */
+	uint64_t		partial;
+	unsigned int		max_batch;
 };
 
+#define DEV_REQ_STOP		BIT(0)
+#define DEV_REQ_STATS		BIT(1)
+
+/*
+ * In export mode the newest buffer stays leased by the producer and every
+ * buffer a reader holds is out of the driver's queue too, so two buffers
+ * would leave the driver one at best and none while a reader holds a
+ * frame. Keep two queued on top of the producer's buffer and one per
+ * reader holding a frame at a time (--export=N, 1 by default).
+ */
+static void export_bufs_for(struct capture_config *config, int holders)
+{
+	int n = 2 + 1 + (holders > 0 ? holders : 1);
+
+	config->export = true;
+	if (n > CAPTURE_MAX_BUFS)
+		n = CAPTURE_MAX_BUFS;
+	if (config->cap_buf_cnt < n)
+		config->cap_buf_cnt = n;
+}
+
 static struct capture_config configs[] = {
 	{
 		.device = "/dev/video0",
+		.name = CAPTURE_DEFAULT_STREAM,
+		.pool_flags = POOL_F_POPULATE,
 		.shb_cnt = 2,
-		.crop_width = 1024,
-		.crop_height = 720,
-		.crop_top = 0,
-		.crop_left = 0,
 		.cap_width = 640,
 		.cap_height = 480,
 		.cap_fmt = V4L2_PIX_FMT_NV12,
 		.cap_buf_cnt = 2,
+		.export = false,
+		.copy_threads = 1,
+	},
+	{
+		.device = "/dev/video1",
+		.name = "cam1",
+		.pool_flags = POOL_F_POPULATE,
+		.shb_cnt = 2,
+		.cap_width = 640,
+		.cap_height = 480,
+		.cap_fmt = V4L2_PIX_FMT_NV12,
+		.cap_buf_cnt = 2,
+		.export = false,
+		.copy_threads = 1,
 	},
 };
 
+#define NR_CONFIGS	(sizeof(configs) / sizeof(configs[0]))
+
 /*
  * int g_rotate = 0;
  * int g_usb_camera = 0;
@@ -91,6 +181,120 @@ static void print_pixelformat(char *prefix, int val)
 					(val >> 24) & 0xff);
 }
 
+static int queue_buffer(int fd_v4l, struct capture_device *dev,
+				unsigned int index)
+{
+	struct v4l2_buffer buf;
+	int ret;
+
+	memset(&buf, 0, sizeof (buf));
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = dev->memory;
+	buf.index = index;
+	if (dev->memory == V4L2_MEMORY_USERPTR) {
+		buf.m.userptr = (unsigned long)dev->cap_bufs[index].start;
+		buf.length = dev->cap_bufs[index].length;
+	} else {
+		buf.m.offset = dev->cap_bufs[index].offset;
+	}
+
+	ret = ioctl(fd_v4l, VIDIOC_QBUF, &buf);
+	if (ret < 0)
+		perror("VIDIOC_QBUF err");
+	else
+		dev->queued |= BIT(index);
+
+	return ret;
+}
+
+/*
+ * The driver can't export its buffers, so let it capture straight into
+ * memfd backed user pointers, which can be passed on just the same.
+ */
+static int setup_memfd_bufs(int fd_v4l, struct capture_device *dev)
+{
+	struct v4l2_requestbuffers req;
+	struct capture_buf *cb;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < dev->config->cap_buf_cnt; i++) {
+		munmap(dev->cap_bufs[i].start, dev->cap_bufs[i].length);
+		dev->cap_bufs[i].start = NULL;
+	}
+
+	memset(&req, 0, sizeof (req));
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_MMAP;
+	req.count = 0;
+	ioctl(fd_v4l, VIDIOC_REQBUFS, &req);
+
+	req.memory = V4L2_MEMORY_USERPTR;
+	req.count = dev->config->cap_buf_cnt;
+	ret = ioctl(fd_v4l, VIDIOC_REQBUFS, &req);
+	if (ret < 0) {
+		perror("VIDIOC_REQBUFS userptr error");
+		return ret;
+	}
+	dev->memory = V4L2_MEMORY_USERPTR;
+
+	for (i = 0; i < dev->config->cap_buf_cnt; i++) {
+		cb = &dev->cap_bufs[i];
+		cb->length = ALIGN(cb->length, getpagesize());
+		cb->fd = memfd_alloc(cb->length, (void **)&cb->start);
+		if (cb->fd < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int export_bufs(int fd_v4l, struct capture_device *dev)
+{
+	struct v4l2_exportbuffer expbuf;
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < dev->config->cap_buf_cnt; i++) {
+		memset(&expbuf, 0, sizeof (expbuf));
+		expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		expbuf.index = i;
+		expbuf.flags = O_RDONLY | O_CLOEXEC;
+		ret = ioctl(fd_v4l, VIDIOC_EXPBUF, &expbuf);
+		if (ret < 0)
+			break;
+		dev->cap_bufs[i].fd = expbuf.fd;
+	}
+	if (ret == 0)
+		return 0;
+
+	printf("VIDIOC_EXPBUF failed (%s), using memfd buffers.\n",
+					strerror(errno));
+	while (i--) {
+		close(dev->cap_bufs[i].fd);
+		dev->cap_bufs[i].fd = -1;
+	}
+
+	return setup_memfd_bufs(fd_v4l, dev);
+}
+
+/* unmap the capture buffers and close what was exported of them */
+static void release_bufs(struct capture_device *dev)
+{
+	struct capture_buf *cb;
+	unsigned int i;
+
+	for (i = 0; i < dev->config->cap_buf_cnt; i++) {
+		cb = &dev->cap_bufs[i];
+		if (cb->start && cb->start != MAP_FAILED)
+			munmap(cb->start, cb->length);
+		if (cb->fd >= 0)
+			close(cb->fd);
+		cb->start = NULL;
+		cb->fd = -1;
+	}
+}
+
 static int start_streaming(int fd_v4l, struct capture_device *dev)
 {
         struct v4l2_buffer buf;
@@ -124,19 +328,19 @@ static int start_streaming(int fd_v4l, struct capture_device *dev)
 		}
 		memset(dev->cap_bufs[i].start, 0xFF, dev->cap_bufs[i].length);
         }
+	dev->memory = V4L2_MEMORY_MMAP;
+
+	if (dev->config->export) {
+		ret = export_bufs(fd_v4l, dev);
+		if (ret < 0)
+			return ret;
+	}
 
+	dev->queued = 0;
         for (i = 0; i < dev->config->cap_buf_cnt; i++) {
-                memset(&buf, 0, sizeof (buf));
-                buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                buf.memory = V4L2_MEMORY_MMAP;
-                buf.index = i;
-		buf.m.offset = dev->cap_bufs[i].offset;
-	
-		ret = ioctl(fd_v4l, VIDIOC_QBUF, &buf);
-                if (ret < 0) {
-			perror("VIDIOC_QBUF err");
+		ret = queue_buffer(fd_v4l, dev, i);
+                if (ret < 0)
                         return ret;
-                }
         }
 
         type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -158,6 +362,46 @@ static int stop_capturing(int fd_v4l)
         return ioctl (fd_v4l, VIDIOC_STREAMOFF, &type);
 }
 
+/* the crop window lies within the sensor and has the capture's aspect */
+static int check_crop(int fd_v4l, const struct capture_config *config)
+{
+	struct v4l2_cropcap cap;
+	const struct v4l2_rect *b = &cap.bounds;
+	uint64_t a, c;
+
+	memset(&cap, 0, sizeof(cap));
+	cap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (ioctl(fd_v4l, VIDIOC_CROPCAP, &cap) < 0) {
+		printf("%s: no VIDIOC_CROPCAP, capturing the full frame\n",
+					config->device);
+		return -1;
+	}
+	if (config->crop_left < b->left || config->crop_top < b->top ||
+			config->crop_left + config->crop_width >
+					b->left + b->width ||
+			config->crop_top + config->crop_height >
+					b->top + b->height) {
+		printf("%s: crop %ux%u+%d+%d outside the sensor's %ux%u+%d+%d, "
+				"capturing the full frame\n", config->device,
+				config->crop_width, config->crop_height,
+				config->crop_left, config->crop_top,
+				b->width, b->height, b->left, b->top);
+		return -1;
+	}
+	/* within 1% */
+	a = (uint64_t)config->crop_width * config->cap_height * 100;
+	c = (uint64_t)config->crop_height * config->cap_width;
+	if (a < c * 99 || a > c * 101) {
+		printf("%s: crop %ux%u doesn't have the aspect of %ux%u, "
+				"capturing the full frame\n", config->device,
+				config->crop_width, config->crop_height,
+				config->cap_width, config->cap_height);
+		return -1;
+	}
+
+	return 0;
+}
+
 static int setup_v4l_capture(const int fd_v4l, struct capture_config *config)
 {
         struct v4l2_format fmt;
@@ -175,24 +419,24 @@ static int setup_v4l_capture(const int fd_v4l, struct capture_config *config)
 		ret = ioctl(fd_v4l, VIDIOC_ENUM_FMT, &ffmt);
 	}
 
-#if 0
-	/* UVC driver does not implement CROP */
-	crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	if (ioctl(fd_v4l, VIDIOC_G_CROP, &crop) < 0) {
-		printf("VIDIOC_G_CROP failed\n");
-		return -1;
-	}
-
-	crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	crop.c.width = g_in_width;
-	crop.c.height = g_in_height;
-	crop.c.top = g_top;
-	crop.c.left = g_left;
-	if (ioctl(fd_v4l, VIDIOC_S_CROP, &crop) < 0) {
-		printf("VIDIOC_S_CROP failed\n");
-		return -1;
+	/*
+	 * Crop at the sensor only when asked to with --crop, so the window
+	 * never crosses the bus. It changes what every reader sees, so it
+	 * has to fit the sensor and keep the aspect of the capture size.
+	 * UVC and some other drivers don't implement CROP, then the whole
+	 * frame is captured and readers take ROIs of it instead.
+	 */
+	if (config->crop_width && config->crop_height &&
+			check_crop(fd_v4l, config) == 0) {
+		crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		crop.c.width = config->crop_width;
+		crop.c.height = config->crop_height;
+		crop.c.top = config->crop_top;
+		crop.c.left = config->crop_left;
+		if (ioctl(fd_v4l, VIDIOC_S_CROP, &crop) < 0)
+			printf("%s: VIDIOC_S_CROP failed, capturing the full "
+					"frame\n", config->device);
 	}
-#endif
 
         fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         fmt.fmt.pix.pixelformat = config->cap_fmt;
@@ -236,127 +480,299 @@ static int setup_v4l_capture(const int fd_v4l, struct capture_config *config)
         return ret;
 }
 
-/* It is for circle buffer */
-static void set_write_index(struct capture_data *shm)
+static void fill_meta(struct capture_meta *meta, struct v4l2_buffer *buf,
+				unsigned int sizeimage)
+{
+	meta->sequence = buf->sequence;
+	meta->bytesused = buf->bytesused && buf->bytesused < sizeimage ?
+					buf->bytesused : sizeimage;
+	meta->timestamp_us = (uint64_t)buf->timestamp.tv_sec * 1000000 +
+					buf->timestamp.tv_usec;
+	meta->flags = 0;
+	meta->roi_gen = 0;
+}
+
+static void put_one_buffer(struct capture_device *dev, 
+					struct v4l2_buffer *buf,
+					struct capture_meta *meta)
 {
-	unsigned int l;
+	if (capture_publish(dev->shm, dev->stats, &dev->copy_pool,
+				&dev->layout, dev->cap_bufs[buf->index].start,
+				meta))
+		dev->partial++;
+}
 
-	sem_lock(shm->sem_id);
-	/* l = shm->mask & (shm->mask + 1 - (shm->in - shm->out)); */
-	l = shm->mask & (shm->in - shm->out);
-	if (l == 0) {
-		shm->in = shm->out + 1;
+static void requeue_bufs(struct capture_device *dev, unsigned int mask)
+{
+	while (mask) {
+		queue_buffer(dev->fd_v4l, dev, __builtin_ctz(mask));
+		mask &= mask - 1;
 	}
-	sem_unlock(shm->sem_id);
 }
 
-static void put_one_buffer(struct capture_device *dev, 
-					struct v4l2_buffer *buf)
+/* vb2 reports EPOLLERR while nothing is queued, so park the fd then */
+static void arm_video(struct capture_device *dev)
 {
-	unsigned int size = dev->shm->sizeimage;
-	unsigned int in;
-	unsigned int or;
-
-	/* set_write_index(dev->shm); */
-	sem_lock(dev->shm->sem_id);
-	or = dev->shm->buf_flag & dev->shm->mask;
-	switch (dev->shm->buf_flag) {
-	case 0x0:
-	case 0x2:
-		in = BIT(0);
-		break;
-	case 0x1:
-		in = BIT(1);
-		break;
-	default:
-		in = dev->shm->last_in;
-		dev->shm->buf_flag &= ~(dev->shm->last_in);
-	}
-	sem_unlock(dev->shm->sem_id);
-	memcpy(dev->shb + size * (in - 1), 
-		(dev->cap_bufs + buf->index)->start, size);
-
-	sem_lock(dev->shm->sem_id);
-	dev->shm->buf_flag |= in;
-	dev->shm->last_in = in;
-	sem_unlock(dev->shm->sem_id);
-	/* printf("flag: %u\n", dev->shm->buf_flag); */
+	loop_arm(&dev->loop, &dev->video, dev->queued != 0);
 }
 
-static void do_handle_cap(int fd_v4l, struct capture_device *dev)
+/*
+ * Dequeue everything the driver has finished, then give the buffers
+ * back in one go. In copy mode each frame is published as it comes
+ * out; in export mode the buffer itself is published and only goes
+ * back once the last lease on it is dropped. A frame no reader is
+ * going to take goes back right away, uncopied.
+ */
+static void on_video(struct loop_source *src, uint32_t events)
 {
+	struct capture_device *dev = src->data;
 	struct v4l2_buffer buf;
-	int ret;
+	struct capture_meta meta;
+	unsigned int done = 0;
+	unsigned int batch = 0;
+	uint64_t t;
 
 	for (;;) {
+		memset(&buf, 0, sizeof (buf));
 		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		buf.memory = V4L2_MEMORY_MMAP;
-		ret = ioctl(fd_v4l, VIDIOC_DQBUF, &buf);
-		if (ret < 0) {
+		buf.memory = dev->memory;
+		t = stat_begin(dev->stats);
+		if (ioctl(dev->fd_v4l, VIDIOC_DQBUF, &buf) < 0) {
+			if (errno == EAGAIN)
+				break;
 			perror("VIDIOC_DQBUF error");
-			break;
+			dev->loop.stop = 1;
+			return;
+		}
+		stat_end(dev->stats, STAT_DQBUF, t);
+		dev->queued &= ~BIT(buf.index);
+		batch++;
+
+		fill_meta(&meta, &buf, dev->shm->sizeimage);
+		if (!capture_publish_want(dev->shm, &dev->demand, &meta)) {
+			/* nobody takes it, straight back to the driver */
+			done |= BIT(buf.index);
+			continue;
+		}
+
+		if (dev->config->export) {
+			t = stat_begin(dev->stats);
+			export_buf_done(dev->shm, buf.index);
+			export_publish(dev->shm, buf.index, &meta,
+						&dev->latest);
+			stat_end(dev->stats, STAT_PUBLISH, t);
+		} else {
+			put_one_buffer(dev, &buf, &meta);
+			done |= BIT(buf.index);
 		}
-		put_one_buffer(dev, &buf);
-		ioctl(fd_v4l, VIDIOC_QBUF, &buf);
-                memset(&buf, 0, sizeof (buf));
 	}
+
+	if (dev->config->export)
+		done |= export_reclaim(dev->shm);
+	t = stat_begin(dev->stats);
+	requeue_bufs(dev, done);
+	if (done)
+		stat_end(dev->stats, STAT_REQUEUE, t);
+	arm_video(dev);
+
+	dev->frames += batch;
+	if (batch > dev->max_batch)
+		dev->max_batch = batch;
+}
+
+/* readers drop their leases without telling us, pick them up here */
+static void on_reclaim(struct loop_source *src, uint32_t events)
+{
+	struct capture_device *dev = src->data;
+
+	loop_timer_ack(src);
+	requeue_bufs(dev, export_reclaim(dev->shm));
+	arm_video(dev);
 }
 
-static void free_shm_and_sem(struct capture_device *dev)
+static void on_housekeeping(struct loop_source *src, uint32_t events)
 {
-	free_sem(dev->shm->sem_id);
-	free_shm(dev->shm_id);
+	struct capture_device *dev = src->data;
+
+	loop_timer_ack(src);
+	capture_reap_readers(dev->shm);
+	if (dev->config->export) {
+		requeue_bufs(dev, export_reclaim(dev->shm));
+		arm_video(dev);
+	}
+}
+
+static void on_export_client(struct loop_source *src, uint32_t events)
+{
+	struct capture_device *dev = src->data;
+	int fds[CAPTURE_MAX_BUFS];
+	unsigned int i;
+
+	for (i = 0; i < dev->config->cap_buf_cnt; i++)
+		fds[i] = dev->cap_bufs[i].fd;
+	while (export_serve(src->fd, fds, dev->config->cap_buf_cnt,
+				dev->shm->sizeimage) > 0)
+		;
+}
+
+static void print_stats(struct capture_device *dev)
+{
+	struct capture_reader *r;
+	unsigned int i;
+
+	printf("%s: frames %llu roi only %llu skipped %u max batch %u "
+			"stalls %u\n", dev->config->name,
+			(unsigned long long)dev->frames,
+			(unsigned long long)dev->partial,
+			READ_ONCE(dev->shm->skipped), dev->max_batch,
+			READ_ONCE(dev->shm->stalls));
+	for (i = 0; i < CAPTURE_MAX_READERS; i++) {
+		r = &dev->shm->readers[i];
+		if (READ_ONCE(r->state) != READER_ACTIVE)
+			continue;
+		printf("\treader %u pid %d: frames %u drops %u lost %u "
+			"latency %uus max %uus\n", i, r->pid, r->frames,
+			r->drops, r->lost, r->latency_us, r->max_latency_us);
+	}
+}
+
+static void on_request(struct loop_source *src, uint32_t events)
+{
+	struct capture_device *dev = src->data;
+	unsigned int req;
+	uint64_t cnt;
+
+	read(src->fd, &cnt, sizeof(cnt));
+	req = __atomic_exchange_n(&dev->requests, 0, __ATOMIC_ACQUIRE);
+	if (req & DEV_REQ_STATS)
+		print_stats(dev);
+	if (req & DEV_REQ_STOP)
+		dev->loop.stop = 1;
+}
+
+static int setup_loop(struct capture_device *dev)
+{
+	char path[108];
+
+	if (capture_loop_init(&dev->loop) < 0)
+		return -1;
+
+	loop_source_init(&dev->video, dev->fd_v4l, EPOLLIN, on_video, dev);
+	dev->video.urgent = true;
+	arm_video(dev);
+
+	loop_source_init(&dev->request, dev->req_fd, EPOLLIN, on_request, dev);
+	if (loop_add(&dev->loop, &dev->request) < 0)
+		goto err;
+
+	if (loop_add_timer(&dev->loop, &dev->housekeeping,
+				CAPTURE_HOUSEKEEPING_US, on_housekeeping, dev) < 0)
+		goto err;
+
+	if (!dev->config->export)
+		return 0;
+
+	if (loop_add_timer(&dev->loop, &dev->reclaim, CAPTURE_RECLAIM_US,
+				on_reclaim, dev) < 0)
+		goto err;
+
+	export_sock_path(path, sizeof(path), dev->config->name);
+	dev->latest = -1;
+	dev->listen_fd = export_listen(path);
+	if (dev->listen_fd < 0)
+		goto err;
+	loop_source_init(&dev->listen, dev->listen_fd, EPOLLIN,
+				on_export_client, dev);
+	if (loop_add(&dev->loop, &dev->listen) < 0) {
+		close(dev->listen_fd);
+		unlink(path);
+		goto err;
+	}
+
+	return 0;
+err:
+	capture_loop_exit(&dev->loop);
+	return -1;
+}
+
+static void teardown_loop(struct capture_device *dev)
+{
+	char path[108];
+
+	if (dev->config->export) {
+		export_sock_path(path, sizeof(path), dev->config->name);
+		loop_close(&dev->loop, &dev->listen);
+		unlink(path);
+		loop_close(&dev->loop, &dev->reclaim);
+	}
+	loop_close(&dev->loop, &dev->housekeeping);
+	loop_del(&dev->loop, &dev->request);
+	loop_del(&dev->loop, &dev->video);
+	capture_loop_exit(&dev->loop);
+}
+
+static void free_capture_shm(struct capture_device *dev)
+{
+	if (dev->stats)
+		capture_pool_destroy(&dev->stats_pool);
+	capture_pool_destroy(&dev->pool);
 }
 
 static int init_shm_with_fmt(struct capture_device *dev, 
 			struct v4l2_format *fmt)
 {
-	int ret;
+	unsigned int cnt = dev->config->shb_cnt;
 	size_t size;
 
-	size = sizeof(struct capture_data) + 
-			fmt->fmt.pix.sizeimage * dev->config->shb_cnt;
-	dev->shm = (struct capture_data *)alloc_shm(&dev->shm_id, 
-			MODULE_SHM_ID, size, 0666 | IPC_CREAT);
-	if ((void *)dev->shm == (void *)-1) {
+	if (cnt == 0 || (cnt & (cnt - 1))) {
+		printf("shb_cnt %u is not the power of 2.\n", cnt);
+		return -1;
+	}
+
+	if (dev->config->cap_buf_cnt > CAPTURE_MAX_BUFS) {
+		printf("cap_buf_cnt is limited to %d.\n", CAPTURE_MAX_BUFS);
+		return -1;
+	}
+
+	size = capture_data_size(cnt);
+	if (!dev->config->export)
+		size += capture_slot_size(fmt->fmt.pix.sizeimage) * cnt;
+	dev->shm = capture_pool_create(&dev->pool, dev->config->name, size,
+					dev->config->pool_flags);
+	if (!dev->shm) {
 		printf("Failed to init shm.\n");
 		return -1;
 	}
-	dev->shb = ((char *)dev->shm) + sizeof(struct capture_data);
 	dev->shm->width = fmt->fmt.pix.width;
 	dev->shm->height = fmt->fmt.pix.height;
 	dev->shm->fmt = fmt->fmt.pix.pixelformat;
-	dev->shm->sizeimage = fmt->fmt.pix.sizeimage;
-
-	dev->shm->in = 0;
-	dev->shm->out = 0;
-	dev->shm->buf_flag = 0x0;
-	dev->shm->buf_cnt = dev->config->shb_cnt;
-	/* if circle, size must be the power of 2 */
-	dev->shm->mask = (1 << dev->config->shb_cnt) - 1;
-
-	dev->shm->sem_id = get_and_init_sem(KEY_PATH, MODULE_SEM_ID);
-	if (dev->shm->sem_id < 0) {
-		printf("Failed to init sem.\n");
-		ret = -1;
-		goto err_sem;
+	dev->shm->bytesperline = fmt->fmt.pix.bytesperline;
+	ring_init(dev->shm, cnt, fmt->fmt.pix.sizeimage);
+	memset(&dev->demand, 0, sizeof(dev->demand));
+	capture_layout(&dev->layout, dev->shm->fmt, dev->shm->width,
+			dev->shm->height, dev->shm->bytesperline,
+			fmt->fmt.pix.sizeimage);
+	if (dev->config->stats) {
+		dev->stats = capture_stats_create(&dev->stats_pool,
+						dev->config->name);
+		if (!dev->stats)
+			printf("%s: running without stats.\n",
+						dev->config->name);
+	} else {
+		capture_stats_remove(dev->config->name);
+	}
+	if (dev->config->export) {
+		dev->shm->flags |= CAPTURE_F_EXPORT;
+		dev->shm->export_cnt = dev->config->cap_buf_cnt;
 	}
 	 
 	return 0;
-
-err_shb:
-	free_sem(dev->shm->sem_id);
-err_sem:
-	shmctl(dev->shm_id, IPC_RMID, 0);
-
-	return ret;
 }
 
 static int start_capturing(const int fd_v4l, struct capture_device *dev)
 {
         struct v4l2_format fmt;
 	int ret = 0;
-	int fd_flags = fcntl(fd_v4l, F_GETFL);
 
         fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	ret = ioctl(fd_v4l, VIDIOC_G_FMT, &fmt);
@@ -382,77 +798,244 @@ static int start_capturing(const int fd_v4l, struct capture_device *dev)
 		goto err_streaming;
         }
 
-	fcntl(fd_v4l, F_SETFL, fd_flags);
-        for (;;) {
-		fd_set fds;
-
-		FD_ZERO(&fds);
-		FD_SET(fd_v4l, &fds);
-
-		ret = select(fd_v4l + 1, &fds, NULL, NULL, NULL);
-		if (ret == -1 || ret == 0) {
-			perror("select error");
-			sleep(1);
-			continue;
-		}
+	ret = setup_loop(dev);
+	if (ret < 0)
+		goto err_streaming;
 
-		ret = FD_ISSET(fd_v4l, &fds);
-		if (ret)
-			do_handle_cap(fd_v4l, dev);
-	}
+	ret = capture_loop_run(&dev->loop);
+	print_stats(dev);
+	teardown_loop(dev);
 
 err_streaming:
-	free_shm_and_sem(dev);
+	free_capture_shm(dev);
 
         return ret;
 }
 
-int main(int argc, char **argv)
+/*
+ * Each camera runs on its own thread and core with its own loop, pool
+ * and copy workers, so one device's frames never wait behind another's.
+ */
+static void *capture_thread(void *arg)
 {
-	struct capture_device *dev;
-        int fd_v4l;
-	int ret = 0;
+	struct capture_device *dev = arg;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	uint64_t one = 1;
+	cpu_set_t set;
+	int i, fd_v4l;
 
-	dev = (struct capture_device *)malloc(sizeof(struct capture_device));
-	if (!dev) {
-		printf("Failed to allocate memory.\n");
-		return -1;
+	if (ncpu > 1) {
+		CPU_ZERO(&set);
+		CPU_SET(dev->cpu % ncpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
 	}
 
-	dev->config = &configs[0];
+	dev->copy = copy_kernel_select(dev->config->copy_kernel);
+	if (copy_pool_init(&dev->copy_pool, dev->config->copy_threads,
+				dev->copy->fn, dev->cpu) < 0)
+		printf("%s: striped copy disabled.\n", dev->config->name);
 	dev->cap_bufs = (struct capture_buf *)malloc(dev->config->cap_buf_cnt
 				* sizeof(struct capture_buf));
 	if (!dev->cap_bufs) {
 		printf("Failed to alloc mem.\n");
-		ret = -1;
+		dev->ret = -1;
 		goto err_mem;
 	}
+	for (i = 0; i < dev->config->cap_buf_cnt; i++) {
+		dev->cap_bufs[i].start = NULL;
+		dev->cap_bufs[i].fd = -1;
+	}
 
-	fd_v4l = open(dev->config->device, O_RDWR, 0);
+	/* the loop drains the queue until EAGAIN */
+	fd_v4l = open(dev->config->device, O_RDWR | O_NONBLOCK, 0);
 	if (fd_v4l < 0) {
 		printf("Unable to open %s\n", dev->config->device);
-		ret = fd_v4l;
+		dev->ret = fd_v4l;
 		goto err_open;
 	}
+	dev->fd_v4l = fd_v4l;
 
-        ret = setup_v4l_capture(fd_v4l, dev->config);
-	if (ret < 0)
+	dev->ret = setup_v4l_capture(fd_v4l, dev->config);
+	if (dev->ret < 0)
 		goto err_setup;
 
-        ret = start_capturing(fd_v4l, dev);
-	if (ret < 0)
-		printf("Failed to start capturing\n");
+	printf("%s: %s on cpu %d, copy kernel %s\n", dev->config->name,
+			dev->config->device, dev->cpu, dev->copy->name);
+	dev->ret = start_capturing(fd_v4l, dev);
+	if (dev->ret < 0)
+		printf("%s: failed to start capturing\n", dev->config->name);
 
-	ret = stop_capturing(fd_v4l);
-        if (ret < 0)
-                printf("stop_capturing failed\n");
+	if (stop_capturing(fd_v4l) < 0)
+		printf("%s: stop_capturing failed\n", dev->config->name);
+	release_bufs(dev);
 
 err_setup:
-        close(fd_v4l);
+	close(fd_v4l);
 err_open:
 	free(dev->cap_bufs);
 err_mem:
-	free(dev);
-	
+	copy_pool_exit(&dev->copy_pool);
+	write(dev->done_fd, &one, sizeof(one));
+
+	return NULL;
+}
+
+static void post_request(struct capture_device *dev, unsigned int req)
+{
+	uint64_t one = 1;
+
+	__atomic_fetch_or(&dev->requests, req, __ATOMIC_RELEASE);
+	write(dev->req_fd, &one, sizeof(one));
+}
+
+struct capture_daemon {
+	struct capture_device	*devs;
+	unsigned int		nr_devs;
+	unsigned int		running;
+	struct capture_loop	loop;
+	struct loop_source	signal;
+	struct loop_source	done;
+};
+
+static void on_signal(struct loop_source *src, uint32_t events)
+{
+	struct capture_daemon *d = src->data;
+	unsigned int i;
+	int sig;
+
+	while ((sig = loop_signal_read(src)) > 0)
+		for (i = 0; i < d->nr_devs; i++)
+			post_request(&d->devs[i], sig == SIGUSR1 ?
+					DEV_REQ_STATS : DEV_REQ_STOP);
+}
+
+static void on_device_done(struct loop_source *src, uint32_t events)
+{
+	struct capture_daemon *d = src->data;
+	uint64_t cnt;
+
+	if (read(src->fd, &cnt, sizeof(cnt)) != sizeof(cnt))
+		return;
+	d->running -= cnt;
+	if (!d->running)
+		d->loop.stop = 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct capture_daemon d;
+	struct capture_device *dev;
+	struct capture_config *config;
+	sigset_t mask;
+	unsigned int i;
+	int cpu = 0;
+	int done_fd;
+	int ret = 0;
+	int j;
+
+	/* blocked before any thread exists so that all of them inherit it */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+
+	for (j = 1; j < argc; j++) {
+		for (i = 0; i < NR_CONFIGS; i++) {
+			config = &configs[i];
+			if (!strcmp(argv[j], "--export") ||
+					!strncmp(argv[j], "--export=", 9))
+				export_bufs_for(config, argv[j][8] ?
+						atoi(argv[j] + 9) : 1);
+			else if (!strcmp(argv[j], "--hugepages"))
+				config->pool_flags |= POOL_F_HUGETLB;
+			else if (!strcmp(argv[j], "--mlock"))
+				config->pool_flags |= POOL_F_MLOCK;
+			else if (!strncmp(argv[j], "--copy=", 7))
+				config->copy_kernel = argv[j] + 7;
+			else if (!strncmp(argv[j], "--copy-threads=", 15))
+				config->copy_threads = atoi(argv[j] + 15);
+			else if (!strcmp(argv[j], "--stats"))
+				config->stats = true;
+			else if (!strncmp(argv[j], "--crop=", 7) &&
+					sscanf(argv[j] + 7, "%ux%u+%d+%d",
+						&config->crop_width,
+						&config->crop_height,
+						&config->crop_left,
+						&config->crop_top) < 2)
+				config->crop_width = config->crop_height = 0;
+		}
+	}
+
+	memset(&d, 0, sizeof(d));
+	d.devs = calloc(NR_CONFIGS, sizeof(*d.devs));
+	if (!d.devs) {
+		printf("Failed to allocate memory.\n");
+		return -1;
+	}
+
+	if (capture_loop_init(&d.loop) < 0) {
+		ret = -1;
+		goto err_loop;
+	}
+	if (loop_add_signals(&d.loop, &d.signal, &mask, on_signal, &d) < 0) {
+		ret = -1;
+		goto err_signal;
+	}
+	done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (done_fd < 0) {
+		perror("eventfd");
+		ret = -1;
+		goto err_done;
+	}
+	loop_source_init(&d.done, done_fd, EPOLLIN, on_device_done, &d);
+	if (loop_add(&d.loop, &d.done) < 0) {
+		ret = -1;
+		goto err_threads;
+	}
+
+	for (i = 0; i < NR_CONFIGS; i++) {
+		dev = &d.devs[d.nr_devs];
+		dev->config = &configs[i];
+		dev->cpu = cpu;
+		dev->done_fd = done_fd;
+		dev->req_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (dev->req_fd < 0) {
+			perror("eventfd");
+			continue;
+		}
+		if (pthread_create(&dev->tid, NULL, capture_thread, dev)) {
+			printf("%s: failed to create thread.\n",
+						dev->config->name);
+			close(dev->req_fd);
+			continue;
+		}
+		/* the device and its copy workers get a core range each */
+		cpu += dev->config->copy_threads ? dev->config->copy_threads : 1;
+		d.nr_devs++;
+		d.running++;
+	}
+
+	if (d.running)
+		capture_loop_run(&d.loop);
+
+	ret = -1;
+	for (i = 0; i < d.nr_devs; i++) {
+		post_request(&d.devs[i], DEV_REQ_STOP);
+		pthread_join(d.devs[i].tid, NULL);
+		close(d.devs[i].req_fd);
+		if (d.devs[i].ret == 0)
+			ret = 0;
+	}
+
+	loop_del(&d.loop, &d.done);
+err_threads:
+	close(done_fd);
+err_done:
+	loop_close(&d.loop, &d.signal);
+err_signal:
+	capture_loop_exit(&d.loop);
+err_loop:
+	free(d.devs);
+
 	return ret;
 }
@@ -14,126 +14,854 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <sys/stat.h>
-#include <sys/ipc.h>
-#include <sys/shm.h>
-#include <sys/sem.h>
 
 #define KEY_PATH	"/tmp"
-#define MODULE_SEM_ID	0x391
-#define MODULE_SHM_ID	0x123
-
-#define free_sem(id) \
-({ \
-	union semun __sem_union; \
-	int __ret; \
-	__ret = semctl(id, 0, IPC_RMID, __sem_union); \
-	if (__ret == -1) \
-		perror("IPC_RMID semctl error"); \
- })
-
-#define free_shm(id) \
-({ \
-	int __ret; \
-	__ret = shmctl(id, IPC_RMID, 0); \
-	if (__ret < 0) \
-		printf("shmctl of %d error.\n", id); \
- })
-
-#define sem_op(sem_id, op) \
-({ \
-	struct sembuf __sembuf; \
-	int __ret; \
-	__sembuf.sem_num = 0; \
-	__sembuf.sem_op = op; \
-	__sembuf.sem_flg = SEM_UNDO; \
-	do { \
-		__ret = semop(sem_id, &__sembuf, 1); \
-		if (__ret == 0) \
-			break; \
-		fprintf(stderr, "sem op %d error: %s", op, strerror(errno)); \
-		sleep(1); \
-	} while (1); \
- })
-
-#define sem_lock(sem_id) sem_op(sem_id, -1)
-#define sem_unlock(sem_id) sem_op(sem_id, 1)
-
-union semun {
-	int			val;
-	struct semid_ds		*buf;
-	unsigned short		*array;
+#define CAPTURE_DEFAULT_STREAM	"cam0"
+
+#define BIT(nr)		(1UL << (nr))
+
+#define CACHE_LINE_SIZE	64
+#define CAPTURE_PAGE_SIZE	4096
+#define __cacheline_aligned __attribute__((__aligned__(CACHE_LINE_SIZE)))
+#define ALIGN(x, a)	(((x) + (a) - 1) & ~((a) - 1))
+
+/*
+ * The shm segment is shared between processes, so the usual kernel
+ * accessors are mapped onto the gcc atomic builtins.
+ */
+#define READ_ONCE(x)		__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v)	__atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define smp_load_acquire(p)	__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define smp_rmb()		__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_wmb()		__atomic_thread_fence(__ATOMIC_RELEASE)
+
+#define CAPTURE_MAX_READERS	16
+
+/* per frame header, valid under the slot seqlock */
+struct capture_meta {
+	unsigned int		sequence;	/* v4l2_buffer.sequence */
+	unsigned int		bytesused;
+	uint64_t		timestamp_us;	/* capture time, CLOCK_MONOTONIC */
+	uint64_t		publish_us;	/* when the producer published */
+	unsigned int		flags;
+	/* CAPTURE_META_PARTIAL: capture_data.roi_gen the ROIs were taken at */
+	unsigned int		roi_gen;
+	/* bit per reader slot the frame was published for, 0 is everybody */
+	unsigned int		want;
+	/*
+	 * Per reader slot, frames the producer had and passed over for its
+	 * subscription up to this one, so that they don't count as lost.
+	 */
+	unsigned int		passed[CAPTURE_MAX_READERS];
+};
+
+/* only the readers' ROIs were published, the rest of the slot is stale */
+#define CAPTURE_META_PARTIAL	BIT(0)
+
+/*
+ * Every slot is a seqlock: the producer makes seq odd while it copies
+ * frame n into the slot and sets it to 2n + 2 once the frame is stable,
+ * so a reader knows both whether the slot is torn and which frame it
+ * holds.
+ */
+struct capture_slot {
+	unsigned int		seq;
+	/* CAPTURE_F_EXPORT: the exported buffer that holds the frame */
+	unsigned int		buf_index;
+	struct capture_meta	meta;
+} __cacheline_aligned;
+
+#define CAPTURE_MAX_BUFS	16
+
+/* frames stay in the exported V4L2 buffers instead of the slots */
+#define CAPTURE_F_EXPORT	BIT(0)
+
+/*
+ * Lease count of an exported buffer. LEASE_QUEUED means the buffer
+ * belongs to the driver; otherwise it counts the readers holding it plus
+ * one for the producer while it is the newest frame. The producer only
+ * requeues a buffer whose count dropped to zero.
+ */
+#define LEASE_QUEUED		0x80000000u
+
+struct capture_lease {
+	unsigned int		state;
+	unsigned int		frame;
+} __cacheline_aligned;
+
+/* how long a block-producer reader may hold the producer back */
+#define CAPTURE_BLOCK_US	100000
+
+enum reader_policy {
+	READER_DROP_OLDEST,	/* read every frame, skip what was overwritten */
+	READER_BLOCK_PRODUCER,	/* producer waits before overwriting our frame */
+	READER_LATEST_ONLY,	/* always jump to the newest frame */
+};
+
+#define CAPTURE_MAX_ROIS	4
+
+/* a named rectangle of the frame, in pixels */
+struct capture_roi {
+	char			name[16];
+	unsigned int		x;
+	unsigned int		y;
+	unsigned int		width;
+	unsigned int		height;
+};
+
+enum {
+	READER_FREE,
+	READER_CLAIMED,
+	READER_ACTIVE,
 };
 
-struct capture_data {	
-	unsigned int		in;
-	unsigned int		last_in;
+/*
+ * A claimed slot carries the claimer's pid above the state bits, so a
+ * process that dies before it finishes attaching can still be reaped.
+ */
+#define READER_STATE_BITS	2
+#define READER_STATE_MASK	((1 << READER_STATE_BITS) - 1)
+
+/*
+ * One per consumer. Everything except state and lapped is written by
+ * the reader only, and each reader sits on its own cache line so that a
+ * slow reader never bounces a line that the producer or other readers
+ * use.
+ */
+struct capture_reader {
+	unsigned int		state;
+	unsigned int		policy;
+	/*
+	 * Producer only: a block-producer reader that outstayed
+	 * CAPTURE_BLOCK_US, overrun like a drop-oldest one until it has
+	 * read everything published.
+	 */
+	unsigned int		lapped;
+	int			pid;
 	unsigned int		out;
-	unsigned int		mask;
-	unsigned int		buf_flag;
+	unsigned int		lag;
+	unsigned int		frames;
+	unsigned int		drops;
+	/* bitmask of exported buffers leased by this reader */
+	unsigned int		leases;
+	/* from the frame headers, see reader_account() */
+	unsigned int		last_sequence;
+	unsigned int		last_passed;
+	unsigned int		lost;
+	unsigned int		latency_us;
+	unsigned int		max_latency_us;
+	/* read by the producer, nr_rois is published after rois[] */
+	unsigned int		nr_rois;
+	struct capture_roi	rois[CAPTURE_MAX_ROIS];
+	/*
+	 * Subscription, read by the producer: at most a frame per
+	 * sub_interval_us and one in every sub_every, 0 is no limit.
+	 * sub_gen is bumped after every change, and on attach.
+	 */
+	unsigned int		sub_interval_us;
+	unsigned int		sub_every;
+	unsigned int		sub_gen;
+} __cacheline_aligned;
+
+struct capture_data {
 	unsigned int		buf_cnt;
-	int			sem_id;
+	unsigned int		mask;
 	int			width;
 	int			height;
 	unsigned int		fmt;
 	unsigned int		sizeimage;
+	unsigned int		bytesperline;
+	unsigned int		slot_size;
+	unsigned int		data_offset;
+	unsigned int		flags;
+	unsigned int		export_cnt;
+
+	/* written by the producer only */
+	unsigned int		in __cacheline_aligned;
+	unsigned int		stalls;
+	/* frames no reader wanted, never copied */
+	unsigned int		skipped;
+
+	/* number of READER_BLOCK_PRODUCER readers */
+	unsigned int		nr_blocking __cacheline_aligned;
+	/* readers sleeping on the in futex */
+	unsigned int		waiters;
+	/* bumped by every ROI registration */
+	unsigned int		roi_gen;
+
+	struct capture_reader	readers[CAPTURE_MAX_READERS];
+	struct capture_lease	leases[CAPTURE_MAX_BUFS];
+
+	struct capture_slot	slots[] __cacheline_aligned;
 };
 
-static int get_and_init_sem(const char *path, int id)
+static inline size_t capture_data_size(unsigned int buf_cnt)
 {
-	key_t key;
-	union semun sem_union;
-	int tmp;
-	int semid;
+	return ALIGN(sizeof(struct capture_data) +
+			buf_cnt * sizeof(struct capture_slot), CAPTURE_PAGE_SIZE);
+}
 
-	key = ftok(path, id);
-	if (key == -1) {
-		perror("MODULE_SEM_ID error");
+/* every slot starts on its own page */
+static inline size_t capture_slot_size(unsigned int sizeimage)
+{
+	return ALIGN(sizeimage, CAPTURE_PAGE_SIZE);
+}
+
+static inline char *capture_slot_buf(struct capture_data *shm,
+				unsigned int frame)
+{
+	return (char *)shm + shm->data_offset +
+			(size_t)shm->slot_size * (frame & shm->mask);
+}
+
+/* buf_cnt must be the power of 2 */
+static inline void ring_init(struct capture_data *shm, unsigned int buf_cnt,
+				unsigned int sizeimage)
+{
+	unsigned int i;
+
+	shm->buf_cnt = buf_cnt;
+	shm->mask = buf_cnt - 1;
+	shm->sizeimage = sizeimage;
+	shm->slot_size = capture_slot_size(sizeimage);
+	shm->data_offset = capture_data_size(buf_cnt);
+	shm->flags = 0;
+	shm->export_cnt = 0;
+	shm->in = 0;
+	shm->stalls = 0;
+	shm->skipped = 0;
+	shm->nr_blocking = 0;
+	memset(shm->readers, 0, sizeof(shm->readers));
+	for (i = 0; i < CAPTURE_MAX_BUFS; i++) {
+		shm->leases[i].state = LEASE_QUEUED;
+		shm->leases[i].frame = 0;
+	}
+	for (i = 0; i < buf_cnt; i++) {
+		shm->slots[i].seq = 0;
+		shm->slots[i].buf_index = 0;
+		memset(&shm->slots[i].meta, 0, sizeof(shm->slots[i].meta));
+	}
+}
+
+static inline void lease_put(struct capture_data *shm, unsigned int buf)
+{
+	__atomic_fetch_sub(&shm->leases[buf].state, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Take a reference on buf as long as it still holds frame, i.e. it has
+ * been neither requeued nor refilled since the frame was published.
+ */
+static inline int lease_get(struct capture_data *shm, unsigned int buf,
+				unsigned int frame)
+{
+	struct capture_lease *l = &shm->leases[buf];
+	unsigned int state = READ_ONCE(l->state);
+
+	do {
+		if (state == 0 || (state & LEASE_QUEUED))
+			return -1;
+	} while (!__atomic_compare_exchange_n(&l->state, &state, state + 1,
+			true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+	if (READ_ONCE(l->frame) != frame) {
+		lease_put(shm, buf);
 		return -1;
 	}
-	semid = semget(key, 1, 0666 | IPC_CREAT);
-	if (!semid) {
-		perror("semget error");
+
+	return 0;
+}
+
+static inline uint64_t capture_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Drop a reader whose process went away without detaching, or while it
+ * was still attaching, so that neither its slot nor its block-producer
+ * policy leaks.
+ */
+static inline int reader_reap(struct capture_data *shm,
+				struct capture_reader *r)
+{
+	unsigned int state = READ_ONCE(r->state);
+	pid_t pid;
+
+	if ((state & READER_STATE_MASK) == READER_CLAIMED)
+		pid = state >> READER_STATE_BITS;
+	else if (state == READER_ACTIVE)
+		pid = r->pid;
+	else
+		return 0;
+	if (kill(pid, 0) == 0 || errno != ESRCH)
+		return 0;
+	if (!__atomic_compare_exchange_n(&r->state, &state, READER_FREE,
+			false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		return 0;
+	/* it never got to take a policy or leases */
+	if (state != READER_ACTIVE)
+		return 1;
+	if (r->policy == READER_BLOCK_PRODUCER)
+		__atomic_fetch_sub(&shm->nr_blocking, 1, __ATOMIC_RELEASE);
+	while (r->leases) {
+		lease_put(shm, __builtin_ctz(r->leases));
+		r->leases &= r->leases - 1;
+	}
+
+	return 1;
+}
+
+static inline void capture_reap_readers(struct capture_data *shm)
+{
+	unsigned int i;
+
+	for (i = 0; i < CAPTURE_MAX_READERS; i++)
+		if (READ_ONCE(shm->readers[i].state) != READER_FREE)
+			reader_reap(shm, &shm->readers[i]);
+}
+
+/*
+ * Wait until no block-producer reader still needs the frame that the
+ * next write will overwrite. The wait is bounded by CAPTURE_BLOCK_US,
+ * after which the reader is marked lapped: it is overrun and sees the
+ * frames as dropped, like a drop-oldest reader, and not waited for again
+ * until it has caught up with everything published. A stuck recorder so
+ * costs the others one CAPTURE_BLOCK_US, not one per frame.
+ *
+ * In export mode a reader that holds a lease already holds the producer
+ * back: the buffer can't be requeued until it lets go. Waiting on the
+ * ring too would only stall the loop that requeues everybody else's.
+ */
+static inline void ring_wait_readers(struct capture_data *shm)
+{
+	struct capture_reader *r;
+	uint64_t deadline = 0;
+	unsigned int i;
+
+	for (i = 0; i < CAPTURE_MAX_READERS; i++) {
+		r = &shm->readers[i];
+		if (smp_load_acquire(&r->state) != READER_ACTIVE ||
+				r->policy != READER_BLOCK_PRODUCER)
+			continue;
+		if (r->lapped) {
+			if (smp_load_acquire(&r->out) != shm->in)
+				continue;
+			WRITE_ONCE(r->lapped, 0);
+		}
+
+		while (shm->in - smp_load_acquire(&r->out) >= shm->buf_cnt) {
+			if ((shm->flags & CAPTURE_F_EXPORT) &&
+					READ_ONCE(r->leases))
+				break;
+			if (!deadline)
+				deadline = capture_now_us() + CAPTURE_BLOCK_US;
+			if (capture_now_us() > deadline) {
+				if (!reader_reap(shm, r)) {
+					WRITE_ONCE(r->lapped, 1);
+					WRITE_ONCE(shm->stalls, shm->stalls + 1);
+				}
+				break;
+			}
+			usleep(200);
+		}
+	}
+}
+
+static inline char *ring_write_begin(struct capture_data *shm)
+{
+	unsigned int in = shm->in;
+	struct capture_slot *slot = &shm->slots[in & shm->mask];
+
+	if (READ_ONCE(shm->nr_blocking))
+		ring_wait_readers(shm);
+
+	WRITE_ONCE(slot->seq, in * 2 + 1);
+	smp_wmb();
+
+	return capture_slot_buf(shm, in);
+}
+
+/* meta may be NULL when the source has no per frame information */
+static inline void ring_write_end(struct capture_data *shm,
+				const struct capture_meta *meta)
+{
+	unsigned int in = shm->in;
+	struct capture_slot *slot = &shm->slots[in & shm->mask];
+
+	if (meta)
+		slot->meta = *meta;
+	else
+		memset(&slot->meta, 0, sizeof(slot->meta));
+	slot->meta.publish_us = capture_now_us();
+
+	smp_store_release(&slot->seq, in * 2 + 2);
+	smp_store_release(&shm->in, in + 1);
+
+	/* pairs with the barrier in ring_wait_seq() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (READ_ONCE(shm->waiters))
+		syscall(SYS_futex, &shm->in, FUTEX_WAKE, INT_MAX,
+					NULL, NULL, 0);
+}
+
+/*
+ * True while every active reader has ROIs registered, so that the
+ * producer need only publish those. *gen is sampled before the scan: a
+ * registration racing with it ends up newer than the frame, and that
+ * reader skips the frame rather than read what was never copied.
+ */
+static inline bool ring_roi_only(struct capture_data *shm, unsigned int *gen)
+{
+	struct capture_reader *r;
+	bool any = false;
+	unsigned int i;
+
+	*gen = smp_load_acquire(&shm->roi_gen);
+	for (i = 0; i < CAPTURE_MAX_READERS; i++) {
+		r = &shm->readers[i];
+		if (smp_load_acquire(&r->state) != READER_ACTIVE)
+			continue;
+		if (!smp_load_acquire(&r->nr_rois))
+			return false;
+		any = true;
+	}
+
+	return any;
+}
+
+/*
+ * Producer side of the subscriptions, private to the producer and
+ * indexed like capture_data.readers.
+ */
+struct capture_demand {
+	unsigned int		gen[CAPTURE_MAX_READERS];
+	unsigned int		last_seq[CAPTURE_MAX_READERS];
+	uint64_t		next_us[CAPTURE_MAX_READERS];
+	/* running count of frames each reader was not given */
+	unsigned int		passed[CAPTURE_MAX_READERS];
+};
+
+/*
+ * The readers that will take the frame meta describes, 0 if none: then
+ * the frame needn't be copied, nor published at all. A rate limited
+ * reader is due an interval after its last due time, an eighth early
+ * to absorb timestamp jitter, so it keeps its rate on average; if it
+ * fell more than an interval behind it restarts from the frame it got.
+ * A new reader or subscription gets the next frame. meta->passed is
+ * filled in for reader_account().
+ */
+static inline unsigned int ring_demand(struct capture_data *shm,
+				struct capture_demand *d,
+				struct capture_meta *meta)
+{
+	struct capture_reader *r;
+	unsigned int i, gen, interval, every, want = 0;
+	uint64_t ts = meta->timestamp_us ? meta->timestamp_us :
+					capture_now_us();
+
+	for (i = 0; i < CAPTURE_MAX_READERS; i++) {
+		r = &shm->readers[i];
+		if (smp_load_acquire(&r->state) != READER_ACTIVE)
+			continue;
+		gen = smp_load_acquire(&r->sub_gen);
+		interval = READ_ONCE(r->sub_interval_us);
+		every = READ_ONCE(r->sub_every);
+		if (gen == d->gen[i]) {
+			if ((every && meta->sequence - d->last_seq[i] < every) ||
+					(interval && ts + interval / 8 <
+						d->next_us[i])) {
+				d->passed[i]++;
+				continue;
+			}
+		} else {
+			d->gen[i] = gen;
+			d->next_us[i] = ts;
+		}
+
+		want |= BIT(i);
+		d->last_seq[i] = meta->sequence;
+		d->next_us[i] = ts > d->next_us[i] + interval ?
+				ts + interval : d->next_us[i] + interval;
+	}
+	memcpy(meta->passed, d->passed, sizeof(meta->passed));
+
+	return want;
+}
+
+/* was the frame published for r, or is it one r would rather skip */
+static inline bool reader_wants(struct capture_data *shm,
+				struct capture_reader *r,
+				const struct capture_meta *meta)
+{
+	if (!meta->want || (!READ_ONCE(r->sub_interval_us) &&
+				!READ_ONCE(r->sub_every)))
+		return true;
+
+	return meta->want & BIT(r - shm->readers);
+}
+
+/*
+ * Sleep until the producer publishes past frame seen, or until
+ * timeout_ms expires (-1 waits forever). in doubles as the futex word,
+ * so an idle producer costs nothing and a publish costs one FUTEX_WAKE
+ * only when somebody is actually asleep.
+ */
+static inline int ring_wait_seq(struct capture_data *shm, unsigned int seen,
+				int timeout_ms)
+{
+	struct timespec ts, *tsp = NULL;
+	uint64_t deadline = 0, now;
+	unsigned int in;
+	int ret = 0;
+
+	if (timeout_ms >= 0)
+		deadline = capture_now_us() + (uint64_t)timeout_ms * 1000;
+
+	for (;;) {
+		in = smp_load_acquire(&shm->in);
+		if (in != seen)
+			return 0;
+
+		if (timeout_ms >= 0) {
+			now = capture_now_us();
+			if (now >= deadline)
+				return -ETIMEDOUT;
+			ts.tv_sec = (deadline - now) / 1000000;
+			ts.tv_nsec = (deadline - now) % 1000000 * 1000;
+			tsp = &ts;
+		}
+
+		__atomic_fetch_add(&shm->waiters, 1, __ATOMIC_SEQ_CST);
+		if (smp_load_acquire(&shm->in) == seen)
+			ret = syscall(SYS_futex, &shm->in, FUTEX_WAIT, seen,
+						tsp, NULL, 0);
+		__atomic_fetch_sub(&shm->waiters, 1, __ATOMIC_RELAXED);
+		if (ret < 0 && errno != EAGAIN && errno != EINTR &&
+				errno != ETIMEDOUT)
+			return -errno;
+	}
+}
+
+/* Wait until there is a frame this reader has not consumed yet. */
+static inline int ring_wait(struct capture_data *shm,
+				struct capture_reader *r, int timeout_ms)
+{
+	return ring_wait_seq(shm, READ_ONCE(r->out), timeout_ms);
+}
+
+static inline struct capture_reader *reader_attach(struct capture_data *shm,
+				enum reader_policy policy)
+{
+	struct capture_reader *r;
+	unsigned int state;
+	unsigned int i;
+
+	for (i = 0; i < CAPTURE_MAX_READERS; i++) {
+		r = &shm->readers[i];
+		state = READ_ONCE(r->state);
+		if (state != READER_FREE && !reader_reap(shm, r))
+			continue;
+
+		state = READER_FREE;
+		if (__atomic_compare_exchange_n(&r->state, &state,
+				READER_CLAIMED | getpid() << READER_STATE_BITS,
+				false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			break;
+	}
+	if (i == CAPTURE_MAX_READERS)
+		return NULL;
+
+	r->policy = policy;
+	r->lapped = 0;
+	r->pid = getpid();
+	r->lag = 0;
+	r->frames = 0;
+	r->drops = 0;
+	r->leases = 0;
+	r->last_sequence = 0;
+	r->last_passed = 0;
+	r->lost = 0;
+	r->latency_us = 0;
+	r->max_latency_us = 0;
+	r->nr_rois = 0;
+	r->sub_interval_us = 0;
+	r->sub_every = 0;
+	__atomic_add_fetch(&r->sub_gen, 1, __ATOMIC_RELEASE);
+	r->out = smp_load_acquire(&shm->in);
+	if (policy == READER_BLOCK_PRODUCER)
+		__atomic_fetch_add(&shm->nr_blocking, 1, __ATOMIC_RELEASE);
+	smp_store_release(&r->state, READER_ACTIVE);
+
+	return r;
+}
+
+static inline void reader_detach(struct capture_data *shm,
+				struct capture_reader *r)
+{
+	while (r->leases) {
+		lease_put(shm, __builtin_ctz(r->leases));
+		r->leases &= r->leases - 1;
+	}
+	if (r->policy == READER_BLOCK_PRODUCER)
+		__atomic_fetch_sub(&shm->nr_blocking, 1, __ATOMIC_RELEASE);
+	smp_store_release(&r->state, READER_FREE);
+}
+
+/*
+ * Pick the next frame for this reader according to its policy, skipping
+ * the ones that have been overwritten already. Returns -1 if there is
+ * nothing new.
+ */
+static inline int ring_read_begin(struct capture_data *shm,
+				struct capture_reader *r, unsigned int *frame)
+{
+	unsigned int in, out;
+	unsigned int seq;
+
+	for (;;) {
+		in = smp_load_acquire(&shm->in);
+		out = r->out;
+		if (in == out)
+			return -1;
+		if (r->policy == READER_LATEST_ONLY && in - out > 1)
+			out = in - 1;
+		else if (in - out > shm->buf_cnt)
+			out = in - shm->buf_cnt;
+
+		seq = smp_load_acquire(&shm->slots[out & shm->mask].seq);
+		if (seq == out * 2 + 2)
+			break;
+		/* the producer is already refilling that slot */
+		out++;
+		WRITE_ONCE(r->drops, r->drops + (out - r->out));
+		smp_store_release(&r->out, out);
+	}
+
+	WRITE_ONCE(r->drops, r->drops + (out - r->out));
+	WRITE_ONCE(r->lag, in - out - 1);
+	*frame = out;
+	return out & shm->mask;
+}
+
+/*
+ * Copy out the header of the frame being read; like the frame data it is
+ * only valid if ring_read_end() succeeds afterwards.
+ */
+static inline void ring_read_meta(struct capture_data *shm, unsigned int frame,
+				struct capture_meta *meta)
+{
+	*meta = shm->slots[frame & shm->mask].meta;
+}
+
+/*
+ * Update the reader's latency and loss counters from a frame it
+ * consumed. Gaps in the v4l2 sequence count every frame lost on the
+ * way, whether the driver, the producer or this reader dropped it,
+ * except the ones its subscription told the producer to pass over.
+ */
+static inline void reader_account(struct capture_data *shm,
+				struct capture_reader *r,
+				const struct capture_meta *meta)
+{
+	unsigned int passed = meta->passed[r - shm->readers];
+	uint64_t now = capture_now_us();
+	unsigned int latency, gap;
+
+	if (r->frames > 1 && meta->sequence - r->last_sequence > 1) {
+		gap = meta->sequence - r->last_sequence - 1;
+		gap -= gap < passed - r->last_passed ?
+				gap : passed - r->last_passed;
+		WRITE_ONCE(r->lost, r->lost + gap);
+	}
+	WRITE_ONCE(r->last_sequence, meta->sequence);
+	WRITE_ONCE(r->last_passed, passed);
+
+	latency = meta->timestamp_us ? now - meta->timestamp_us :
+				now - meta->publish_us;
+	WRITE_ONCE(r->latency_us, latency);
+	if (latency > r->max_latency_us)
+		WRITE_ONCE(r->max_latency_us, latency);
+}
+
+/* Returns 0 if the frame stayed intact while it was being read. */
+static inline int ring_read_end(struct capture_data *shm,
+				struct capture_reader *r, unsigned int frame)
+{
+	unsigned int seq;
+
+	smp_rmb();
+	seq = READ_ONCE(shm->slots[frame & shm->mask].seq);
+	smp_store_release(&r->out, frame + 1);
+	if (seq != frame * 2 + 2) {
+		WRITE_ONCE(r->drops, r->drops + 1);
 		return -1;
 	}
+	WRITE_ONCE(r->frames, r->frames + 1);
+
+	return 0;
+}
+
+/*
+ * CAPTURE_F_EXPORT producer side: buf came back from the driver and will
+ * carry the next published frame.
+ */
+static inline void export_buf_done(struct capture_data *shm, unsigned int buf)
+{
+	WRITE_ONCE(shm->leases[buf].frame, shm->in);
+	smp_store_release(&shm->leases[buf].state, 1);
+}
+
+/*
+ * Publish buf as the newest frame. The producer keeps its reference on
+ * the newest buffer only, so the one published before is handed over to
+ * whatever readers still lease it.
+ */
+static inline void export_publish(struct capture_data *shm, unsigned int buf,
+				const struct capture_meta *meta, int *latest)
+{
+	ring_write_begin(shm);
+	WRITE_ONCE(shm->slots[shm->in & shm->mask].buf_index, buf);
+	ring_write_end(shm, meta);
+
+	if (*latest >= 0)
+		lease_put(shm, *latest);
+	*latest = buf;
+}
+
+/* Returns the mask of buffers nobody leases any more; they may be requeued. */
+static inline unsigned int export_reclaim(struct capture_data *shm)
+{
+	unsigned int mask = 0;
+	unsigned int state;
+	unsigned int i;
+
+	for (i = 0; i < shm->export_cnt; i++) {
+		state = 0;
+		if (__atomic_compare_exchange_n(&shm->leases[i].state, &state,
+				LEASE_QUEUED, false, __ATOMIC_ACQ_REL,
+				__ATOMIC_RELAXED))
+			mask |= BIT(i);
+	}
+
+	return mask;
+}
+
+/*
+ * CAPTURE_F_EXPORT reader side: lease the buffer that holds the next
+ * frame for this reader. Returns the buffer index, or -1 if there is no
+ * new frame or it was requeued before we got to it.
+ */
+static inline int export_acquire(struct capture_data *shm,
+				struct capture_reader *r, unsigned int *frame,
+				struct capture_meta *meta)
+{
+	struct capture_meta m;
+	unsigned int buf;
+	int leased;
+	int idx;
+
+	idx = ring_read_begin(shm, r, frame);
+	if (idx < 0)
+		return -1;
 
-	sem_union.val = 1;
-	tmp = semctl(semid, 0, SETVAL, sem_union);
-	if (tmp == -1) {
-		semid = tmp;
-		perror("semctl error");
+	buf = READ_ONCE(shm->slots[idx].buf_index);
+	ring_read_meta(shm, *frame, &m);
+	if (!reader_wants(shm, r, &m)) {
+		smp_store_release(&r->out, *frame + 1);
+		return -1;
+	}
+	if (meta)
+		*meta = m;
+	leased = buf < shm->export_cnt && !lease_get(shm, buf, *frame);
+	if (ring_read_end(shm, r, *frame) < 0) {
+		if (leased)
+			lease_put(shm, buf);
+		return -1;
 	}
+	if (!leased) {
+		WRITE_ONCE(r->drops, r->drops + 1);
+		return -1;
+	}
+	r->leases |= BIT(buf);
 
-	return semid;
+	return buf;
 }
 
-static void *alloc_shm(int *shmid, int id, size_t size, int flag)
+static inline void export_release(struct capture_data *shm,
+				struct capture_reader *r, unsigned int buf)
 {
-	key_t key;
-	void *shm;
-	int tmp;
+	r->leases &= ~BIT(buf);
+	lease_put(shm, buf);
+}
 
-	key = ftok(KEY_PATH, id);
-	if (key == (key_t)-1) {
-		printf("ftok of 0x%0x id error.\n", id);
-		return (void *)-1;
+/*
+ * A futex cannot be polled, so consumers with their own epoll loop get
+ * an eventfd that a helper thread bumps on every publish.
+ */
+struct capture_notifier {
+	pthread_t		tid;
+	struct capture_data	*shm;
+	int			efd;
+	volatile int		stop;
+};
+
+static inline void *capture_notifier_fn(void *arg)
+{
+	struct capture_notifier *n = arg;
+	unsigned int seen = smp_load_acquire(&n->shm->in);
+	uint64_t one = 1;
+
+	while (!n->stop) {
+		if (ring_wait_seq(n->shm, seen, 100) < 0)
+			continue;
+		seen = smp_load_acquire(&n->shm->in);
+		if (write(n->efd, &one, sizeof(one)) < 0)
+			perror("notifier write");
 	}
-	printf("size: %d\n", size);
-	tmp = shmget(key, size, flag);
-	if (tmp < 0) {
-		printf("shmget of 0x%0x id error.\n", id);
-		return (void *)-1;
+
+	return NULL;
+}
+
+static inline int capture_notifier_start(struct capture_notifier *n,
+				struct capture_data *shm)
+{
+	n->shm = shm;
+	n->stop = 0;
+	n->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (n->efd < 0) {
+		perror("eventfd error");
+		return -1;
 	}
-	printf("shmdid: %d\n", tmp);
-	shm = shmat(tmp, NULL, 0);
-	if (shm == (void *)-1) {
-		printf("shmat of 0x%0x id error.\n", id);
-		return (void *)-1;
+	if (pthread_create(&n->tid, NULL, capture_notifier_fn, n)) {
+		printf("Failed to create notifier thread.\n");
+		close(n->efd);
+		return -1;
 	}
 
-	*shmid = tmp;
+	return n->efd;
+}
 
-	return shm;
+static inline void capture_notifier_stop(struct capture_notifier *n)
+{
+	n->stop = 1;
+	pthread_join(n->tid, NULL);
+	close(n->efd);
 }
 
 static inline unsigned int find_first_bit(unsigned int word)
@@ -0,0 +1,177 @@
+/*
+ * @file v4l2_pipe.c
+ *
+ * Copyright 2017 zhujiongfu.
+ *
+ * Runs a pipeline of a capture node and m2m nodes, buffers passed from
+ * stage to stage as dmabufs, and reports every stage's rate, queue depth
+ * and latency. Without the hardware, the kernel's test drivers do:
+ *
+ *   modprobe vivid; modprobe vim2m
+ *   v4l2_pipe /dev/video0:640x480:YUYV /dev/video2:320x240:RGBP
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include "v4l2_pipeline.h"
+
+#define PIPE_STATS_MS		1000
+
+struct pipe_app {
+	struct pipe		pipe;
+	struct loop_source	signals;
+	struct loop_source	timer;
+	unsigned int		interval_ms;
+	/* frames out of the last stage, headerless */
+	FILE			*dump;
+};
+
+/* path[:WxH][:FOURCC], path may not contain ':' */
+static int parse_node(struct pipe *p, char *spec)
+{
+	unsigned int width = 0, height = 0, fmt = 0;
+	char *path, *tok;
+
+	path = strtok(spec, ":");
+	if (!path)
+		return -1;
+	while ((tok = strtok(NULL, ":"))) {
+		if (sscanf(tok, "%ux%u", &width, &height) == 2)
+			continue;
+		if (strlen(tok) != 4) {
+			printf("%s: neither WxH nor a fourcc.\n", tok);
+			return -1;
+		}
+		fmt = v4l2_fourcc(tok[0], tok[1], tok[2], tok[3]);
+	}
+
+	return pipe_add_node(p, path, width, height, fmt) ? 0 : -1;
+}
+
+static void on_frame(struct pipe *p, const struct pipe_frame *f)
+{
+	struct pipe_app *app = p->data;
+
+	if (app->dump && fwrite(f->data, f->bytesused, 1, app->dump) != 1) {
+		perror("dump");
+		fclose(app->dump);
+		app->dump = NULL;
+	}
+}
+
+static void on_signal(struct loop_source *src, uint32_t events)
+{
+	struct pipe_app *app = src->data;
+
+	if (loop_signal_read(src))
+		app->pipe.loop.stop = 1;
+}
+
+static void on_timer(struct loop_source *src, uint32_t events)
+{
+	struct pipe_app *app = src->data;
+
+	loop_timer_ack(src);
+	pipe_print_stats(&app->pipe, app->interval_ms * 1000);
+}
+
+static void usage(const char *prog)
+{
+	printf("usage: %s [-b buffers] [-n frames] [-i interval ms] "
+		"[-o dump file]\n\tsource[:WxH][:FOURCC] "
+		"[m2m[:WxH][:FOURCC]...]\n"
+		"  each stage takes the previous one's output, WxH and FOURCC\n"
+		"  set what it produces\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct pipe_app app;
+	struct pipe *p = &app.pipe;
+	const char *dump = NULL;
+	sigset_t mask;
+	int i, opt, ret = -1;
+
+	memset(&app, 0, sizeof(app));
+	pipe_init(p);
+	p->sink = on_frame;
+	p->data = &app;
+	app.interval_ms = PIPE_STATS_MS;
+	while ((opt = getopt(argc, argv, "b:n:i:o:")) != -1) {
+		switch (opt) {
+		case 'b':
+			p->nbufs = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			p->max_frames = strtoull(optarg, NULL, 0);
+			break;
+		case 'i':
+			app.interval_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			dump = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	if (optind == argc || !app.interval_ms || !p->nbufs ||
+			p->nbufs > PIPE_MAX_BUFS) {
+		usage(argv[0]);
+		return -1;
+	}
+	for (i = optind; i < argc; i++) {
+		if (parse_node(p, argv[i]) < 0) {
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (dump) {
+		app.dump = fopen(dump, "w");
+		if (!app.dump) {
+			perror(dump);
+			return -1;
+		}
+	}
+
+	if (pipe_open(p) < 0)
+		goto out;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	if (loop_add_signals(&p->loop, &app.signals, &mask, on_signal,
+				&app) < 0)
+		goto close;
+	if (loop_add_timer(&p->loop, &app.timer, app.interval_ms * 1000,
+				on_timer, &app) < 0)
+		goto signals;
+
+	if (pipe_start(p) == 0)
+		ret = pipe_run(p);
+	pipe_stop(p);
+	printf("%llu frames through %u stages\n",
+			(unsigned long long)p->nodes[p->nnodes - 1].stats.frames,
+			p->nnodes);
+
+	loop_close(&p->loop, &app.timer);
+signals:
+	loop_close(&p->loop, &app.signals);
+close:
+	pipe_close(p);
+out:
+	if (app.dump)
+		fclose(app.dump);
+
+	return ret;
+}
@@ -0,0 +1,784 @@
+/*
+ * Chains of V4L2 capture and mem-to-mem nodes.
+ *
+ * Copyright (C) 2017 zhujiongfu
+ *
+ * A pipeline is a capture node (a sensor, vivid) followed by any number
+ * of m2m nodes (FIMC, vim2m), each one fed by the one before. Formats are
+ * negotiated down the chain: every stage takes exactly what the previous
+ * one produces on its output queue, and its capture queue is set to what
+ * the stage was asked for, the input's where nothing was asked.
+ *
+ * No stage copies a frame. The capture buffers of every stage but the
+ * last are exported with VIDIOC_EXPBUF and imported, index for index, as
+ * the DMABUF output buffers of the next stage. A buffer the next stage
+ * has consumed comes back on its output queue and is queued again to the
+ * capture queue it came from. The fds never change, so vb2 keeps the
+ * attachments and nothing is mapped per frame. Only the last stage's
+ * buffers are mmapped, for the sink.
+ *
+ * Every node is one source of a single capture_loop: EPOLLIN is a capture
+ * buffer done, EPOLLOUT an output buffer consumed.
+ *
+ * Buffers have a single memory plane; multi-planar APIs are fine, NV12M
+ * and the like aren't.
+ *
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ */
+
+#ifndef __V4L2_PIPELINE_H
+#define __V4L2_PIPELINE_H
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+#include "v4l2_capture.h"
+#include "capture_loop.h"
+
+#define PIPE_MAX_NODES		8
+#define PIPE_MAX_BUFS		CAPTURE_MAX_BUFS
+#define PIPE_DEFAULT_BUFS	4
+
+struct pipe_fmt {
+	unsigned int		width;
+	unsigned int		height;
+	unsigned int		pixelformat;
+	unsigned int		bytesperline;
+	unsigned int		sizeimage;
+};
+
+struct pipe_stage_stats {
+	/* capture buffers dequeued */
+	uint64_t		frames;
+	uint64_t		bytes;
+	/* source timestamp to dequeue */
+	uint64_t		latency_us;
+	unsigned int		max_latency_us;
+	/* buffers the driver holds, sampled at each dequeue */
+	uint64_t		depth_sum;
+	unsigned int		max_depth;
+	/* sequence gaps, source only */
+	unsigned int		lost;
+};
+
+struct pipe;
+
+struct pipe_node {
+	const char		*path;
+	int			fd;
+	int			idx;
+	struct pipe		*pipe;
+	bool			m2m;
+	bool			mplane;
+	unsigned int		cap_type;
+	unsigned int		out_type;
+
+	/* asked for, 0 is whatever comes in */
+	struct pipe_fmt		want;
+	/* output queue, m2m only */
+	struct pipe_fmt		in;
+	/* capture queue */
+	struct pipe_fmt		out;
+
+	unsigned int		nbufs;
+	unsigned int		buf_len;
+	/* exported capture buffers, all but the last stage */
+	int			dmabuf[PIPE_MAX_BUFS];
+	/* mapped capture buffers, last stage only */
+	void			*map[PIPE_MAX_BUFS];
+	unsigned int		cap_queued;
+	unsigned int		out_queued;
+	unsigned int		last_seq;
+
+	struct loop_source	src;
+	struct pipe_stage_stats	stats;
+	struct pipe_stage_stats	last;
+};
+
+struct pipe_frame {
+	unsigned int		index;
+	void			*data;
+	unsigned int		bytesused;
+	unsigned int		sequence;
+	uint64_t		timestamp_us;
+};
+
+/* a frame out of the last stage, its buffer is queued again on return */
+typedef void (*pipe_sink_fn)(struct pipe *p, const struct pipe_frame *f);
+
+struct pipe {
+	struct pipe_node	nodes[PIPE_MAX_NODES];
+	unsigned int		nnodes;
+	unsigned int		nbufs;
+	pipe_sink_fn		sink;
+	void			*data;
+	/* stop after that many frames out of the last stage, 0 never */
+	uint64_t		max_frames;
+	struct capture_loop	loop;
+};
+
+static inline const char *pipe_fourcc(unsigned int fmt, char *buf)
+{
+	buf[0] = fmt & 0xff;
+	buf[1] = (fmt >> 8) & 0xff;
+	buf[2] = (fmt >> 16) & 0xff;
+	buf[3] = (fmt >> 24) & 0xff;
+	buf[4] = '\0';
+	return buf;
+}
+
+static inline void pipe_init(struct pipe *p)
+{
+	memset(p, 0, sizeof(*p));
+	p->nbufs = PIPE_DEFAULT_BUFS;
+	p->loop.epfd = -1;
+}
+
+static inline struct pipe_node *pipe_add_node(struct pipe *p,
+				const char *path, unsigned int width,
+				unsigned int height, unsigned int pixelformat)
+{
+	struct pipe_node *n;
+	unsigned int i;
+
+	if (p->nnodes == PIPE_MAX_NODES) {
+		printf("at most %d pipeline stages.\n", PIPE_MAX_NODES);
+		return NULL;
+	}
+
+	n = &p->nodes[p->nnodes];
+	memset(n, 0, sizeof(*n));
+	n->path = path;
+	n->fd = -1;
+	n->idx = p->nnodes++;
+	n->pipe = p;
+	n->want.width = width;
+	n->want.height = height;
+	n->want.pixelformat = pixelformat;
+	for (i = 0; i < PIPE_MAX_BUFS; i++)
+		n->dmabuf[i] = -1;
+
+	return n;
+}
+
+static inline struct pipe_node *pipe_next(struct pipe *p, struct pipe_node *n)
+{
+	return n->idx + 1 < p->nnodes ? &p->nodes[n->idx + 1] : NULL;
+}
+
+static inline struct pipe_node *pipe_prev(struct pipe *p, struct pipe_node *n)
+{
+	return n->idx ? &p->nodes[n->idx - 1] : NULL;
+}
+
+static inline int pipe_querycap(struct pipe_node *n)
+{
+	struct v4l2_capability cap;
+	unsigned int caps;
+
+	memset(&cap, 0, sizeof(cap));
+	if (ioctl(n->fd, VIDIOC_QUERYCAP, &cap) < 0) {
+		perror("VIDIOC_QUERYCAP");
+		return -1;
+	}
+	caps = cap.capabilities & V4L2_CAP_DEVICE_CAPS ?
+			cap.device_caps : cap.capabilities;
+	if (!(caps & V4L2_CAP_STREAMING)) {
+		printf("%s: no streaming I/O.\n", n->path);
+		return -1;
+	}
+
+	n->m2m = caps & (V4L2_CAP_VIDEO_M2M | V4L2_CAP_VIDEO_M2M_MPLANE);
+	n->mplane = caps & (V4L2_CAP_VIDEO_M2M_MPLANE |
+				V4L2_CAP_VIDEO_CAPTURE_MPLANE);
+	if (!n->m2m && !(caps & (V4L2_CAP_VIDEO_CAPTURE |
+				V4L2_CAP_VIDEO_CAPTURE_MPLANE))) {
+		printf("%s: neither a capture nor a m2m device.\n", n->path);
+		return -1;
+	}
+	if (n->idx == 0 ? n->m2m : !n->m2m) {
+		printf("%s: the first stage must capture, the others must be "
+			"m2m.\n", n->path);
+		return -1;
+	}
+
+	n->cap_type = n->mplane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE :
+				V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	n->out_type = n->mplane ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE :
+				V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	printf("%s: %s, %s%s\n", n->path, cap.card,
+			n->m2m ? "m2m" : "capture",
+			n->mplane ? ", mplane" : "");
+
+	return 0;
+}
+
+static inline void pipe_fmt_from(struct pipe_node *n, struct pipe_fmt *f,
+				const struct v4l2_format *fmt)
+{
+	if (n->mplane) {
+		f->width = fmt->fmt.pix_mp.width;
+		f->height = fmt->fmt.pix_mp.height;
+		f->pixelformat = fmt->fmt.pix_mp.pixelformat;
+		f->bytesperline = fmt->fmt.pix_mp.plane_fmt[0].bytesperline;
+		f->sizeimage = fmt->fmt.pix_mp.plane_fmt[0].sizeimage;
+	} else {
+		f->width = fmt->fmt.pix.width;
+		f->height = fmt->fmt.pix.height;
+		f->pixelformat = fmt->fmt.pix.pixelformat;
+		f->bytesperline = fmt->fmt.pix.bytesperline;
+		f->sizeimage = fmt->fmt.pix.sizeimage;
+	}
+}
+
+/* set f on queue type, f is updated to what the driver made of it */
+static inline int pipe_set_fmt(struct pipe_node *n, unsigned int type,
+				struct pipe_fmt *f)
+{
+	struct v4l2_format fmt;
+
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = type;
+	if (n->mplane) {
+		fmt.fmt.pix_mp.width = f->width;
+		fmt.fmt.pix_mp.height = f->height;
+		fmt.fmt.pix_mp.pixelformat = f->pixelformat;
+		fmt.fmt.pix_mp.field = V4L2_FIELD_NONE;
+		fmt.fmt.pix_mp.num_planes = 1;
+		fmt.fmt.pix_mp.plane_fmt[0].bytesperline = f->bytesperline;
+		fmt.fmt.pix_mp.plane_fmt[0].sizeimage = f->sizeimage;
+	} else {
+		fmt.fmt.pix.width = f->width;
+		fmt.fmt.pix.height = f->height;
+		fmt.fmt.pix.pixelformat = f->pixelformat;
+		fmt.fmt.pix.field = V4L2_FIELD_NONE;
+		fmt.fmt.pix.bytesperline = f->bytesperline;
+		fmt.fmt.pix.sizeimage = f->sizeimage;
+	}
+
+	if (ioctl(n->fd, VIDIOC_S_FMT, &fmt) < 0) {
+		perror("VIDIOC_S_FMT");
+		return -1;
+	}
+	if (n->mplane && fmt.fmt.pix_mp.num_planes != 1) {
+		printf("%s: %u memory planes, only one is supported.\n",
+				n->path, fmt.fmt.pix_mp.num_planes);
+		return -1;
+	}
+	pipe_fmt_from(n, f, &fmt);
+
+	return 0;
+}
+
+static inline int pipe_get_fmt(struct pipe_node *n, unsigned int type,
+				struct pipe_fmt *f)
+{
+	struct v4l2_format fmt;
+
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = type;
+	if (ioctl(n->fd, VIDIOC_G_FMT, &fmt) < 0) {
+		perror("VIDIOC_G_FMT");
+		return -1;
+	}
+	pipe_fmt_from(n, f, &fmt);
+
+	return 0;
+}
+
+static inline void pipe_print_fmt(const char *prefix, const struct pipe_fmt *f)
+{
+	char fcc[5];
+
+	printf("  %s %ux%u %s stride %u size %u\n", prefix, f->width,
+			f->height, pipe_fourcc(f->pixelformat, fcc),
+			f->bytesperline, f->sizeimage);
+}
+
+/*
+ * The output queue has to take the previous stage's frames as they are,
+ * a driver that wants another format, size or stride can't be fed
+ * without a copy.
+ */
+static inline int pipe_negotiate(struct pipe *p, struct pipe_node *n)
+{
+	struct pipe_node *prev = pipe_prev(p, n);
+	struct pipe_fmt f;
+
+	if (prev) {
+		f = prev->out;
+		if (pipe_set_fmt(n, n->out_type, &f) < 0)
+			return -1;
+		if (f.pixelformat != prev->out.pixelformat ||
+				f.width != prev->out.width ||
+				f.height != prev->out.height ||
+				f.bytesperline != prev->out.bytesperline) {
+			printf("%s: can't take the output of %s.\n",
+					n->path, prev->path);
+			pipe_print_fmt("offered", &prev->out);
+			pipe_print_fmt("wants", &f);
+			return -1;
+		}
+		n->in = f;
+		pipe_print_fmt("in ", &n->in);
+	} else if (pipe_get_fmt(n, n->cap_type, &f) < 0) {
+		return -1;
+	}
+
+	if (n->want.width)
+		f.width = n->want.width;
+	if (n->want.height)
+		f.height = n->want.height;
+	if (n->want.pixelformat)
+		f.pixelformat = n->want.pixelformat;
+	f.bytesperline = 0;
+	f.sizeimage = 0;
+	if (pipe_set_fmt(n, n->cap_type, &f) < 0)
+		return -1;
+	if ((n->want.pixelformat && f.pixelformat != n->want.pixelformat) ||
+			(n->want.width && f.width != n->want.width) ||
+			(n->want.height && f.height != n->want.height))
+		printf("%s: adjusted by the driver.\n", n->path);
+	n->out = f;
+	pipe_print_fmt("out", &n->out);
+
+	return 0;
+}
+
+static inline void pipe_buf_init(struct pipe_node *n, struct v4l2_buffer *b,
+				struct v4l2_plane *plane, unsigned int type,
+				unsigned int memory, unsigned int index)
+{
+	memset(b, 0, sizeof(*b));
+	b->type = type;
+	b->memory = memory;
+	b->index = index;
+	if (n->mplane) {
+		memset(plane, 0, sizeof(*plane));
+		b->m.planes = plane;
+		b->length = 1;
+	}
+}
+
+static inline int pipe_reqbufs(struct pipe_node *n, unsigned int type,
+				unsigned int memory, unsigned int count)
+{
+	struct v4l2_requestbuffers req;
+
+	memset(&req, 0, sizeof(req));
+	req.type = type;
+	req.memory = memory;
+	req.count = count;
+	if (ioctl(n->fd, VIDIOC_REQBUFS, &req) < 0) {
+		perror("VIDIOC_REQBUFS");
+		return -1;
+	}
+
+	return req.count;
+}
+
+/*
+ * Capture buffers are exported, or mapped on the last stage. The output
+ * queue of a m2m stage gets as many DMABUF slots as the stage before has
+ * buffers, buffer i of one is always slot i of the other.
+ */
+static inline int pipe_alloc(struct pipe *p, struct pipe_node *n)
+{
+	struct pipe_node *prev = pipe_prev(p, n);
+	struct v4l2_exportbuffer expbuf;
+	struct v4l2_buffer b;
+	struct v4l2_plane plane;
+	unsigned int i;
+	int cnt;
+
+	if (prev) {
+		cnt = pipe_reqbufs(n, n->out_type, V4L2_MEMORY_DMABUF,
+					prev->nbufs);
+		if (cnt < 0)
+			return -1;
+		if (cnt < prev->nbufs) {
+			printf("%s: takes %d buffers, %s has %u.\n", n->path,
+					cnt, prev->path, prev->nbufs);
+			return -1;
+		}
+	}
+
+	cnt = pipe_reqbufs(n, n->cap_type, V4L2_MEMORY_MMAP, p->nbufs);
+	if (cnt <= 0)
+		return -1;
+	n->nbufs = cnt < PIPE_MAX_BUFS ? cnt : PIPE_MAX_BUFS;
+
+	for (i = 0; i < n->nbufs; i++) {
+		pipe_buf_init(n, &b, &plane, n->cap_type, V4L2_MEMORY_MMAP, i);
+		if (ioctl(n->fd, VIDIOC_QUERYBUF, &b) < 0) {
+			perror("VIDIOC_QUERYBUF");
+			return -1;
+		}
+		n->buf_len = n->mplane ? plane.length : b.length;
+
+		if (pipe_next(p, n)) {
+			memset(&expbuf, 0, sizeof(expbuf));
+			expbuf.type = n->cap_type;
+			expbuf.index = i;
+			expbuf.flags = O_RDWR | O_CLOEXEC;
+			if (ioctl(n->fd, VIDIOC_EXPBUF, &expbuf) < 0) {
+				perror("VIDIOC_EXPBUF");
+				return -1;
+			}
+			n->dmabuf[i] = expbuf.fd;
+			continue;
+		}
+
+		n->map[i] = mmap(NULL, n->buf_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED, n->fd, n->mplane ?
+				plane.m.mem_offset : b.m.offset);
+		if (n->map[i] == MAP_FAILED) {
+			perror("mmap");
+			n->map[i] = NULL;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static inline void pipe_free(struct pipe_node *n)
+{
+	unsigned int i;
+
+	for (i = 0; i < PIPE_MAX_BUFS; i++) {
+		if (n->dmabuf[i] >= 0)
+			close(n->dmabuf[i]);
+		n->dmabuf[i] = -1;
+		if (n->map[i])
+			munmap(n->map[i], n->buf_len);
+		n->map[i] = NULL;
+	}
+	if (n->fd < 0)
+		return;
+	pipe_reqbufs(n, n->cap_type, V4L2_MEMORY_MMAP, 0);
+	if (n->m2m)
+		pipe_reqbufs(n, n->out_type, V4L2_MEMORY_DMABUF, 0);
+}
+
+static inline int pipe_qbuf_cap(struct pipe_node *n, unsigned int index)
+{
+	struct v4l2_buffer b;
+	struct v4l2_plane plane;
+
+	pipe_buf_init(n, &b, &plane, n->cap_type, V4L2_MEMORY_MMAP, index);
+	if (ioctl(n->fd, VIDIOC_QBUF, &b) < 0) {
+		perror("VIDIOC_QBUF capture");
+		return -1;
+	}
+	n->cap_queued |= BIT(index);
+
+	return 0;
+}
+
+/* hand the previous stage's buffer src, index for index, to n */
+static inline int pipe_qbuf_out(struct pipe_node *n, struct pipe_node *prev,
+				const struct v4l2_buffer *src,
+				unsigned int bytesused)
+{
+	struct v4l2_buffer b;
+	struct v4l2_plane plane;
+
+	pipe_buf_init(n, &b, &plane, n->out_type, V4L2_MEMORY_DMABUF,
+				src->index);
+	b.field = src->field;
+	b.timestamp = src->timestamp;
+	if (n->mplane) {
+		plane.m.fd = prev->dmabuf[src->index];
+		plane.length = prev->buf_len;
+		plane.bytesused = bytesused;
+	} else {
+		b.m.fd = prev->dmabuf[src->index];
+		b.length = prev->buf_len;
+		b.bytesused = bytesused;
+	}
+	if (ioctl(n->fd, VIDIOC_QBUF, &b) < 0) {
+		perror("VIDIOC_QBUF output");
+		return -1;
+	}
+	n->out_queued |= BIT(src->index);
+
+	return 0;
+}
+
+/* vb2 reports EPOLLERR while nothing is queued, so park the fd then */
+static inline void pipe_arm(struct pipe *p, struct pipe_node *n)
+{
+	loop_arm(&p->loop, &n->src, (n->cap_queued | n->out_queued) != 0);
+}
+
+static inline void pipe_account(struct pipe_node *n,
+				const struct v4l2_buffer *b,
+				unsigned int bytesused)
+{
+	struct pipe_stage_stats *st = &n->stats;
+	uint64_t ts, now = capture_now_us();
+	unsigned int depth;
+
+	depth = __builtin_popcount(n->cap_queued) +
+			__builtin_popcount(n->out_queued);
+	st->depth_sum += depth;
+	if (depth > st->max_depth)
+		st->max_depth = depth;
+
+	/* m2m stages copy the source timestamp along */
+	ts = b->timestamp.tv_sec * 1000000ull + b->timestamp.tv_usec;
+	if (ts && ts <= now) {
+		st->latency_us += now - ts;
+		if (now - ts > st->max_latency_us)
+			st->max_latency_us = now - ts;
+	}
+
+	if (!n->m2m && st->frames && b->sequence != n->last_seq + 1)
+		st->lost += b->sequence - n->last_seq - 1;
+	n->last_seq = b->sequence;
+
+	st->frames++;
+	st->bytes += bytesused;
+}
+
+/* output buffers n is done with go back to the stage they came from */
+static inline int pipe_on_output(struct pipe *p, struct pipe_node *n)
+{
+	struct pipe_node *prev = pipe_prev(p, n);
+	struct v4l2_buffer b;
+	struct v4l2_plane plane;
+
+	for (;;) {
+		pipe_buf_init(n, &b, &plane, n->out_type, V4L2_MEMORY_DMABUF, 0);
+		if (ioctl(n->fd, VIDIOC_DQBUF, &b) < 0) {
+			if (errno == EAGAIN)
+				break;
+			perror("VIDIOC_DQBUF output");
+			return -1;
+		}
+		n->out_queued &= ~BIT(b.index);
+		if (pipe_qbuf_cap(prev, b.index) < 0)
+			return -1;
+	}
+	pipe_arm(p, prev);
+
+	return 0;
+}
+
+/* finished frames move on to the next stage, or to the sink */
+static inline int pipe_on_capture(struct pipe *p, struct pipe_node *n)
+{
+	struct pipe_node *next = pipe_next(p, n);
+	struct v4l2_buffer b;
+	struct v4l2_plane plane;
+	struct pipe_frame f;
+	unsigned int bytesused;
+
+	for (;;) {
+		pipe_buf_init(n, &b, &plane, n->cap_type, V4L2_MEMORY_MMAP, 0);
+		if (ioctl(n->fd, VIDIOC_DQBUF, &b) < 0) {
+			if (errno == EAGAIN)
+				break;
+			perror("VIDIOC_DQBUF capture");
+			return -1;
+		}
+		bytesused = n->mplane ? plane.bytesused : b.bytesused;
+		pipe_account(n, &b, bytesused);
+		n->cap_queued &= ~BIT(b.index);
+
+		if (next) {
+			if (pipe_qbuf_out(next, n, &b, bytesused) < 0)
+				return -1;
+			continue;
+		}
+
+		if (p->sink) {
+			f.index = b.index;
+			f.data = n->map[b.index];
+			f.bytesused = bytesused;
+			f.sequence = b.sequence;
+			f.timestamp_us = b.timestamp.tv_sec * 1000000ull +
+					b.timestamp.tv_usec;
+			p->sink(p, &f);
+		}
+		if (pipe_qbuf_cap(n, b.index) < 0)
+			return -1;
+		if (p->max_frames && n->stats.frames >= p->max_frames)
+			p->loop.stop = 1;
+	}
+	if (next)
+		pipe_arm(p, next);
+
+	return 0;
+}
+
+static inline void pipe_on_node(struct loop_source *src, uint32_t events)
+{
+	struct pipe_node *n = src->data;
+	struct pipe *p = n->pipe;
+
+	if (events & EPOLLERR) {
+		printf("%s: queue error.\n", n->path);
+		p->loop.stop = 1;
+		return;
+	}
+	if ((events & EPOLLOUT) && pipe_on_output(p, n) < 0)
+		p->loop.stop = 1;
+	if ((events & EPOLLIN) && pipe_on_capture(p, n) < 0)
+		p->loop.stop = 1;
+	pipe_arm(p, n);
+}
+
+static inline void pipe_close(struct pipe *p)
+{
+	struct pipe_node *n;
+	unsigned int i;
+
+	for (i = 0; i < p->nnodes; i++) {
+		n = &p->nodes[i];
+		pipe_free(n);
+		if (n->fd >= 0)
+			close(n->fd);
+		n->fd = -1;
+	}
+	if (p->loop.epfd >= 0)
+		capture_loop_exit(&p->loop);
+	p->loop.epfd = -1;
+}
+
+/* open the nodes, negotiate formats down the chain and set up buffers */
+static inline int pipe_open(struct pipe *p)
+{
+	struct pipe_node *n;
+	unsigned int i;
+
+	if (!p->nnodes) {
+		printf("empty pipeline.\n");
+		return -1;
+	}
+	if (capture_loop_init(&p->loop) < 0)
+		return -1;
+
+	for (i = 0; i < p->nnodes; i++) {
+		n = &p->nodes[i];
+		n->fd = open(n->path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if (n->fd < 0) {
+			perror(n->path);
+			goto err;
+		}
+		if (pipe_querycap(n) < 0 || pipe_negotiate(p, n) < 0)
+			goto err;
+	}
+	for (i = 0; i < p->nnodes; i++) {
+		n = &p->nodes[i];
+		if (pipe_alloc(p, n) < 0)
+			goto err;
+		loop_source_init(&n->src, n->fd, EPOLLIN |
+				(n->m2m ? EPOLLOUT : 0), pipe_on_node, n);
+		n->src.urgent = true;
+	}
+
+	return 0;
+err:
+	pipe_close(p);
+	return -1;
+}
+
+static inline int pipe_streamon(struct pipe_node *n, unsigned int type)
+{
+	if (ioctl(n->fd, VIDIOC_STREAMON, &type) < 0) {
+		perror("VIDIOC_STREAMON");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* every capture buffer starts out empty and queued, the source last */
+static inline int pipe_start(struct pipe *p)
+{
+	struct pipe_node *n;
+	unsigned int i, j;
+	int k;
+
+	for (k = p->nnodes - 1; k >= 0; k--) {
+		n = &p->nodes[k];
+		for (j = 0; j < n->nbufs; j++) {
+			if (pipe_qbuf_cap(n, j) < 0)
+				return -1;
+		}
+		if (n->m2m && pipe_streamon(n, n->out_type) < 0)
+			return -1;
+		if (pipe_streamon(n, n->cap_type) < 0)
+			return -1;
+	}
+	for (i = 0; i < p->nnodes; i++)
+		pipe_arm(p, &p->nodes[i]);
+
+	return 0;
+}
+
+static inline void pipe_stop(struct pipe *p)
+{
+	struct pipe_node *n;
+	unsigned int i, type;
+
+	for (i = 0; i < p->nnodes; i++) {
+		n = &p->nodes[i];
+		loop_del(&p->loop, &n->src);
+		type = n->cap_type;
+		ioctl(n->fd, VIDIOC_STREAMOFF, &type);
+		if (n->m2m) {
+			type = n->out_type;
+			ioctl(n->fd, VIDIOC_STREAMOFF, &type);
+		}
+		n->cap_queued = 0;
+		n->out_queued = 0;
+	}
+}
+
+/* per stage rate, throughput, queue depth and latency since last time */
+static inline void pipe_print_stats(struct pipe *p, unsigned int interval_us)
+{
+	struct pipe_stage_stats *st, *last;
+	struct pipe_node *n;
+	uint64_t frames;
+	unsigned int i;
+
+	for (i = 0; i < p->nnodes; i++) {
+		n = &p->nodes[i];
+		st = &n->stats;
+		last = &n->last;
+		frames = st->frames - last->frames;
+		printf("  %u %-12s %6.1f fps %7.1f MB/s depth avg %.1f max %u/%u"
+			" latency avg %llu max %u us", i, n->path,
+			frames * 1e6 / interval_us,
+			(st->bytes - last->bytes) / (double)interval_us,
+			frames ? (double)(st->depth_sum - last->depth_sum) /
+				frames : 0.0,
+			st->max_depth, n->nbufs + (n->m2m ?
+				pipe_prev(p, n)->nbufs : 0),
+			(unsigned long long)(frames ? (st->latency_us -
+				last->latency_us) / frames : 0),
+			st->max_latency_us);
+		if (!n->m2m)
+			printf(" lost %u", st->lost - last->lost);
+		printf("\n");
+		*last = *st;
+		st->max_depth = 0;
+		st->max_latency_us = 0;
+	}
+}
+
+static inline int pipe_run(struct pipe *p)
+{
+	return capture_loop_run(&p->loop);
+}
+
+#endif
@@ -3,6 +3,7 @@
 #include <string.h>  
 #include <errno.h>  
 #include <stdlib.h>  
+#include <malloc.h>
 #include <sys/types.h>  
 #include <sys/stat.h>  
 #include <fcntl.h>  
@@ -14,6 +15,11 @@
 #include <pthread.h>  
 #include <poll.h>  
 #include <semaphore.h>  
+#include "rk3288_capture/pixconv.h"
+#include "rk3288_capture/scaler.h"
+#include "rk3288_capture/kms_output.h"
+#include "rk3288_capture/frame_queue.h"
+#include "rk3288_capture/present_clock.h"
   
 #define TimeOut 5   
   
@@ -58,10 +64,13 @@ typedef struct
     void *start;  
     int length;  
     int bytesused;  
+    unsigned int sequence;
+    uint64_t timestamp_us;
 }BUFTYPE;  
   
   
-char lcd_path[] = "/dev/fb0";  
+const char *lcd_path = "/dev/fb0";
+const char *kms_path = "/dev/dri/card0";
 char fimc0_path[] = "/dev/video0";  
 char cam_path[] = "/dev/video13";  
   
@@ -70,7 +79,6 @@ char cam_path[] = "/dev/video13";
   
   
   
-static sem_t lcd_sem;  
   
 BUFTYPE *fimc0_out_buf;  
 BUFTYPE *buffers;  
@@ -95,8 +103,93 @@ static pthread_t display_tid;
     int cam_fd;  
 int display_x = 0;  
 int display_y = 0;  
-static int fimc0_cap_index = 0;  
 char *temp_buf=NULL;  
+
+/*
+ * Without FIMC0 (or with --sw) the camera frame is converted and scaled
+ * to the framebuffer size on the CPU, straight into a framebuffer page.
+ */
+static int use_fimc = 1;
+static struct pixconv sw_conv;
+static struct scaler sw_scaler;
+static struct copy_pool sw_pool;
+static int sw_scale;
+static char *sw_rgb;
+static int cam_width, cam_height, cam_stride;
+
+/*
+ * The framebuffer is FB_PAGES screens high and the display thread pans
+ * between them on vsync, so a frame is only ever rendered into a page
+ * that isn't being scanned out. The cam thread takes a page from
+ * fb_free_q, fills it and queues it on fb_show_q; the page that was on
+ * screen before a flip goes back on fb_free_q once the flip happened.
+ * Both are lock-free single producer queues, the cam thread owns the
+ * one way and the display thread the other. With FIMC0 writing straight
+ * into the pages (fimc_direct) the free pages are the ones queued to
+ * FIMC0 instead.
+ *
+ * fb_show_q is --queue deep. By default the newest frame wins: a full
+ * queue drops its oldest frame, and with no free page the cam thread
+ * takes back the oldest one the display hasn't got to. With --fifo
+ * every frame is shown and the cam thread waits for the display.
+ *
+ * Unless --asap, the display thread doesn't flip to a frame as soon as
+ * it has it but on the refresh present_clock says it is due, the frames
+ * it holds till then are its jitter buffer. --smooth and --latency set
+ * how much jitter it rides out, at the cost of latency.
+ *
+ * With --kms the pages are KMS dumb buffers, or FIMC0's own buffers
+ * imported as DMABUFs, and a flip is an atomic commit that completes
+ * with the page flip event.
+ */
+#define FB_PAGES 3
+static int fb_pages = 1;
+static int fb_page_size;
+static int fb_front;
+static struct frame_queue fb_show_q;
+static struct frame_queue fb_free_q;
+static int fb_queue_depth = 2;
+static unsigned int fb_queue_flags = FQ_F_LATEST;
+/* a page the cam thread got back from fb_show_q, used before fb_free_q */
+static int fb_spare = -1;
+static int fimc_direct;
+static int fimc0_cap_stride;
+int fimc0_cap_qbuf(int index);
+static int use_kms;
+static struct kms_output kms;
+static struct present_clock present;
+static int present_asap;
+static unsigned int present_smooth = 2;
+static unsigned int present_min_us;
+
+/* refresh period, and no FBIO_WAITFORVSYNC (vfb): sleep to the next one */
+static unsigned int fb_period_us;
+static int fb_soft_vsync;
+
+struct fb_stats {
+    unsigned int flips;
+    unsigned int missed;
+    uint64_t latency_us;
+    unsigned int max_latency_us;
+    uint64_t last_vsync_us;
+    uint64_t report_us;
+};
+static struct fb_stats fb_stats;
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline char *fb_page(int page)
+{
+    if (use_kms)
+        return kms.bufs[page].map;
+    return fb_buf + page * fb_page_size;
+}
 int display_format(int pixelformat)  
 {  
             printf("{pixelformat = %c%c%c%c}\n",  
@@ -149,17 +242,19 @@ int open_camera_device()
         exit(EXIT_FAILURE);  
     }   
     cam_fd = fd;  
+    if (!use_fimc)
+        return fd;
     if((fimc0_fd = open(fimc0_path,O_RDWR | O_NONBLOCK)) < 0)  
     {  
-        perror("Fail to open");  
-        exit(EXIT_FAILURE);  
+        perror("Fail to open fimc0, using the software path");  
+        use_fimc = 0;
     }   
       
     printf("open cam success %d\n",fd);  
     return fd;  
 }  
   
-//ͷ豸  
+//´ò¿ªÉãÏñÍ·Éè±¸  
 int open_lcd_device()  
 {  
     int fd;  
@@ -182,20 +277,49 @@ int open_lcd_device()
         perror("Fail to ioctl:FBIOGET_VSCREENINFO\n");  
         exit(EXIT_FAILURE);  
     }  
-    lcd_buf_size = vinfo.xres * vinfo.yres * vinfo.bits_per_pixel / 8;    
-    printf("vinfo.xres:%d, vinfo.yres:%d, vinfo.bits_per_pixel:%d, lcd_buf_size:%d, finfo.line_length:%d\n",vinfo.xres, vinfo.yres, vinfo.bits_per_pixel, lcd_buf_size, finfo.line_length);   
-  
-  
     lcd_fd = fd;  
       
+    /* room to flip between FB_PAGES screens, or two, or none */
     vinfo.activate = FB_ACTIVATE_FORCE;  
-    vinfo.yres_virtual = vinfo.yres;  
-    ret = ioctl(fd, FBIOPUT_VSCREENINFO, &vinfo );  
-    if( ret < 0 )  
-    {  
-        printf( "ioctl FBIOPUT_VSCREENINFO failed\n");  
-        return -1;  
-    }  
+    vinfo.xoffset = 0;
+    vinfo.yoffset = 0;
+    for (fb_pages = finfo.ypanstep ? FB_PAGES : 1; fb_pages > 1; fb_pages--) {
+        vinfo.yres_virtual = vinfo.yres * fb_pages;
+        if (ioctl(fd, FBIOPUT_VSCREENINFO, &vinfo) == 0 &&
+                vinfo.yres_virtual >= vinfo.yres * fb_pages)
+            break;
+    }
+    if (fb_pages == 1) {
+        vinfo.yres_virtual = vinfo.yres;  
+        ret = ioctl(fd, FBIOPUT_VSCREENINFO, &vinfo );  
+        if( ret < 0 )  
+        {  
+            printf( "ioctl FBIOPUT_VSCREENINFO failed\n");  
+            return -1;  
+        }  
+    }
+    /* the line length can change with the virtual size */
+    if (-1 == ioctl(fd, FBIOGET_FSCREENINFO, &finfo))
+    {
+        perror("Fail to ioctl:FBIOGET_FSCREENINFO\n");
+        exit(EXIT_FAILURE);
+    }
+    fb_page_size = finfo.line_length * vinfo.yres;
+    lcd_buf_size = fb_page_size * fb_pages;
+    fb_front = 0;
+    printf("vinfo.xres:%d, vinfo.yres:%d, vinfo.bits_per_pixel:%d, lcd_buf_size:%d, finfo.line_length:%d, %d pages\n",vinfo.xres, vinfo.yres, vinfo.bits_per_pixel, lcd_buf_size, finfo.line_length, fb_pages);   
+
+    if (vinfo.pixclock) {
+        uint64_t htotal = vinfo.left_margin + vinfo.xres +
+                vinfo.right_margin + vinfo.hsync_len;
+        uint64_t vtotal = vinfo.upper_margin + vinfo.yres +
+                vinfo.lower_margin + vinfo.vsync_len;
+
+        /* pixclock is in ps */
+        fb_period_us = vinfo.pixclock * htotal * vtotal / 1000000;
+    }
+    if (!fb_period_us)
+        fb_period_us = 1000000 / 60;
       
     //mmap framebuffer      
     fb_buf = (char *)mmap(  
@@ -204,7 +328,7 @@ int open_lcd_device()
         PROT_READ | PROT_WRITE,MAP_SHARED ,  
         lcd_fd,   
         0);      
-    if(NULL == fb_buf)  
+    if(MAP_FAILED == fb_buf)  
     {  
         perror("Fail to mmap fb_buf");  
         exit(EXIT_FAILURE);  
@@ -218,18 +342,201 @@ int open_lcd_device()
       
     return fd;  
 }  
+/* open_lcd_device() for KMS, the geometry goes into vinfo/finfo the same */
+int open_kms_device()
+{
+    if (kms_open(&kms, kms_path) < 0 || kms_alloc_dumb(&kms, FB_PAGES) < 0)
+        exit(EXIT_FAILURE);
+    lcd_fd = kms.fd;
+    vinfo.xres = kms.width;
+    vinfo.yres = kms.height;
+    vinfo.bits_per_pixel = 32;
+    finfo.line_length = kms.bufs[0].pitch;
+    fb_pages = kms.nr_bufs;
+    fb_page_size = finfo.line_length * vinfo.yres;
+    fb_front = 0;
+    fb_period_us = kms.period_us;
+    return lcd_fd;
+}
 int fb_wait_for_vsync(int lcd_fd)  
 {  
     int ret;  
-    unsigned long temp;  
-  
-    ret = ioctl(lcd_fd, FBIO_WAITFORVSYNC, &temp);  
-    if (ret < 0) {  
-        err("Wait for vsync failed");  
-        return -1;  
-    }  
+    __u32 crtc = 0;
+    uint64_t next;
+    struct timespec ts;
+  
+    if (!fb_soft_vsync) {
+        ret = ioctl(lcd_fd, FBIO_WAITFORVSYNC, &crtc);  
+        if (ret == 0)
+            return 0;
+        if (errno != ENOTTY && errno != EINVAL) {  
+            ERR("Wait for vsync failed: %s\n", ERRSTR);  
+            return -1;  
+        }  
+        printf("fb: no vsync interrupt, flipping every %u us\n",
+                fb_period_us);
+        fb_soft_vsync = 1;
+    }
+
+    next = (now_us() / fb_period_us + 1) * fb_period_us;
+    ts.tv_sec = next / 1000000;
+    ts.tv_nsec = next % 1000000 * 1000;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
     return 0;  
 }  
+
+/* every page but the one on screen is free */
+static void fb_init_queues(void)
+{
+    struct frame_desc d;
+    int i;
+
+    fq_init(&fb_show_q, fb_queue_depth, fb_queue_flags);
+    fq_init(&fb_free_q, FQ_MAX_DEPTH, 0);
+    CLEAR(d);
+    for (i = 1; i < fb_pages; i++) {
+        d.index = i;
+        fq_push(&fb_free_q, &d, NULL);
+    }
+}
+
+/* a page the cam thread may render into, waits out a flip if it must */
+static int fb_get_page(void)
+{
+    struct frame_desc d;
+
+    if (fb_pages == 1)
+        return 0;
+    if (fb_spare >= 0) {
+        d.index = fb_spare;
+        fb_spare = -1;
+        return d.index;
+    }
+    if (fq_pop(&fb_free_q, &d) == 0)
+        return d.index;
+    /* the display is behind, replace the oldest frame it hasn't taken */
+    if ((fb_queue_flags & FQ_F_LATEST) && fq_pop(&fb_show_q, &d) == 0) {
+        fb_show_q.dropped++;
+        return d.index;
+    }
+    fq_pop_wait(&fb_free_q, &d);
+    return d.index;
+}
+
+/* display thread: page is off screen */
+static void fb_put_page(int page)
+{
+    struct frame_desc d;
+
+    if (fimc_direct) {
+        fimc0_cap_qbuf(page);
+        return;
+    }
+    CLEAR(d);
+    d.index = page;
+    fq_push(&fb_free_q, &d, NULL);
+}
+
+/* page is rendered, flip to it on the next vsync */
+static void fb_queue_page(int page, unsigned int sequence,
+        uint64_t timestamp_us)
+{
+    struct frame_desc d, old;
+    int ret;
+
+    d.index = page;
+    d.sequence = sequence;
+    d.timestamp_us = timestamp_us;
+    d.queued_us = now_us();
+    CLEAR(old);
+    ret = fq_push(&fb_show_q, &d, &old);
+    if (ret == 0)
+        return;
+    /* a frame dropped, the new one or the oldest, the page comes back */
+    if (ret < 0)
+        old = d;
+    if (fimc_direct)
+        fimc0_cap_qbuf(old.index);
+    else
+        fb_spare = old.index;
+}
+
+static void present_print(void)
+{
+    struct present_stats *ps = &present.stats;
+
+    if (!ps->shown)
+        return;
+    printf("present: %u shown, %u late, %u dropped, %u repeats, delay "
+        "%lld+%u us, jitter %u us, glass to glass avg %llu max %u us\n",
+        ps->shown, ps->late, ps->dropped, ps->repeats,
+        (long long)present.base_us, present.margin_us, present.jitter_us,
+        (unsigned long long)(ps->glass_us / ps->shown), ps->max_glass_us);
+    ps->max_glass_us = 0;
+}
+
+/*
+ * Pan to page and wait for the vsync that puts it on screen, returns
+ * when that was. The pan is applied at once and FBIO_WAITFORVSYNC is the
+ * only wait: an FB_ACTIVATE_VBL pan already blocks for a vsync on some
+ * drivers, and waiting again after it would show every page a period
+ * late. A vsync interval of several refresh periods while the
+ * frame was already waiting is counted as missed vsyncs; the latency is
+ * from the frame being queued to it being shown.
+ */
+static uint64_t fb_flip(int page, uint64_t ready_us)
+{
+    struct fb_stats *st = &fb_stats;
+    unsigned int latency, periods;
+    uint64_t vsync;
+
+    if (use_kms) {
+        if (kms_flip(&kms, page, &vsync) < 0)
+            vsync = now_us();
+    } else {
+        if (fb_pages > 1) {
+            vinfo.xoffset = 0;
+            vinfo.yoffset = page * vinfo.yres;
+            vinfo.activate = FB_ACTIVATE_NOW;
+            if (ioctl(lcd_fd, FBIOPAN_DISPLAY, &vinfo) < 0)
+                ERR("fb: FBIOPAN_DISPLAY: %s\n", ERRSTR);
+        }
+        fb_wait_for_vsync(lcd_fd);
+        vsync = now_us();
+    }
+
+    st->flips++;
+    latency = vsync - ready_us;
+    st->latency_us += latency;
+    if (latency > st->max_latency_us)
+        st->max_latency_us = latency;
+    if (st->last_vsync_us && ready_us < st->last_vsync_us) {
+        periods = (vsync - st->last_vsync_us + fb_period_us / 2) /
+                fb_period_us;
+        if (periods > 1)
+            st->missed += periods - 1;
+    }
+    st->last_vsync_us = vsync;
+
+    if (vsync >= st->report_us) {
+        if (st->report_us)
+            printf("%s: %u flips, %u missed vsyncs, %u dropped, latency "
+                "avg %llu max %u us, queue %u/%u avg %.1f max %u, %d pages%s\n",
+                use_kms ? "kms" : "fb", st->flips, st->missed,
+                READ_ONCE(fb_show_q.dropped),
+                (unsigned long long)(st->latency_us / st->flips),
+                st->max_latency_us, fq_fill(&fb_show_q), fb_show_q.depth,
+                fb_show_q.pushed ? (double)READ_ONCE(fb_show_q.fill_sum) /
+                    READ_ONCE(fb_show_q.pushed) : 0.0,
+                READ_ONCE(fb_show_q.max_fill), fb_pages,
+                fb_soft_vsync ? ", soft vsync" : "");
+        if (st->report_us && !present_asap)
+            present_print();
+        st->max_latency_us = 0;
+        st->report_us = vsync + 1000000;
+    }
+    return vsync;
+}
 int cam_reqbufs()  
 {  
     struct v4l2_requestbuffers req;  
@@ -282,6 +589,39 @@ int cam_reqbufs()
     printf("%s: -\n", __func__);  
 }  
   
+/* scan FIMC0's capture buffers out instead of the dumb buffers */
+static int kms_import_fimc(void)
+{
+    struct v4l2_exportbuffer expbuf;
+    int n, ret;
+
+    kms_free_buffers(&kms);
+    for (n = 0; n < ReqButNum; n++) {
+        CLEAR(expbuf);
+        expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        expbuf.index = n;
+        expbuf.flags = O_CLOEXEC;
+        ret = ioctl(fimc0_fd, VIDIOC_EXPBUF, &expbuf);
+        if (ERR_ON(ret < 0, "fimc0: VIDIOC_EXPBUF: %s\n", ERRSTR))
+            break;
+        ret = kms_import(&kms, expbuf.fd, fimc0_cap_stride);
+        close(expbuf.fd);
+        if (ret < 0)
+            break;
+    }
+    if (n == ReqButNum) {
+        fb_pages = n;
+        printf("fimc0 capture buffers scanned out by kms\n");
+        return 0;
+    }
+
+    printf("kms: can't import fimc0 buffers, copying\n");
+    kms_free_buffers(&kms);
+    if (kms_alloc_dumb(&kms, FB_PAGES) < 0)
+        exit(EXIT_FAILURE);
+    return -1;
+}
+
 int fimc0_reqbufs()  
 {  
     int i = 0;  
@@ -380,6 +720,22 @@ int fimc0_reqbufs()
     CLEAR(plane);  
     CLEAR(b);  
   
+    /* 800x480 RGB32 can go straight into the pages, the front one aside */
+    if (!use_kms && fb_pages >= 3 && vinfo.yres == 480 &&
+            finfo.line_length == 800 * 4) {
+        rb.count = fb_pages;
+        rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        rb.memory = V4L2_MEMORY_USERPTR;
+        ret = ioctl(fimc0_fd, VIDIOC_REQBUFS, &rb);
+        if (ret == 0 && rb.count == fb_pages) {
+            fimc_direct = 1;
+            printf("%s - fimc0 capture into the framebuffer\n", __func__);
+            return 0;
+        }
+        printf("fimc0: no userptr capture, copying to the framebuffer\n");
+        CLEAR(rb);
+    }
+
     rb.count = ReqButNum;  
     rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;  
     rb.memory = V4L2_MEMORY_MMAP;  
@@ -414,6 +770,9 @@ int fimc0_reqbufs()
         fimc0_cap_buf_length = b.m.planes[0].length;  
         printf("fimc0 capture:plane.length:%d\n",fimc0_cap_buf_length);   
     }  
+    if (use_kms && kms.width == 800 && kms.height == 480 &&
+            kms_import_fimc() == 0)
+        fimc_direct = 1;
   
     printf("%s -\n", __func__);  
     return 0;  
@@ -559,13 +918,95 @@ int fimc0_setfmt()
     ret = ioctl(fimc0_fd, VIDIOC_S_FMT, &stream_fmt);  
     if (ERR_ON(ret < 0, "fimc0: VIDIOC_S_FMT: %s\n", ERRSTR))  
         return -errno;  
+    fimc0_cap_stride = pix_mp_f->plane_fmt[0].bytesperline ?
+            pix_mp_f->plane_fmt[0].bytesperline : 800 * 4;
       
     printf("%s -\n", __func__);  
   
 }  
+/* the camera's own userptr buffers, fimc0_reqbufs() does this with FIMC */
+int cam_alloc_bufs()
+{
+    unsigned int page_size = getpagesize();
+    int n;
+
+    n_buffer = ReqButNum;
+    fimc0_out_buf_length = (cam_stride * cam_height + page_size - 1) & ~(page_size - 1);
+    fimc0_out_buf = calloc(n_buffer, sizeof(BUFTYPE));
+    if (fimc0_out_buf == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (n = 0; n < n_buffer; ++n) {
+        fimc0_out_buf[n].start = memalign(page_size, fimc0_out_buf_length);
+        fimc0_out_buf[n].length = fimc0_out_buf_length;
+        if (fimc0_out_buf[n].start == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return 0;
+}
+
+int sw_setfmt()
+{
+    struct v4l2_format stream_fmt;
+    int ret;
+
+    CLEAR(stream_fmt);
+    stream_fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    ret = ioctl(cam_fd, VIDIOC_G_FMT, &stream_fmt);
+    if (ERR_ON(ret < 0, "cam: VIDIOC_G_FMT: %s\n", ERRSTR))
+        return -errno;
+    dump_format("cam_fd-capture", &stream_fmt);
+
+    cam_width = stream_fmt.fmt.pix.width;
+    cam_height = stream_fmt.fmt.pix.height;
+    cam_stride = stream_fmt.fmt.pix.bytesperline ?
+            stream_fmt.fmt.pix.bytesperline : cam_width * 2;
+    if (vinfo.bits_per_pixel != 32) {
+        ERR("sw: %u bpp framebuffer not supported\n", vinfo.bits_per_pixel);
+        return -1;
+    }
+    if (pixconv_init(&sw_conv, stream_fmt.fmt.pix.pixelformat,
+            PIXCONV_RGB32, PIXCONV_BT601, false, NULL) < 0) {
+        ERR("sw: can't convert from %.4s\n",
+            (char *)&stream_fmt.fmt.pix.pixelformat);
+        return -1;
+    }
+
+    sw_scale = cam_width != vinfo.xres || cam_height != vinfo.yres;
+    if (sw_scale) {
+        sw_rgb = malloc(cam_width * cam_height * 4);
+        if (!sw_rgb)
+            return -1;
+        copy_pool_init(&sw_pool, 2, copy_kernel_select(NULL)->fn,
+                sched_getcpu());
+        if (scaler_init(&sw_scaler, V4L2_PIX_FMT_XBGR32, cam_width,
+                cam_height, vinfo.xres, vinfo.yres, SCALER_BILINEAR,
+                NULL, &sw_pool) < 0) {
+            ERR("sw: can't scale %dx%d to %ux%u\n", cam_width,
+                cam_height, vinfo.xres, vinfo.yres);
+            return -1;
+        }
+    }
+    printf("sw: %dx%d %s -> %ux%u, %s + %s\n", cam_width, cam_height,
+        (char *)&stream_fmt.fmt.pix.pixelformat, vinfo.xres, vinfo.yres,
+        sw_conv.kernel->name, sw_scale ? sw_scaler.kernel->name : "no scaling");
+    return 0;
+}
+
 int init_device()  
 {  
     cam_setfmt();  
+    if (!use_fimc) {
+        if (sw_setfmt() < 0)
+            exit(EXIT_FAILURE);
+        cam_alloc_bufs();
+        cam_reqbufs();
+        cam_setrate();
+        return 0;
+    }
     fimc0_setfmt();  
     fimc0_reqbufs();  
   
@@ -603,6 +1044,16 @@ int start_capturing(int cam_fd)
         }  
     }  
   
+    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;  
+    if(-1 == ioctl(cam_fd,VIDIOC_STREAMON,&type))  
+    {  
+        printf("i = %d.\n",i);  
+        perror("cam_fd Fail to ioctl 'VIDIOC_STREAMON'");  
+        exit(EXIT_FAILURE);  
+    }  
+    if (!use_fimc)
+        return 0;
+
     CLEAR(plane);  
     CLEAR(b);  
     b.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;  
@@ -610,21 +1061,20 @@ int start_capturing(int cam_fd)
     b.index = 0;  
     b.m.planes = &plane;  
     b.length = 1;  
-    for(i = 0;i < n_buffer;i ++)  
+    /* every page but the one on screen */
+    for (i = 1; fimc_direct && i < fb_pages; i++)
+    {
+        ret = fimc0_cap_qbuf(i);
+        if (ret < 0)
+            return ret;
+    }
+    for(i = 0;!fimc_direct && i < n_buffer;i ++)  
     {  
         b.index = i;  
         ret = ioctl(fimc0_fd, VIDIOC_QBUF, &b);  
         if (ERR_ON(ret < 0, "fimc0: VIDIOC_QBUF: %s\n", ERRSTR))  
             return -errno;    
   
-    }  
-  
-    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;  
-    if(-1 == ioctl(cam_fd,VIDIOC_STREAMON,&type))  
-    {  
-        printf("i = %d.\n",i);  
-        perror("cam_fd Fail to ioctl 'VIDIOC_STREAMON'");  
-        exit(EXIT_FAILURE);  
     }  
       
             /* start processing */  
@@ -662,7 +1112,10 @@ int cam_cap_dbuf(int *index)
         exit(EXIT_FAILURE);  
     }  
     buffers[buf.index].bytesused = buf.bytesused;  
-    printf("%s,Line:%d,bytesused:%d\n",__func__, __LINE__, buf.bytesused);  
+    buffers[buf.index].sequence = buf.sequence;
+    buffers[buf.index].timestamp_us = buf.timestamp.tv_sec * 1000000ull +
+            buf.timestamp.tv_usec;
+//  printf("%s,Line:%d,bytesused:%d\n",__func__, __LINE__, buf.bytesused);  
     *index = buf.index;  
   
 //  printf("%s -\n", __func__);  
@@ -763,11 +1216,13 @@ int fimc0_cap_dbuf(int *index)
     struct v4l2_buffer b, buf;  
     struct v4l2_plane plane[3];  
     static int count = 0;  
+    uint64_t timestamp_us;
+    int page;
     /* enqueue buffer to fimc0 output */  
     CLEAR(plane);  
     CLEAR(b);  
     b.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;  
-    b.memory = V4L2_MEMORY_MMAP;  
+    b.memory = fimc_direct && !use_kms ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;  
 //  b.index = index;  
     b.m.planes = plane;  
     b.length = 1;  
@@ -779,11 +1234,19 @@ int fimc0_cap_dbuf(int *index)
     if (ERR_ON(ret < 0, "fimc0: VIDIOC_DQBUF: %s\n", ERRSTR))  
         return -errno;    
   
-    sem_post(&lcd_sem);  
-    fimc0_cap_index = b.index;  
+    timestamp_us = b.timestamp.tv_sec * 1000000ull + b.timestamp.tv_usec;
+    if (fimc_direct) {
+        fb_queue_page(b.index, b.sequence, timestamp_us);
+    } else {
+        page = fb_get_page();
+        memcpy(fb_page(page), fimc0_cap[b.index],
+            MIN(fb_page_size, fimc0_cap_buf_length));
+        fimc0_cap_qbuf(b.index);
+        fb_queue_page(page, b.sequence, timestamp_us);
+    }
     count ++;  
     //memcpy((void *)temp_buf, (void *)fimc0_cap[b.index], 800*480*4);  
-    printf("%s,%d\n",__func__, count);  
+//  printf("%s,%d\n",__func__, count);  
     return 0;  
 }  
 #if 0  
@@ -827,7 +1290,7 @@ int fimc0_cap_qbuf(int index)
     struct v4l2_plane plane;  
     static unsigned int count = 0;  
     //sleep(0);  
-    printf("%s +\n", __func__);  
+//  printf("%s +\n", __func__);  
         CLEAR(plane);  
     CLEAR(b);  
     b.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;  
@@ -835,27 +1298,33 @@ int fimc0_cap_qbuf(int index)
     b.m.planes = &plane;  
     b.length = 1;  
     b.index = index;  
+    if (fimc_direct && !use_kms) {
+        b.memory = V4L2_MEMORY_USERPTR;
+        plane.m.userptr = (unsigned long)fb_page(index);
+        plane.length = fb_page_size;
+    }
       
     ret = ioctl(fimc0_fd, VIDIOC_QBUF, &b);  
     if (ERR_ON(ret < 0, "fimc0: VIDIOC_QBUF: %s\n", ERRSTR))  
         return -errno;  
 //  printf("%s -\n", __func__);  
+    return 0;
 }  
 void process_cam_to_fimc0()  
 {  
     int index;  
-    printf("%s +\n", __func__);  
+//  printf("%s +\n", __func__);  
     cam_cap_dbuf(&index);  
     fimc0_out_qbuf(index);  
-    printf("%s -,index:%d\n",__func__, index);  
+//  printf("%s -,index:%d\n",__func__, index);  
 }  
 void process_fimc0_to_cam()  
 {  
     int index;  
-    printf("%s +\n", __func__);  
+//  printf("%s +\n", __func__);  
     fimc0_out_dbuf(&index);  
     cam_cap_qbuf(index);  
-    printf("%s -,index:%d\n",__func__, index);  
+//  printf("%s -,index:%d\n",__func__, index);  
 }  
   
 int process_fimc0_capture()  
@@ -879,7 +1348,7 @@ int process_fimc0_capture()
     if (ERR_ON(ret < 0, "fimc0: VIDIOC_DQBUF: %s\n", ERRSTR))  
         return -errno;  
     count ++;  
-    printf("%s,%d\n",__func__, count);  
+//  printf("%s,%d\n",__func__, count);  
   
     //memcpy((void *)fb_buf, (void *)fimc0_cap[b.index], 800*480*4);  
     //process_rgb32(fimc0_cap[b.index]);      
@@ -902,6 +1371,37 @@ int process_fimc0_capture()
   
 }  
   
+/* the FIMC0 job on the CPU: YUYV to RGB32, then to the framebuffer size */
+void process_cam_sw()
+{
+    const uint8_t *src[3] = { 0 };
+    unsigned int src_stride[3] = { 0 };
+    uint8_t *dst[3];
+    unsigned int dst_stride[3];
+    int index, page;
+    char *out;
+
+    cam_cap_dbuf(&index);
+    page = fb_get_page();
+    out = fb_page(page);
+    src[0] = fimc0_out_buf[index].start;
+    src_stride[0] = cam_stride;
+    if (!sw_scale) {
+        pixconv_frame(&sw_conv, (uint8_t *)out, finfo.line_length, src,
+            src_stride, cam_width, cam_height);
+    } else {
+        pixconv_frame(&sw_conv, (uint8_t *)sw_rgb, cam_width * 4, src,
+            src_stride, cam_width, cam_height);
+        src[0] = (uint8_t *)sw_rgb;
+        src_stride[0] = cam_width * 4;
+        dst[0] = (uint8_t *)out;
+        dst_stride[0] = finfo.line_length;
+        scaler_run(&sw_scaler, src, src_stride, dst, dst_stride);
+    }
+    cam_cap_qbuf(index);
+    fb_queue_page(page, buffers[index].sequence, buffers[index].timestamp_us);
+}
+
 int mainloop(int cam_fd)  
 {   
     int count = 1;//CapNum;  
@@ -924,7 +1424,7 @@ int mainloop(int cam_fd)
             fds[0].fd = cam_fd;  
   
             fds[1].events |= POLLIN | POLLPRI | POLLOUT;  
-            fds[1].fd = fimc0_fd;  
+            fds[1].fd = use_fimc ? fimc0_fd : -1;  
             //++nfds;  
               
             r = poll(fds, 2, -1);  
@@ -942,7 +1442,11 @@ int mainloop(int cam_fd)
                 exit(EXIT_FAILURE);  
             }  
   
-            if (fds[0].revents & POLLIN)  
+            if ((fds[0].revents & POLLIN) && !use_fimc)
+            {
+                process_cam_sw();
+            }
+            else if (fds[0].revents & POLLIN)  
             {  
                 process_cam_to_fimc0();  
                 gettimeofday(&end,NULL);  
@@ -989,7 +1493,9 @@ void uninit_camer_device()
             exit(EXIT_FAILURE);  
         }  
     }  
-    if (-1 == munmap(fb_buf, lcd_buf_size))   
+    if (use_kms)
+        kms_free_buffers(&kms);
+    else if (-1 == munmap(fb_buf, lcd_buf_size))   
     {            
         perror(" Error: framebuffer device munmap() failed.\n");            
         exit (EXIT_FAILURE) ;         
@@ -1019,26 +1525,151 @@ static void *cam_thread(void *pVoid)
 {  
     mainloop(cam_fd);  
 }  
+/* page is on screen, the old front page is off it now */
+static void fb_set_front(int page)
+{
+    int old;
+
+    if (page != fb_front) {
+        old = fb_front;
+        fb_front = page;
+        fb_put_page(old);
+    }
+}
+
+/*
+ * The jitter buffer: frames taken off fb_show_q, oldest first, waiting
+ * for their refresh. It holds at most fb_pages - 2 of them, one page is
+ * on screen and one has to be left for the cam thread, else it waits on
+ * fb_free_q for a page that only comes back after the next flip; frames
+ * beyond that stay on fb_show_q where the cam thread can take them back.
+ */
+static struct frame_desc present_buf[FQ_MAX_DEPTH];
+static int present_cnt;
+
+static int present_max(void)
+{
+    int n = fb_pages > 3 ? fb_pages - 2 : 1;
+
+    return n < FQ_MAX_DEPTH ? n : FQ_MAX_DEPTH;
+}
+
+static void present_take(struct frame_desc *d)
+{
+    present_arrive(&present, &d->timestamp_us, d->queued_us);
+    present_buf[present_cnt++] = *d;
+}
+
+static void present_pop(void)
+{
+    present_cnt--;
+    memmove(present_buf, present_buf + 1,
+        present_cnt * sizeof(present_buf[0]));
+}
+
+static void sleep_until_us(uint64_t t)
+{
+    struct timespec ts;
+
+    ts.tv_sec = t / 1000000;
+    ts.tv_nsec = t % 1000000 * 1000;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/*
+ * Show the oldest frame if it is due by the next refresh. It is dropped,
+ * and its page handed back right away, once the one after it is due by
+ * then too or belongs on the same refresh; with nothing due the front
+ * page stays up, which repeats it.
+ */
+static void display_present(void)
+{
+    struct frame_desc d;
+    uint64_t next, slot, vsync;
+
+    while (present_cnt < present_max() && fq_pop(&fb_show_q, &d) == 0)
+        present_take(&d);
+    if (!present_cnt) {
+        fq_pop_wait(&fb_show_q, &d);
+        present_take(&d);
+    }
+
+    next = present_vsync_after(&present, now_us());
+    while (present_cnt > 1) {
+        slot = present_slot(&present, present_buf[0].timestamp_us);
+        if (present_slot(&present, present_buf[1].timestamp_us) >
+                (slot > next ? slot : next))
+            break;
+        present_dropped(&present);
+        if (present_buf[0].index != fb_front)
+            fb_put_page(present_buf[0].index);
+        present_pop();
+    }
+
+    slot = present_slot(&present, present_buf[0].timestamp_us);
+    if (present.vsync_us && slot > next) {
+        /* flip half a refresh ahead, the flip waits for the vsync */
+        sleep_until_us(slot - present.period_us / 2);
+        return;
+    }
+
+    d = present_buf[0];
+    present_pop();
+    vsync = fb_flip(d.index, d.queued_us);
+    present_shown(&present, d.timestamp_us, d.queued_us, vsync);
+    fb_set_front(d.index);
+}
+
 static void *display_thread(void *pVoid)  
 {  
     static unsigned int count = 0;  
+    struct frame_desc d;
     printf("display_thread start\n");  
   
-    int num = 800*480*4;  
     while(1)  
     {  
-        sem_wait(&lcd_sem);  
+        if (!present_asap) {
+            display_present();
+            continue;
+        }
+        fq_pop_wait(&fb_show_q, &d);
         count ++;  
-        memcpy((void *)fb_buf, (void *)fimc0_cap[fimc0_cap_index], num);  
-        //fb_wait_for_vsync(lcd_fd);  
-        fimc0_cap_qbuf(fimc0_cap_index);  
+        fb_flip(d.index, d.queued_us);
+        fb_set_front(d.index);
     }  
 }  
-int main()  
+int main(int argc, char **argv)  
 {  
-    sem_init(&lcd_sem, 0, 0);  
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--sw"))
+            use_fimc = 0;
+        else if (!strcmp(argv[i], "--fb") && i + 1 < argc)
+            lcd_path = argv[++i];
+        else if (!strcmp(argv[i], "--kms")) {
+            use_kms = 1;
+            if (i + 1 < argc && strncmp(argv[i + 1], "--", 2))
+                kms_path = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--queue") && i + 1 < argc)
+            fb_queue_depth = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--fifo"))
+            fb_queue_flags &= ~FQ_F_LATEST;
+        else if (!strcmp(argv[i], "--asap"))
+            present_asap = 1;
+        else if (!strcmp(argv[i], "--smooth") && i + 1 < argc)
+            present_smooth = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--latency") && i + 1 < argc)
+            present_min_us = atoi(argv[++i]) * 1000;
+    }
     temp_buf =(char *)malloc(800*480*4);  
-    open_lcd_device();  
+    if (use_kms)
+        open_kms_device();
+    else
+        open_lcd_device();  
+    fb_init_queues();
+    present_init(&present, fb_period_us, present_smooth, present_min_us);
     open_camera_device();  
     init_device(lcd_fd, cam_fd);  
     start_capturing(cam_fd);  